@@ -8,540 +8,5346 @@
 
 #include "Parsley.h"
 #include "ParsleyErrors.h"
+#include "ParsleyWriter.h"
+#include <cctype>
 #include <fstream>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <unordered_map>
+#include <condition_variable>
+#include <exception>
+#include <thread>
 
-// FIXME: Re-write comments into file after parsing.
+#ifdef PARSLEY_WITH_ZLIB
+#include <zlib.h>
+#endif
 
-std::string strip(Str_cItr begin, Str_cItr end)
+#ifdef PARSLEY_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+namespace
+{
+    template <class S>
+    void appendUtf8(S& out, unsigned long code)
+    {
+        if (code < 0x80) out += static_cast<char>(code);
+        
+        else if (code < 0x800)
+        {
+            out += static_cast<char>(0xC0 | (code >> 6));
+            out += static_cast<char>(0x80 | (code & 0x3F));
+        }
+        
+        else if (code < 0x10000)
+        {
+            out += static_cast<char>(0xE0 | (code >> 12));
+            out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (code & 0x3F));
+        }
+        
+        else
+        {
+            out += static_cast<char>(0xF0 | (code >> 18));
+            out += static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+            out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (code & 0x3F));
+        }
+    }
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Decodes a single entity reference starting at the '&' at begin.
+    *
+    *   @return The position after the reference, or begin if it is not a
+    *           valid reference (in which case nothing is appended).
+    *
+    ****************************************************************************/
+    
+    template <class S>
+    const char* decodeEntity(const char* begin, const char* end, S& out)
+    {
+        const char* semi = static_cast<const char*>(std::memchr(begin, ';', std::min<std::ptrdiff_t>(end - begin, 12)));
+        
+        if (! semi) return begin;
+        
+        const char* name = begin + 1;
+        
+        std::size_t length = semi - name;
+        
+        if (length > 1 && *name == '#')
+        {
+            unsigned long code = 0;
+            
+            bool hex = name[1] == 'x' || name[1] == 'X';
+            
+            const char* digit = name + (hex ? 2 : 1);
+            
+            if (digit == semi) return begin;
+            
+            for ( ; digit != semi; ++digit)
+            {
+                int value;
+                
+                if (*digit >= '0' && *digit <= '9') value = *digit - '0';
+                else if (hex && *digit >= 'a' && *digit <= 'f') value = *digit - 'a' + 10;
+                else if (hex && *digit >= 'A' && *digit <= 'F') value = *digit - 'A' + 10;
+                else return begin;
+                
+                code = code * (hex ? 16 : 10) + value;
+            }
+            
+            if (code == 0 || code > 0x10FFFF || (code >= 0xD800 && code <= 0xDFFF))
+                return begin;
+            
+            appendUtf8(out, code);
+        }
+        
+        else if (length == 3 && std::equal(name, semi, "amp")) out += '&';
+        else if (length == 2 && std::equal(name, semi, "lt")) out += '<';
+        else if (length == 2 && std::equal(name, semi, "gt")) out += '>';
+        else if (length == 4 && std::equal(name, semi, "quot")) out += '"';
+        else if (length == 4 && std::equal(name, semi, "apos")) out += '\'';
+        else return begin;
+        
+        return semi + 1;
+    }
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Appends [begin, end) to out, replacing entity references.
+    *
+    *   @details Runs without a '&' are found with memchr and copied in bulk,
+    *            only references themselves take the slow path. Unknown or
+    *            malformed references are copied verbatim.
+    *
+    ****************************************************************************/
+    
+    template <class S>
+    void decodeEntities(const char* begin, const char* end, S& out)
+    {
+        while (begin != end)
+        {
+            const char* amp = static_cast<const char*>(std::memchr(begin, '&', end - begin));
+            
+            if (! amp)
+            {
+                out.append(begin, end);
+                
+                return;
+            }
+            
+            out.append(begin, amp);
+            
+            begin = decodeEntity(amp, end, out);
+            
+            // not a reference, keep the '&'
+            if (begin == amp) out += *begin++;
+        }
+    }
+    
+    template <class S>
+    void decodeEntities(Str_cItr begin, Str_cItr end, S& out)
+    {
+        if (begin != end) decodeEntities(&*begin, &*begin + (end - begin), out);
+    }
+    
+    /*! Appends [begin, end) to out, minus leading and trailing whitespace, decoding entities. */
+    template <class S>
+    void appendText(Str_cItr begin, Str_cItr end, S& out)
+    {
+        while (begin != end && ::isspace(*begin)) ++begin;
+        
+        while (end != begin && ::isspace(*(end - 1))) --end;
+        
+        decodeEntities(begin, end, out);
+    }
+    
+    const std::uint64_t onesMask = 0x0101010101010101ULL;
+    const std::uint64_t highMask = 0x8080808080808080ULL;
+    
+    /*! Sets the high bit of every byte of word that equals byte. */
+    inline std::uint64_t matchByte(std::uint64_t word, unsigned char byte)
+    {
+        std::uint64_t x = word ^ (onesMask * byte);
+        
+        return (x - onesMask) & ~x & highMask;
+    }
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Returns the first character in [begin, end) that must be escaped.
+    *
+    *   @details Checks eight bytes at a time with word-wide (SWAR) compares,
+    *            so long runs of plain text are skipped quickly on any CPU.
+    *
+    *   @param quote Whether '"' must be escaped too, as in attribute values.
+    *
+    ****************************************************************************/
+    
+    const char* findSpecial(const char* begin, const char* end, bool quote)
+    {
+        while (end - begin >= 8)
+        {
+            std::uint64_t word;
+            
+            std::memcpy(&word, begin, 8);
+            
+            std::uint64_t found = matchByte(word, '&') | matchByte(word, '<') | matchByte(word, '>');
+            
+            if (quote) found |= matchByte(word, '"');
+            
+            if (found) break;
+            
+            begin += 8;
+        }
+        
+        for ( ; begin != end; ++begin)
+        {
+            if (*begin == '&' || *begin == '<' || *begin == '>' || (quote && *begin == '"'))
+                break;
+        }
+        
+        return begin;
+    }
+    
+    /*! Appends [begin, end) to out, escaping markup characters. */
+    void escape(const char* begin, const char* end, std::string& out, bool quote)
+    {
+        while (begin != end)
+        {
+            const char* special = findSpecial(begin, end, quote);
+            
+            out.append(begin, special);
+            
+            if (special == end) return;
+            
+            switch (*special)
+            {
+                case '&': out += "&amp;"; break;
+                case '<': out += "&lt;"; break;
+                case '>': out += "&gt;"; break;
+                default: out += "&quot;"; break;
+            }
+            
+            begin = special + 1;
+        }
+    }
+    
+    void escape(const ParsleyNode::String& str, std::string& out, bool quote)
+    {
+        escape(str.data(), str.data() + str.size(), out, quote);
+    }
+}
+
+Str_cItr skipSpace(Str_cItr begin, Str_cItr end)
 {
     while (begin != end && ::isspace(*begin)) ++begin;
     
-    while (end != begin && ( ::isspace(*end) || *end == '\0' )) --end;
+    return begin;
+}
+
+namespace
+{
+    /*! Like std::find, but with memchr's vectorized scan. */
+    Str_cItr findChar(Str_cItr begin, Str_cItr end, char c)
+    {
+        if (begin == end) return end;
+        
+        const char* p = static_cast<const char*>(std::memchr(&*begin, c, end - begin));
+        
+        return p ? begin + (p - &*begin) : end;
+    }
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Finds the end of a terminator like "-->" in [begin, end).
+    *
+    *   @details Scans for the terminator's last character, which is rare
+    *            inside comments and CDATA, with memchr and only then checks
+    *            the characters before it.
+    *
+    *   @return The position just after the terminator, or end.
+    *
+    ****************************************************************************/
+    
+    Str_cItr findTerminator(Str_cItr begin, Str_cItr end, const char* terminator, std::size_t length)
+    {
+        if (static_cast<std::size_t>(end - begin) < length) return end;
+        
+        Str_cItr i = begin + (length - 1);
+        
+        while (i < end)
+        {
+            i = findChar(i, end, terminator[length - 1]);
+            
+            if (i == end) break;
+            
+            if (i - begin >= static_cast<std::ptrdiff_t>(length - 1) &&
+                std::equal(i - (length - 1), i, terminator))
+                return i + 1;
+            
+            ++i;
+        }
+        
+        return end;
+    }
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Finds the '>' that ends a tag starting in [begin, end).
+    *
+    *   @details Attribute values may contain '>', so a '>' only ends the
+    *            tag if no quote is open before it. Each '>' is found with
+    *            memchr and the stretch before it checked for a quote; after
+    *            a quote, the scan restarts past its closing counterpart.
+    *
+    *   @param resume If not null and no '>' is found, set to where a later
+    *                 search, with more of the tag available, can pick up.
+    *
+    *   @return The position of the '>', or end.
+    *
+    ****************************************************************************/
+    
+    Str_cItr findTagEnd(Str_cItr begin, Str_cItr end, Str_cItr* resume = 0)
+    {
+        while (true)
+        {
+            Str_cItr close = findChar(begin, end, '>');
+            
+            Str_cItr quote = std::min(findChar(begin, close, '"'), findChar(begin, close, '\''));
+            
+            if (quote == close)
+            {
+                if (resume) *resume = close;
+                
+                return close;
+            }
+            
+            // skip the quoted value, whatever it contains
+            Str_cItr quoteEnd = findChar(quote + 1, end, *quote);
+            
+            if (quoteEnd == end)
+            {
+                if (resume) *resume = quote;
+                
+                return end;
+            }
+            
+            begin = quoteEnd + 1;
+        }
+    }
+    
+    bool startsWith(Str_cItr begin, Str_cItr end, const char* prefix, std::size_t length)
+    {
+        return static_cast<std::size_t>(end - begin) >= length && std::equal(prefix, prefix + length, begin);
+    }
+}
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+    
+    double secondsSince(const Clock::time_point& start)
+    {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+    
+    std::string toStdString(const ParsleyNode::String& str)
+    {
+        return std::string(str.begin(), str.end());
+    }
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Sits in front of every ParsleyNode so that operator delete
+    *          knows which resource to return the node's memory to.
+    *
+    ****************************************************************************/
+    
+    struct NodeHeader
+    {
+        ParsleyMemoryResource* resource;
+        
+        std::size_t size;
+    };
+    
+    // keep the node itself maximally aligned
+    const std::size_t nodeHeaderSize = (sizeof(NodeHeader) + alignof(std::max_align_t) - 1)
+                                       / alignof(std::max_align_t) * alignof(std::max_align_t);
     
-    return std::string(begin,++end);
+    class NewDeleteResource : public ParsleyMemoryResource
+    {
+        
+    protected:
+        
+        virtual void* doAllocate(std::size_t bytes, std::size_t)
+        { return ::operator new(bytes); }
+        
+        virtual void doDeallocate(void* ptr, std::size_t, std::size_t)
+        { ::operator delete(ptr); }
+        
+        virtual bool doIsEqual(const ParsleyMemoryResource& other) const
+        { return dynamic_cast<const NewDeleteResource*>(&other) != 0; }
+    };
 }
 
-std::string splitOne(Str_cItr begin, Str_cItr end)
+/*************************************************************************//*!
+*
+*   @brief The state shared by all nodes of a lazily parsed document.
+*
+*   @details Holds the document's contents, its tokens and, for every start
+*            tag, the index of the matching end tag, as well as a copy of
+*            the parser (and thereby its settings) to parse nodes with.
+*            For the instances of a ParsleyTemplate it instead holds the
+*            template's tree, from which their nodes copy what they need.
+*
+****************************************************************************/
+
+struct ParsleyLazyDocument
 {
-    Str_cItr i,j;
+    Parsley parser;
+    
+    std::string buffer;
     
-    i = std::find_if_not(begin, end, ::isspace);
+    Parsley::TokenVec tokens;
     
-    j = std::find_if(i, end, ::isspace);
+    /*! For every start tag, the index of its end tag (itself if self-closing). */
+    std::vector<std::size_t> match;
+    
+    /*! The frozen tree of a ParsleyTemplate. */
+    ParsleyNode::NodePtr source;
+};
+
+thread_local std::size_t* ParsleyMemoryResource::_counter = 0;
+
+ParsleyMemoryResource* ParsleyMemoryResource::getDefault()
+{
+    static NewDeleteResource resource;
     
-    return std::string(i,j);
+    return &resource;
 }
 
-std::string condense(Str_cItr begin, Str_cItr end)
+void* ParsleyBudgetResource::doAllocate(std::size_t bytes, std::size_t align)
 {
-    std::string s(begin,end);
+    std::size_t inUse = _inUse.fetch_add(bytes) + bytes;
     
-    s.erase(std::remove_if(s.begin(), s.end(), ::isspace),s.end());
+    if (inUse > _budget || inUse < bytes)
+    {
+        _inUse -= bytes;
+        
+        throw MemoryLimitError();
+    }
     
-    return s;
+    void* ptr;
+    
+    try { ptr = _upstream->allocate(bytes, align); }
+    
+    catch (...)
+    {
+        _inUse -= bytes;
+        
+        throw;
+    }
+    
+    ++_allocations;
+    
+    std::size_t peak = _peak;
+    
+    while (inUse > peak && ! _peak.compare_exchange_weak(peak, inUse));
+    
+    return ptr;
+}
+
+void ParsleyBudgetResource::doDeallocate(void* ptr, std::size_t bytes, std::size_t align)
+{
+    _upstream->deallocate(ptr, bytes, align);
+    
+    _inUse -= bytes;
+}
+
+void ParsleyBudgetResource::doCharge(std::size_t bytes)
+{
+    std::size_t inUse = _inUse.fetch_add(bytes) + bytes;
+    
+    if (inUse > _budget || inUse < bytes)
+    {
+        _inUse -= bytes;
+        
+        throw MemoryLimitError();
+    }
+    
+    try { _upstream->charge(bytes); }
+    
+    catch (...)
+    {
+        _inUse -= bytes;
+        
+        throw;
+    }
+    
+    std::size_t peak = _peak;
+    
+    while (inUse > peak && ! _peak.compare_exchange_weak(peak, inUse));
 }
 
-ParsleyNode * Parsley::parse(const std::string& fname)
+void* ParsleyArenaResource::doAllocate(std::size_t bytes, std::size_t align)
 {
-    std::ifstream file(fname);
+    std::size_t padding = (align - reinterpret_cast<std::uintptr_t>(_current) % align) % align;
     
-    if (! file.good() || ! file.is_open())
-        throw FileOpenError();
+    if (! _current || padding + bytes > _left)
+    {
+        // large requests get a block of their own size
+        std::size_t size = std::max(_nextBlockSize, bytes + align);
+        
+        Block block = { _upstream->allocate(size), size };
+        
+        _blocks.push_back(block);
+        
+        _current = static_cast<char*>(block.memory);
+        _left = size;
+        _reserved += size;
+        
+        _nextBlockSize *= 2;
+        
+        padding = (align - reinterpret_cast<std::uintptr_t>(_current) % align) % align;
+    }
     
-    StrVec vec;
-    std::string s,str;
+    char* ptr = _current + padding;
     
-    // grab first line to see if it has a header
-    getline(file, s,'>');
+    _current = ptr + bytes;
+    _left -= padding + bytes;
     
-    // go back in file
-    file.unget();
+    return ptr;
+}
+
+void ParsleyArenaResource::release()
+{
+    for (std::vector<Block>::const_iterator itr = _blocks.begin(), end = _blocks.end();
+         itr != end;
+         ++itr)
+    { _upstream->deallocate(itr->memory, itr->size); }
     
-    // get a char
-    s += file.get();
+    _blocks.clear();
     
-    // see if it is an XML header
-    bool hasHeader = _isHeader(s.begin() + 1, s.end() - 1);
+    _current = 0;
+    _left = 0;
+    _reserved = 0;
+}
+
+void ParseError::locate(const char* begin, std::size_t size)
+{
+    if (_offset > size || _line) return;
     
-    if (!hasHeader) str += s;
+    const char* position = begin + _offset;
     
-    while (getline(file,s)) str += s;
+    const char* lineBegin = position;
     
-    vec = _parse(str.begin(), str.end());
+    while (lineBegin != begin && *(lineBegin - 1) != '\n') --lineBegin;
     
-    // _makeNodeTree needs a parent to be passed
-    // for the recursion to work, so pass this
-    // "pseudo-parent"
-    ParsleyNode* pseudo = new ParsleyNode;
+    // count characters, not UTF-8 continuation bytes
+    std::size_t column = std::count_if(lineBegin, position, [] (char c) { return (c & 0xC0) != 0x80; }) + 1;
     
-    _makeNodeTree(vec.begin(), vec.end(),pseudo);
+    _place(begin, size, lineBegin, std::count(begin, lineBegin, '\n') + 1, column);
+}
+
+void ParseError::locate(std::vector<ParseError>& errors, const char* begin, std::size_t size)
+{
+    std::vector<ParseError*> order;
     
-    // the root is then the first child of this pseudo-parent
-    ParsleyNode* ret = pseudo->firstChild;
+    for (std::size_t n = 0; n < errors.size(); ++n)
+    {
+        if (errors[n]._offset <= size && ! errors[n]._line)
+            order.push_back(&errors[n]);
+    }
     
-    // remove pseudo-parent
-    pseudo->firstChild = pseudo->lastChild = 0;
-    delete pseudo;
+    std::stable_sort(order.begin(), order.end(),
+                     [] (const ParseError* a, const ParseError* b) { return a->_offset < b->_offset; });
     
-    return ret;
+    // carry the line and column on from one error to the next
+    const char* counted = begin;
+    const char* lineBegin = begin;
+    
+    std::size_t line = 1;
+    std::size_t column = 1;
+    
+    for (std::size_t n = 0; n < order.size(); ++n)
+    {
+        const char* position = begin + order[n]->_offset;
+        
+        while (const char* newline = static_cast<const char*>(std::memchr(counted, '\n', position - counted)))
+        {
+            ++line;
+            column = 1;
+            
+            lineBegin = counted = newline + 1;
+        }
+        
+        column += std::count_if(counted, position, [] (char c) { return (c & 0xC0) != 0x80; });
+        
+        counted = position;
+        
+        order[n]->_place(begin, size, lineBegin, line, column);
+    }
 }
 
-bool Parsley::_isHeader(Str_cItr begin, Str_cItr end)
+void ParseError::_place(const char* begin, std::size_t size,
+                        const char* lineBegin, std::size_t line, std::size_t column)
 {
-    std::string s = condense(begin, end);
+    const char* position = begin + _offset;
+    const char* end = begin + size;
     
-    return *(s.begin()) == '?' && *(s.end() - 1) == '?' && s.substr(1,3) == "xml";
+    _line = line;
+    _column = column;
+    
+    // look no further than the excerpt can reach, which
+    // keeps errors on one very long line cheap to place
+    const char* limit = end - position > 44 ? position + 44 : end;
+    
+    const char* lineEnd = static_cast<const char*>(std::memchr(position, '\n', limit - position));
+    
+    if (! lineEnd) lineEnd = limit;
+    
+    // up to 40 bytes either side, not splitting characters
+    const char* excerptBegin = position - lineBegin > 40 ? position - 40 : lineBegin;
+    const char* excerptEnd = lineEnd - position > 40 ? position + 40 : lineEnd;
+    
+    while (excerptBegin != lineBegin && (*excerptBegin & 0xC0) == 0x80) --excerptBegin;
+    while (excerptEnd != lineEnd && (*excerptEnd & 0xC0) == 0x80) ++excerptEnd;
+    
+    _excerpt.assign(excerptBegin, excerptEnd);
+    
+    std::replace_if(_excerpt.begin(), _excerpt.end(), [] (char c) { return c == '\t' || c == '\r'; }, ' ');
+    
+    _what = _message + " (at line " + std::to_string(_line) +
+            ", column " + std::to_string(_column) +
+            ", byte offset " + std::to_string(_offset) + ") near \"" + _excerpt + "\"";
 }
 
-template <class T>
-T Parsley::_lastNonSpace(T begin, T end)
+void* ParsleyNode::operator new(std::size_t size, ParsleyMemoryResource* resource)
 {
-    return (condense(begin, end)).end();
+    char* mem = static_cast<char*>(resource->allocate(nodeHeaderSize + size));
+    
+    NodeHeader* header = reinterpret_cast<NodeHeader*>(mem);
+    
+    header->resource = resource;
+    header->size = nodeHeaderSize + size;
+    
+    return mem + nodeHeaderSize;
 }
 
-std::string ParsleyNode::getAttr(const std::string& attrKey)
+void ParsleyNode::operator delete(void* ptr)
+{
+    if (! ptr) return;
+    
+    char* mem = static_cast<char*>(ptr) - nodeHeaderSize;
+    
+    NodeHeader* header = reinterpret_cast<NodeHeader*>(mem);
+    
+    header->resource->deallocate(mem, header->size);
+}
+
+namespace
+{
+    struct NameTable
+    {
+        std::mutex mutex;
+        
+        std::unordered_map<std::string, ParsleyNames::Id> ids;
+        
+        // a deque, so references handed out stay valid
+        std::deque<std::string> names;
+        
+        NameTable()
+        {
+            names.push_back(std::string());
+            
+            ids.emplace(std::string(), ParsleyNames::None);
+        }
+    };
+    
+    NameTable& nameTable()
+    {
+        static NameTable table;
+        
+        return table;
+    }
+    
+    const ParsleyNames::Id xmlPrefix = ParsleyNames::intern("xml", 3);
+    const ParsleyNames::Id xmlnsPrefix = ParsleyNames::intern("xmlns", 5);
+    
+    const ParsleyNames::Id xmlNamespace = ParsleyNames::intern("http://www.w3.org/XML/1998/namespace");
+    const ParsleyNames::Id xmlnsNamespace = ParsleyNames::intern("http://www.w3.org/2000/xmlns/");
+    
+    /*! How many names a Parsley keeps at hand before starting over. */
+    const std::size_t nameCacheSize = 4096;
+    
+    ParsleyNames::Id internName(const char* name, std::size_t length)
+    {
+        return ParsleyNames::intern(name, length);
+    }
+    
+    /*! Splits a qualified name at its first ':' into interned prefix and local name. */
+    template <class S, class Intern>
+    void splitName(const S& name, ParsleyNames::Id& prefix, ParsleyNames::Id& local, const Intern& intern)
+    {
+        const char* begin = name.data();
+        
+        const char* colon = static_cast<const char*>(std::memchr(begin, ':', name.size()));
+        
+        if (colon)
+        {
+            prefix = intern(begin, colon - begin);
+            local = intern(colon + 1, name.size() - (colon + 1 - begin));
+        }
+        
+        else
+        {
+            prefix = ParsleyNames::None;
+            local = intern(begin, name.size());
+        }
+    }
+}
+
+const ParsleyNames::Id ParsleyNames::None;
+
+const ParsleyNames::Id ParsleyNames::Unknown;
+
+const unsigned int ParsleyNode::AnyDepth;
+
+const std::size_t ParsleyBinding::_empty;
+
+ParsleyNames::Id ParsleyNames::intern(const char* name, std::size_t length, ParsleyMemoryResource* charge)
+{
+    NameTable& table = nameTable();
+    
+    std::string key(name, length);
+    
+    std::lock_guard<std::mutex> lock(table.mutex);
+    
+    std::unordered_map<std::string, Id>::const_iterator itr = table.ids.find(key);
+    
+    if (itr != table.ids.end()) return itr->second;
+    
+    // the name is kept twice, in the map and in the deque,
+    // and the map adds a node with a hash and a link
+    if (charge) charge->charge(2 * (sizeof(std::string) + length + 1) + 4 * sizeof(void*));
+    
+    Id id = static_cast<Id>(table.names.size());
+    
+    table.names.push_back(key);
+    
+    table.ids.emplace(std::move(key), id);
+    
+    return id;
+}
+
+ParsleyNames::Id ParsleyNames::find(const char* name, std::size_t length)
+{
+    NameTable& table = nameTable();
+    
+    std::string key(name, length);
+    
+    std::lock_guard<std::mutex> lock(table.mutex);
+    
+    std::unordered_map<std::string, Id>::const_iterator itr = table.ids.find(key);
+    
+    return itr != table.ids.end() ? itr->second : Unknown;
+}
+
+const std::string& ParsleyNames::getName(Id id)
+{
+    NameTable& table = nameTable();
+    
+    std::lock_guard<std::mutex> lock(table.mutex);
+    
+    return table.names.at(id);
+}
+
+ParsleyNode* ParsleyNode::createComment(const std::string& text, ParsleyMemoryResource* resource)
+{
+    ParsleyNode* node = new (resource) ParsleyNode(resource);
+    
+    node->type = CommentNode;
+    node->isClosed = true;
+    node->data.assign(text.begin(), text.end());
+    
+    return node;
+}
+
+ParsleyNode* ParsleyNode::createInstruction(const std::string& target,
+                                            const std::string& data,
+                                            ParsleyMemoryResource* resource)
+{
+    ParsleyNode* node = new (resource) ParsleyNode(target, resource);
+    
+    node->type = InstructionNode;
+    node->isClosed = true;
+    node->data.assign(data.begin(), data.end());
+    
+    return node;
+}
+
+std::string condense(Str_cItr begin, Str_cItr end)
+{
+    std::string s(begin,end);
+    
+    s.erase(std::remove_if(s.begin(), s.end(), ::isspace),s.end());
+    
+    return s;
+}
+
+namespace
+{
+    enum Encoding
+    {
+        Utf8,
+        Utf16LE,
+        Utf16BE,
+        Latin1
+    };
+    
+    /*! Whether any byte of word has its high bit set, i.e. is not ASCII. */
+    inline bool hasHighBit(std::uint64_t word)
+    {
+        return (word & highMask) != 0;
+    }
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Returns the first byte in [begin, end) that is not valid UTF-8.
+    *
+    *   @details ASCII is skipped eight bytes at a time with word-wide
+    *            (SWAR) checks, only multi-byte sequences are decoded one by
+    *            one. Overlong forms, surrogates and code points above
+    *            U+10FFFF are rejected, as are sequences cut off by end.
+    *
+    *   @return The position of the first invalid byte, or end.
+    *
+    ****************************************************************************/
+    
+    const char* findInvalidUtf8(const char* begin, const char* end)
+    {
+        const unsigned char* i = reinterpret_cast<const unsigned char*>(begin);
+        const unsigned char* last = reinterpret_cast<const unsigned char*>(end);
+        
+        while (i != last)
+        {
+            if (last - i >= 32)
+            {
+                std::uint64_t words[4];
+                
+                std::memcpy(words, i, 32);
+                
+                if (! hasHighBit(words[0] | words[1] | words[2] | words[3]))
+                {
+                    i += 32;
+                    
+                    continue;
+                }
+            }
+            
+            if (last - i >= 8)
+            {
+                std::uint64_t word;
+                
+                std::memcpy(&word, i, 8);
+                
+                if (! hasHighBit(word))
+                {
+                    i += 8;
+                    
+                    continue;
+                }
+            }
+            
+            if (*i < 0x80)
+            {
+                ++i;
+                
+                continue;
+            }
+            
+            // the allowed range of the second byte and the
+            // number of continuation bytes after the first
+            unsigned char low = 0x80, high = 0xBF;
+            
+            std::ptrdiff_t length;
+            
+            if (*i >= 0xC2 && *i <= 0xDF) length = 1;
+            
+            else if (*i >= 0xE0 && *i <= 0xEF)
+            {
+                length = 2;
+                
+                if (*i == 0xE0) low = 0xA0;         // overlong
+                else if (*i == 0xED) high = 0x9F;   // surrogates
+            }
+            
+            else if (*i >= 0xF0 && *i <= 0xF4)
+            {
+                length = 3;
+                
+                if (*i == 0xF0) low = 0x90;         // overlong
+                else if (*i == 0xF4) high = 0x8F;   // above U+10FFFF
+            }
+            
+            else return reinterpret_cast<const char*>(i);
+            
+            if (last - i <= length || i[1] < low || i[1] > high)
+                return reinterpret_cast<const char*>(i);
+            
+            for (std::ptrdiff_t n = 2; n <= length; ++n)
+            {
+                if ((i[n] & 0xC0) != 0x80) return reinterpret_cast<const char*>(i);
+            }
+            
+            i += length + 1;
+        }
+        
+        return end;
+    }
+    
+    /*! Case-insensitively compares the encoding name [begin, end) with name. */
+    bool encodingIs(const char* begin, const char* end, const char* name)
+    {
+        std::size_t length = std::strlen(name);
+        
+        if (static_cast<std::size_t>(end - begin) != length) return false;
+        
+        for ( ; begin != end; ++begin, ++name)
+        {
+            if (::toupper(static_cast<unsigned char>(*begin)) != *name) return false;
+        }
+        
+        return true;
+    }
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Determines the encoding of a document.
+    *
+    *   @details Looks for a byte order mark first, then for a UTF-16 encoded
+    *            "<?", and finally at the encoding declared in the XML header.
+    *            Documents without either are taken to be UTF-8.
+    *
+    *   @param skip Set to the length of the byte order mark, if any.
+    *
+    *   @throws EncodingError if the encoding is not supported.
+    *
+    ****************************************************************************/
+    
+    Encoding detectEncoding(const std::string& str, std::size_t& skip)
+    {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(str.data());
+        
+        std::size_t size = str.size();
+        
+        skip = 0;
+        
+        if (size >= 4 && ((bytes[0] == 0xFF && bytes[1] == 0xFE && bytes[2] == 0 && bytes[3] == 0) ||
+                          (bytes[0] == 0 && bytes[1] == 0 && bytes[2] == 0xFE && bytes[3] == 0xFF)))
+            throw EncodingError("Unsupported encoding: UTF-32", 0);
+        
+        if (size >= 3 && bytes[0] == 0xEF && bytes[1] == 0xBB && bytes[2] == 0xBF)
+        {
+            skip = 3;
+            
+            return Utf8;
+        }
+        
+        if (size >= 2 && bytes[0] == 0xFF && bytes[1] == 0xFE)
+        {
+            skip = 2;
+            
+            return Utf16LE;
+        }
+        
+        if (size >= 2 && bytes[0] == 0xFE && bytes[1] == 0xFF)
+        {
+            skip = 2;
+            
+            return Utf16BE;
+        }
+        
+        if (size >= 4 && bytes[0] == '<' && bytes[1] == 0 && bytes[2] == '?' && bytes[3] == 0)
+            return Utf16LE;
+        
+        if (size >= 4 && bytes[0] == 0 && bytes[1] == '<' && bytes[2] == 0 && bytes[3] == '?')
+            return Utf16BE;
+        
+        // otherwise the header, if any, is ASCII
+        if (size < 5 || str.compare(0, 5, "<?xml") != 0) return Utf8;
+        
+        const char* begin = str.data();
+        const char* end = static_cast<const char*>(std::memchr(begin, '>', size));
+        
+        if (! end) return Utf8;
+        
+        const char* attr = std::search(begin, end, "encoding", "encoding" + 8);
+        
+        if (attr == end) return Utf8;
+        
+        const char* quote = std::find_if(attr + 8, end, [] (char c) { return c == '"' || c == '\''; });
+        
+        if (quote == end) return Utf8;
+        
+        const char* valueBegin = quote + 1;
+        const char* valueEnd = std::find(valueBegin, end, *quote);
+        
+        if (encodingIs(valueBegin, valueEnd, "UTF-8") ||
+            encodingIs(valueBegin, valueEnd, "US-ASCII") ||
+            encodingIs(valueBegin, valueEnd, "ASCII"))
+            return Utf8;
+        
+        if (encodingIs(valueBegin, valueEnd, "ISO-8859-1") ||
+            encodingIs(valueBegin, valueEnd, "ISO_8859-1") ||
+            encodingIs(valueBegin, valueEnd, "LATIN1") ||
+            encodingIs(valueBegin, valueEnd, "LATIN-1"))
+            return Latin1;
+        
+        throw EncodingError("Unsupported encoding: " + std::string(valueBegin, valueEnd), valueBegin - begin);
+    }
+    
+    /*! Lets appendUtf8() write into a buffer that is known to be large enough. */
+    struct Writer
+    {
+        char* out;
+        
+        Writer& operator+=(char c)
+        {
+            *out++ = c;
+            
+            return *this;
+        }
+    };
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Transcodes UTF-16 to UTF-8.
+    *
+    *   @details Runs of ASCII are converted four code units at a time.
+    *
+    *   @param bigEndian Whether the input is UTF-16BE rather than UTF-16LE.
+    *
+    *   @param offset The offset of begin in the file, for error messages.
+    *
+    *   @throws EncodingError for unpaired surrogates or an odd number of bytes.
+    *
+    ****************************************************************************/
+    
+    std::string utf16ToUtf8(const char* begin, const char* end, bool bigEndian, std::size_t offset)
+    {
+        if ((end - begin) % 2)
+            throw EncodingError("Truncated UTF-16 code unit!", offset + (end - begin) - 1);
+        
+        const unsigned char* i = reinterpret_cast<const unsigned char*>(begin);
+        const unsigned char* last = reinterpret_cast<const unsigned char*>(end);
+        
+        // any code unit takes at most three bytes, a pair four
+        std::string str((last - i) / 2 * 3, '\0');
+        
+        char* out = &str[0];
+        
+        // high bytes zero and low bytes below 0x80
+        const std::uint64_t asciiMask = bigEndian ? 0x80FF80FF80FF80FFULL : 0xFF80FF80FF80FF80ULL;
+        
+        while (i != last)
+        {
+            if (last - i >= 8)
+            {
+                std::uint64_t word;
+                
+                std::memcpy(&word, i, 8);
+                
+                if (! (word & asciiMask))
+                {
+                    for (int n = bigEndian ? 1 : 0; n < 8; n += 2) *out++ = static_cast<char>(i[n]);
+                    
+                    i += 8;
+                    
+                    continue;
+                }
+            }
+            
+            unsigned long code = bigEndian ? (i[0] << 8) | i[1] : (i[1] << 8) | i[0];
+            
+            std::size_t position = offset + (reinterpret_cast<const char*>(i) - begin);
+            
+            i += 2;
+            
+            if (code >= 0xD800 && code <= 0xDBFF)
+            {
+                unsigned long low = 0;
+                
+                if (i != last) low = bigEndian ? (i[0] << 8) | i[1] : (i[1] << 8) | i[0];
+                
+                if (low < 0xDC00 || low > 0xDFFF)
+                    throw EncodingError("Unpaired UTF-16 surrogate!", position);
+                
+                code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                
+                i += 2;
+            }
+            
+            else if (code >= 0xDC00 && code <= 0xDFFF)
+                throw EncodingError("Unpaired UTF-16 surrogate!", position);
+            
+            Writer writer = { out };
+            
+            appendUtf8(writer, code);
+            
+            out = writer.out;
+        }
+        
+        str.resize(out - str.data());
+        
+        return str;
+    }
+    
+    /*! Transcodes Latin-1 to UTF-8, copying runs of ASCII eight bytes at a time. */
+    std::string latin1ToUtf8(const char* begin, const char* end)
+    {
+        std::string str((end - begin) * 2, '\0');
+        
+        char* out = &str[0];
+        
+        while (begin != end)
+        {
+            if (end - begin >= 8)
+            {
+                std::uint64_t word;
+                
+                std::memcpy(&word, begin, 8);
+                
+                if (! hasHighBit(word))
+                {
+                    std::memcpy(out, begin, 8);
+                    
+                    out += 8;
+                    begin += 8;
+                    
+                    continue;
+                }
+            }
+            
+            unsigned char c = static_cast<unsigned char>(*begin++);
+            
+            if (c < 0x80) *out++ = static_cast<char>(c);
+            
+            else
+            {
+                *out++ = static_cast<char>(0xC0 | (c >> 6));
+                *out++ = static_cast<char>(0x80 | (c & 0x3F));
+            }
+        }
+        
+        str.resize(out - str.data());
+        
+        return str;
+    }
+}
+
+namespace
+{
+    enum Compression
+    {
+        Uncompressed,
+        Gzip,
+        Zstd
+    };
+    
+    Compression detectCompression(const char* magic, std::size_t size)
+    {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(magic);
+        
+        if (size >= 2 && bytes[0] == 0x1F && bytes[1] == 0x8B) return Gzip;
+        
+        if (size >= 4 && bytes[0] == 0x28 && bytes[1] == 0xB5 && bytes[2] == 0x2F && bytes[3] == 0xFD) return Zstd;
+        
+        return Uncompressed;
+    }
+    
+    /*! Size of the parts a document is read or decompressed in. */
+    const std::size_t chunkSize = 256 * 1024;
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Runs a producer on its own thread, handing its output over
+    *          through a bounded queue of buffers.
+    *
+    *   @details The producer fills one buffer per call and returns false
+    *            after the last one. At most depth buffers wait in the queue,
+    *            so the producer runs at most that far ahead of the consumer.
+    *            Buffers are recycled, so their memory is reused. Exceptions
+    *            thrown by the producer are rethrown by pop().
+    *
+    ****************************************************************************/
+    
+    class ChunkPipe
+    {
+        
+    public:
+        
+        typedef std::function<bool(std::string&)> Producer;
+        
+        explicit ChunkPipe(Producer producer, std::size_t depth = 4)
+        : _producer(std::move(producer)), _depth(depth), _done(false), _cancelled(false)
+        {
+            _thread = std::thread(&ChunkPipe::_run, this);
+        }
+        
+        /*! Stops the producer, if it is still running, and waits for it. */
+        ~ChunkPipe()
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                
+                _cancelled = true;
+            }
+            
+            _space.notify_all();
+            
+            _thread.join();
+        }
+        
+        /*! Swaps the next buffer into chunk, returns false once there are no more. */
+        bool pop(std::string& chunk)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            
+            _ready.wait(lock, [this] { return ! _full.empty() || _done; });
+            
+            if (_full.empty())
+            {
+                if (_error) std::rethrow_exception(_error);
+                
+                return false;
+            }
+            
+            // the consumer's old buffer goes back to the producer
+            chunk.swap(_full.front());
+            
+            _free.push_back(std::move(_full.front()));
+            
+            _full.pop_front();
+            
+            lock.unlock();
+            
+            _space.notify_one();
+            
+            return true;
+        }
+        
+    private:
+        
+        void _run()
+        {
+            try
+            {
+                for (bool more = true; more; )
+                {
+                    std::string chunk;
+                    
+                    {
+                        std::unique_lock<std::mutex> lock(_mutex);
+                        
+                        _space.wait(lock, [this] { return _full.size() < _depth || _cancelled; });
+                        
+                        if (_cancelled) return;
+                        
+                        if (! _free.empty())
+                        {
+                            chunk.swap(_free.back());
+                            
+                            _free.pop_back();
+                        }
+                    }
+                    
+                    more = _producer(chunk);
+                    
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    
+                    if (! chunk.empty()) _full.push_back(std::move(chunk));
+                    
+                    _ready.notify_one();
+                }
+            }
+            
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                
+                _error = std::current_exception();
+            }
+            
+            std::lock_guard<std::mutex> lock(_mutex);
+            
+            _done = true;
+            
+            _ready.notify_one();
+        }
+        
+        Producer _producer;
+        
+        std::size_t _depth;
+        
+        std::deque<std::string> _full;
+        
+        std::vector<std::string> _free;
+        
+        std::mutex _mutex;
+        
+        /*! Signalled when a buffer is queued or the producer is done. */
+        std::condition_variable _ready;
+        
+        /*! Signalled when the queue has room or the pipe is destroyed. */
+        std::condition_variable _space;
+        
+        std::exception_ptr _error;
+        
+        bool _done;
+        
+        bool _cancelled;
+        
+        std::thread _thread;
+    };
+    
+    /*! Reads the next block of a file, returns false at its end. */
+    bool readBlock(std::ifstream& file, char* block, std::size_t capacity, std::size_t& size)
+    {
+        file.read(block, capacity);
+        
+        if (file.bad()) throw FileReadError();
+        
+        size = static_cast<std::size_t>(file.gcount());
+        
+        return size != 0;
+    }
+    
+    /*! Reads a file one chunk at a time, for reading ahead of the parser. */
+    class FileSource
+    {
+        
+    public:
+        
+        explicit FileSource(std::ifstream& file) : _file(file) { }
+        
+        bool operator()(std::string& chunk)
+        {
+            chunk.resize(chunkSize);
+            
+            std::size_t size;
+            
+            bool more = readBlock(_file, &chunk[0], chunkSize, size);
+            
+            chunk.resize(size);
+            
+            return more;
+        }
+        
+    private:
+        
+        std::ifstream& _file;
+    };
+    
+#if defined(PARSLEY_WITH_ZLIB) || defined(PARSLEY_WITH_ZSTD)
+    
+    /*! Caps a size claimed by a compressed file at what its data could expand to. */
+    std::size_t plausibleSize(std::size_t claimed, std::size_t compressed, std::size_t ratio)
+    {
+        return compressed > claimed / ratio ? claimed : compressed * ratio;
+    }
+    
+#endif
+    
+#ifdef PARSLEY_WITH_ZLIB
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Decompresses a gzip file one chunk at a time.
+    *
+    *   @details Concatenated gzip members are decompressed as one document.
+    *
+    ****************************************************************************/
+    
+    class GzipSource
+    {
+        
+    public:
+        
+        GzipSource(std::ifstream& file, std::size_t size)
+        : _file(file), _input(64 * 1024), _sizeHint(0), _eof(false), _finished(false)
+        {
+            // the last member's trailer holds its size modulo 2^32
+            if (size >= 18)
+            {
+                unsigned char trailer[4];
+                
+                _file.seekg(-4, std::ios::end);
+                _file.read(reinterpret_cast<char*>(trailer), 4);
+                _file.seekg(0, std::ios::beg);
+                
+                if (! _file) throw FileReadError();
+                
+                std::size_t claimed = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) |
+                                      (static_cast<std::size_t>(trailer[3]) << 24);
+                
+                // deflate can't expand data more than about 1032 times
+                _sizeHint = plausibleSize(claimed, size, 1032);
+            }
+            
+            std::memset(&_stream, 0, sizeof(_stream));
+            
+            // 32 makes zlib expect a gzip header
+            if (inflateInit2(&_stream, 15 + 32) != Z_OK) throw std::bad_alloc();
+        }
+        
+        ~GzipSource() { inflateEnd(&_stream); }
+        
+        GzipSource(const GzipSource&) = delete;
+        
+        GzipSource& operator=(const GzipSource&) = delete;
+        
+        bool operator()(std::string& chunk)
+        {
+            chunk.resize(chunkSize);
+            
+            _stream.next_out = reinterpret_cast<Bytef*>(&chunk[0]);
+            _stream.avail_out = static_cast<uInt>(chunkSize);
+            
+            while (_stream.avail_out && ! _finished)
+            {
+                if (! _stream.avail_in && ! _eof)
+                {
+                    std::size_t size;
+                    
+                    _eof = ! readBlock(_file, _input.data(), _input.size(), size);
+                    
+                    _stream.next_in = reinterpret_cast<Bytef*>(_input.data());
+                    _stream.avail_in = static_cast<uInt>(size);
+                }
+                
+                int ret = inflate(&_stream, Z_NO_FLUSH);
+                
+                if (ret == Z_STREAM_END)
+                {
+                    // another member may follow
+                    if (_stream.avail_in || (! _eof && _file.peek() != std::char_traits<char>::eof()))
+                        inflateReset(&_stream);
+                    
+                    else _finished = true;
+                }
+                
+                else if (ret == Z_BUF_ERROR && _eof)
+                    throw DecompressionError("Compressed document is truncated!");
+                
+                else if (ret != Z_OK)
+                    throw DecompressionError(_stream.msg ? std::string("Invalid gzip data: ") + _stream.msg :
+                                                           std::string("Invalid gzip data!"));
+            }
+            
+            chunk.resize(chunkSize - _stream.avail_out);
+            
+            return ! _finished;
+        }
+        
+        /*! The decompressed size the file claims, or 0 if it doesn't know. */
+        std::size_t getSizeHint() const { return _sizeHint; }
+        
+    private:
+        
+        std::ifstream& _file;
+        
+        std::vector<char> _input;
+        
+        z_stream _stream;
+        
+        std::size_t _sizeHint;
+        
+        bool _eof;
+        
+        bool _finished;
+    };
+    
+#endif
+    
+#ifdef PARSLEY_WITH_ZSTD
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Decompresses a zstd file one chunk at a time.
+    *
+    *   @details Concatenated frames are decompressed as one document.
+    *
+    ****************************************************************************/
+    
+    class ZstdSource
+    {
+        
+    public:
+        
+        ZstdSource(std::ifstream& file, std::size_t size)
+        : _file(file), _input(ZSTD_DStreamInSize()), _sizeHint(0), _eof(false), _finished(false), _frameDone(false)
+        {
+            // the frame header may hold the decompressed size
+            char header[18];
+            
+            _file.read(header, sizeof(header));
+            
+            unsigned long long claimed = ZSTD_getFrameContentSize(header, static_cast<std::size_t>(_file.gcount()));
+            
+            _file.clear();
+            _file.seekg(0, std::ios::beg);
+            
+            if (claimed != ZSTD_CONTENTSIZE_UNKNOWN && claimed != ZSTD_CONTENTSIZE_ERROR &&
+                claimed <= std::numeric_limits<std::size_t>::max())
+                _sizeHint = plausibleSize(static_cast<std::size_t>(claimed), size, 1032);
+            
+            _stream = ZSTD_createDStream();
+            
+            if (! _stream) throw std::bad_alloc();
+            
+            ZSTD_initDStream(_stream);
+            
+            _in.src = _input.data();
+            _in.size = 0;
+            _in.pos = 0;
+        }
+        
+        ~ZstdSource() { ZSTD_freeDStream(_stream); }
+        
+        ZstdSource(const ZstdSource&) = delete;
+        
+        ZstdSource& operator=(const ZstdSource&) = delete;
+        
+        bool operator()(std::string& chunk)
+        {
+            chunk.resize(chunkSize);
+            
+            ZSTD_outBuffer out = { &chunk[0], chunkSize, 0 };
+            
+            while (out.pos < out.size && ! _finished)
+            {
+                if (_in.pos == _in.size && ! _eof)
+                {
+                    _eof = ! readBlock(_file, _input.data(), _input.size(), _in.size);
+                    
+                    _in.pos = 0;
+                }
+                
+                std::size_t before = out.pos;
+                std::size_t consumed = _in.pos;
+                
+                std::size_t ret = ZSTD_decompressStream(_stream, &out, &_in);
+                
+                if (ZSTD_isError(ret))
+                    throw DecompressionError(std::string("Invalid zstd data: ") + ZSTD_getErrorName(ret));
+                
+                // 0 means a frame is complete, until the next one starts
+                if (ret == 0) _frameDone = true;
+                
+                else if (_in.pos != consumed) _frameDone = false;
+                
+                if (_eof && _in.pos == _in.size && out.pos == before)
+                {
+                    if (! _frameDone) throw DecompressionError("Compressed document is truncated!");
+                    
+                    _finished = true;
+                }
+            }
+            
+            chunk.resize(out.pos);
+            
+            return ! _finished;
+        }
+        
+        /*! The decompressed size the file claims, or 0 if it doesn't know. */
+        std::size_t getSizeHint() const { return _sizeHint; }
+        
+    private:
+        
+        std::ifstream& _file;
+        
+        std::vector<char> _input;
+        
+        ZSTD_DStream* _stream;
+        
+        ZSTD_inBuffer _in;
+        
+        std::size_t _sizeHint;
+        
+        bool _eof;
+        
+        bool _finished;
+        
+        bool _frameDone;
+    };
+    
+#endif
+    
+    /*! Opens a file, returns its size and how it is compressed. */
+    Compression openFile(const std::string& fname, std::ifstream& file, std::size_t& size)
+    {
+        file.open(fname, std::ios::binary);
+        
+        if (! file.good() || ! file.is_open())
+            throw FileOpenError();
+        
+        file.seekg(0, std::ios::end);
+        
+        std::streamoff end = file.tellg();
+        
+        if (end < 0) throw FileReadError();
+        
+        size = static_cast<std::size_t>(end);
+        
+        // compressed documents are recognized by their magic number
+        char magic[4] = { };
+        
+        file.seekg(0, std::ios::beg);
+        
+        file.read(magic, sizeof(magic));
+        
+        file.clear();
+        file.seekg(0, std::ios::beg);
+        
+        return detectCompression(magic, file.gcount());
+    }
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Starts reading a file on a separate thread, decompressing it
+    *          if need be.
+    *
+    *   @param sizeHint Set to the expected size of the content.
+    *
+    *   @throws DecompressionError if Parsley was built without support for
+    *           the file's compression.
+    *
+    ****************************************************************************/
+    
+    std::unique_ptr<ChunkPipe> openPipe(std::ifstream& file, std::size_t size,
+                                        Compression compression, std::size_t& sizeHint)
+    {
+        if (compression == Gzip)
+        {
+#ifdef PARSLEY_WITH_ZLIB
+            std::shared_ptr<GzipSource> source = std::make_shared<GzipSource>(file, size);
+            
+            sizeHint = source->getSizeHint();
+            
+            return std::unique_ptr<ChunkPipe>(new ChunkPipe([source] (std::string& chunk) { return (*source)(chunk); }));
+#else
+            throw DecompressionError("Document is gzip-compressed, but Parsley was built without PARSLEY_WITH_ZLIB!");
+#endif
+        }
+        
+        if (compression == Zstd)
+        {
+#ifdef PARSLEY_WITH_ZSTD
+            std::shared_ptr<ZstdSource> source = std::make_shared<ZstdSource>(file, size);
+            
+            sizeHint = source->getSizeHint();
+            
+            return std::unique_ptr<ChunkPipe>(new ChunkPipe([source] (std::string& chunk) { return (*source)(chunk); }));
+#else
+            throw DecompressionError("Document is zstd-compressed, but Parsley was built without PARSLEY_WITH_ZSTD!");
+#endif
+        }
+        
+        sizeHint = size;
+        
+        FileSource source(file);
+        
+        return std::unique_ptr<ChunkPipe>(new ChunkPipe([source] (std::string& chunk) mutable { return source(chunk); }, 3));
+    }
+}
+
+bool Parsley::_transcode(std::string& str, std::size_t& skip)
+{
+    Encoding encoding = detectEncoding(str, skip);
+    
+    // UTF-8 is used in place, minus the byte order mark
+    if (encoding == Utf8) return false;
+    
+    const char* begin = str.data() + skip;
+    const char* end = str.data() + str.size();
+    
+    if (encoding == Latin1) latin1ToUtf8(begin, end).swap(str);
+    
+    else utf16ToUtf8(begin, end, encoding == Utf16BE, skip).swap(str);
+    
+    skip = 0;
+    
+    return true;
+}
+
+void Parsley::_checkUtf8(Str_cItr begin, Str_cItr end)
+{
+    if (begin == end) return;
+    
+    const char* first = &*begin;
+    const char* last = first + (end - begin);
+    
+    const char* invalid = findInvalidUtf8(first, last);
+    
+    while (invalid != last)
+    {
+        EncodingError error("Invalid UTF-8 sequence!", (begin - _docBegin) + (invalid - first));
+        
+        if (! _recover) throw error;
+        
+        // keep the bytes, but note them, once for a whole run
+        _diagnose(error);
+        
+        const char* next = invalid + 1;
+        
+        while (next != last && (invalid = findInvalidUtf8(next, last)) == next) ++next;
+        
+        if (next == last) invalid = last;
+    }
+}
+
+void Parsley::_diagnose(const ParseError& error)
+{
+    // past the limit, problems are still repaired but no longer noted
+    if (_diagnostics.size() < _limits.maxDiagnostics) _diagnostics.push_back(error);
+}
+
+namespace
+{
+    /*! Counts the allocations made on this thread into stats, if any, while it lives. */
+    struct AllocationCounter
+    {
+        explicit AllocationCounter(ParseStats * stats)
+        : previous(ParsleyMemoryResource::getAllocationCounter())
+        {
+            if (stats) ParsleyMemoryResource::setAllocationCounter(&stats->allocations);
+        }
+        
+        ~AllocationCounter()
+        {
+            ParsleyMemoryResource::setAllocationCounter(previous);
+        }
+        
+        std::size_t * previous;
+    };
+}
+
+ParsleyNode * Parsley::parse(const std::string& fname, ParseStats * stats)
+{
+    _stats = stats;
+    _depth = 0;
+    _nodeCount = 0;
+    _bindings.clear();
+    _diagnostics.clear();
+    
+    if (_stats) *_stats = ParseStats();
+    
+    AllocationCounter counter(_stats);
+    
+    // a lazy document keeps its text, so read straight into it
+    std::shared_ptr<ParsleyLazyDocument> doc;
+    
+    if (_isLazy) doc = std::make_shared<ParsleyLazyDocument>();
+    
+    std::string buffer;
+    
+    std::string& str = doc ? doc->buffer : buffer;
+    
+    ParsleyNode * root;
+    
+    try
+    {
+        TokenVec vec = _load(fname, str);
+        
+        root = _parseTokens(vec, doc);
+    }
+    
+    // only now is it worth counting lines
+    catch (ParseError& error)
+    {
+        error.locate(str.data(), str.size());
+        
+        ParseError::locate(_diagnostics, str.data(), str.size());
+        
+        _stats = 0;
+        
+        throw;
+    }
+    
+    ParseError::locate(_diagnostics, str.data(), str.size());
+    
+    return root;
+}
+
+Parsley::TokenVec Parsley::_load(const std::string& fname, std::string& str)
+{
+    Clock::time_point start;
+    
+    if (_stats) start = Clock::now();
+    
+    std::ifstream file;
+    
+    std::size_t size;
+    
+    Compression compression = openFile(fname, file, size);
+    
+    // check the size up front, so oversized
+    // documents are never read into memory
+    if (compression == Uncompressed && size > _limits.maxBytes)
+        throw ParseError("Document exceeds the maximum size of " +
+                         std::to_string(_limits.maxBytes) + " bytes!", _limits.maxBytes);
+    
+    // tokenize each chunk while the next ones are read or decompressed
+    if (compression != Uncompressed || _readAhead)
+    {
+        std::size_t sizeHint;
+        
+        std::unique_ptr<ChunkPipe> pipe = openPipe(file, size, compression, sizeHint);
+        
+        return _tokenizeStream([&pipe] (std::string& chunk) { return pipe->pop(chunk); }, str, sizeHint);
+    }
+    
+    str.assign(size, '\0');
+    
+    if (! file.read(&str[0], size)) throw FileReadError();
+    
+    if (_stats)
+    {
+        _stats->ioSeconds = secondsSince(start);
+        _stats->bytesRead = str.size();
+    }
+    
+    return _tokenize(str);
+}
+
+Str_cItr Parsley::_skipHeader(Str_cItr begin, Str_cItr end)
+{
+    Str_cItr i = std::find_if_not(begin, end, ::isspace);
+    
+    if (i != end && *i == '<')
+    {
+        Str_cItr j = std::find(i, end, '>');
+        
+        if (j != end && _isHeader(i + 1, j)) return j + 1;
+    }
+    
+    return begin;
+}
+
+Parsley::TokenVec Parsley::_tokenize(std::string& str)
+{
+    Clock::time_point start;
+    
+    if (_stats) start = Clock::now();
+    
+    std::size_t bom;
+    
+    _validating = ! _transcode(str, bom) && _validateUtf8;
+    
+    if (_stats)
+    {
+        _stats->transcodeSeconds = secondsSince(start);
+        
+        start = Clock::now();
+    }
+    
+    Str_cItr begin = _skipHeader(str.begin() + bom, str.end());
+    
+    _docBegin = str.begin();
+    
+    TokenVec vec = _parse(begin, str.end());
+    
+    if (_stats)
+    {
+        _stats->tokenizeSeconds = secondsSince(start);
+        _stats->tokens = vec.size();
+    }
+    
+    return vec;
+}
+
+Parsley::TokenVec Parsley::_tokenizeStream(const std::function<bool(std::string&)>& next,
+                                           std::string& str,
+                                           std::size_t sizeHint)
+{
+    Clock::time_point start;
+    
+    str.clear();
+    str.reserve(std::min(sizeHint, _limits.maxBytes));
+    
+    TokenVec vec;
+    
+    std::string chunk;
+    
+    // where tokenizing resumes, npos until the encoding is known
+    std::size_t position = std::string::npos;
+    
+    // how far past position an unfinished token has been searched
+    std::size_t searched = 0;
+    
+    for (bool more = true; more; )
+    {
+        if (_stats) start = Clock::now();
+        
+        more = next(chunk);
+        
+        if (_stats) _stats->ioSeconds += secondsSince(start);
+        
+        if (more)
+        {
+            if (str.size() + chunk.size() > _limits.maxBytes)
+                throw ParseError("Document exceeds the maximum size of " +
+                                 std::to_string(_limits.maxBytes) + " bytes!", _limits.maxBytes);
+            
+            str.append(chunk);
+        }
+        
+        if (position == std::string::npos)
+        {
+            // the encoding and header are known once the first tag is complete
+            if (more && str.find('>') == std::string::npos) continue;
+            
+            std::size_t bom;
+            
+            // anything but UTF-8 has to be transcoded as a whole
+            if (detectEncoding(str, bom) != Utf8)
+            {
+                while (more)
+                {
+                    if ((more = next(chunk)) && str.size() + chunk.size() > _limits.maxBytes)
+                        throw ParseError("Document exceeds the maximum size of " +
+                                         std::to_string(_limits.maxBytes) + " bytes!", _limits.maxBytes);
+                    
+                    if (more) str.append(chunk);
+                }
+                
+                if (_stats) _stats->bytesRead = str.size();
+                
+                return _tokenize(str);
+            }
+            
+            _validating = _validateUtf8;
+            
+            position = _skipHeader(str.begin() + bom, str.end()) - str.begin();
+        }
+        
+        if (_stats) start = Clock::now();
+        
+        // the buffer may have moved, but tokens are offsets
+        _docBegin = str.begin();
+        
+        position = _scan(str.begin() + position, str.end(), ! more, vec, searched) - str.begin();
+        
+        if (_stats) _stats->tokenizeSeconds += secondsSince(start);
+    }
+    
+    if (_stats)
+    {
+        _stats->bytesRead = str.size();
+        _stats->tokens = vec.size();
+    }
+    
+    return vec;
+}
+
+ParsleyNode * Parsley::_parseTokens(TokenVec& vec, const std::shared_ptr<ParsleyLazyDocument>& doc)
+{
+    Clock::time_point start;
+    
+    if (_stats) start = Clock::now();
+    
+    if (vec.empty()) throw ParseError("Document contains no elements!");
+    
+    // only the eager parser can repair a document
+    if (doc && ! _recover)
+    {
+        // tokens are offsets, so they stay valid
+        doc->tokens.swap(vec);
+        
+        std::size_t root = _matchTokens(doc->tokens, doc->match);
+        
+        doc->parser = *this;
+        doc->parser._stats = 0;
+        
+        ParsleyNode* ret = _makeLazyNode(doc, root);
+        
+        if (_stats)
+        {
+            _stats->treeSeconds = secondsSince(start);
+            
+            _stats = 0;
+        }
+        
+        return ret;
+    }
+    
+    // comments and the like before the root element
+    // have no node to belong to, so they are dropped
+    TokenVec_cItr first = vec.begin();
+    
+    while (first != vec.end() && first->type != TagToken) ++first;
+    
+    if (first == vec.end()) throw ParseError("Document contains no elements!");
+    
+    // _makeNodeTree needs a parent to be passed
+    // for the recursion to work, so pass this
+    // "pseudo-parent"
+    ParsleyNode* pseudo = new ParsleyNode;
+    
+    // release whatever was built so far if the
+    // tree is malformed or memory runs out
+    try
+    {
+        TokenVec_cItr itr = _makeNodeTree(first, vec.end(), pseudo);
+        
+        // a skipped tag leaves no root yet, so carry on with the next one
+        while (_recover && ! pseudo->firstChild && ++itr != vec.end())
+            itr = _makeNodeTree(itr, vec.end(), pseudo);
+        
+        if (! pseudo->firstChild) throw ParseError("Document contains no elements!");
+    }
+    
+    catch (...)
+    {
+        delete pseudo;
+        
+        _stats = 0;
+        
+        throw;
+    }
+    
+    // the root is then the first child of this pseudo-parent
+    ParsleyNode* ret = pseudo->firstChild;
+    
+    // remove pseudo-parent
+    pseudo->firstChild = pseudo->lastChild = 0;
+    
+    if (ret) ret->parent = 0;
+    
+    delete pseudo;
+    
+    if (_stats)
+    {
+        _stats->treeSeconds = secondsSince(start) - _stats->attrSeconds;
+        
+        _stats = 0;
+    }
+    
+    return ret;
+}
+
+void ParsleyBinding::_add(const Field& field)
+{
+    std::size_t index = 0;
+    
+    // a name bound twice takes the later binding
+    while (index < _fields.size() &&
+           (_fields[index].isAttribute != field.isAttribute || _fields[index].name != field.name))
+        ++index;
+    
+    if (index == _fields.size()) _fields.push_back(field);
+    
+    else _fields[index] = field;
+    
+    // search for a seed that gives every name a slot of its own,
+    // growing the table whenever a few seeds in a row fail
+    std::size_t size = 1;
+    
+    while (size < _fields.size() * 2) size *= 2;
+    
+    for (std::size_t attempt = 0; ; ++attempt)
+    {
+        if (attempt && attempt % 16 == 0) size *= 2;
+        
+        _seed = attempt * 0x9e3779b9u;
+        
+        _table.assign(size, _empty);
+        
+        std::size_t n = 0;
+        
+        for ( ; n < _fields.size(); ++n)
+        {
+            std::size_t& slot = _table[_hash(_fields[n].name.data(), _fields[n].name.size(),
+                                             _fields[n].isAttribute, _seed) & (size - 1)];
+            
+            if (slot != _empty) break;
+            
+            slot = n;
+        }
+        
+        if (n == _fields.size()) return;
+    }
+}
+
+namespace
+{
+    /*! An open element while binding, and where its contents go. */
+    struct BindFrame
+    {
+        /*! The schema of the struct being filled, null if not a struct. */
+        const ParsleyBinding * schema;
+        
+        /*! The struct being filled, or the one owning field. */
+        void * object;
+        
+        /*! The field collecting the element's text, null if none. */
+        const ParsleyBinding::Field * field;
+        
+        /*! The element's name, as an offset and length into the document. */
+        std::size_t name;
+        std::size_t length;
+        
+        /*! Where the element's start tag begins. */
+        std::size_t offset;
+    };
+    
+    /*! Converts a field's text, reporting failures at offset. */
+    void assignField(const ParsleyBinding::Field& field, void * object,
+                     const char* begin, const char* end, std::size_t offset)
+    {
+        try { field.binder->assign(object, begin, end); }
+        
+        catch (ParseError& error)
+        {
+            throw ParseError("Cannot bind " + field.name + ": " + error.what(), offset);
+        }
+    }
+}
+
+void Parsley::_bind(const std::string& fname, const ParsleyBinding& schema, void * object)
+{
+    _stats = 0;
+    _depth = 0;
+    _nodeCount = 0;
+    _diagnostics.clear();
+    
+    // nothing is repaired while binding, every problem throws
+    bool recover = _recover;
+    
+    _recover = false;
+    
+    std::string str;
+    
+    try
+    {
+        TokenVec vec = _load(fname, str);
+        
+        _bindTokens(vec, schema, object);
+    }
+    
+    catch (ParseError& error)
+    {
+        _recover = recover;
+        
+        error.locate(str.data(), str.size());
+        
+        throw;
+    }
+    
+    catch (...)
+    {
+        _recover = recover;
+        
+        throw;
+    }
+    
+    _recover = recover;
+}
+
+void Parsley::_bindTokens(const TokenVec& vec, const ParsleyBinding& schema, void * object)
+{
+    std::vector<BindFrame> stack;
+    
+    // the text of the current field and attribute values, reused throughout
+    std::string text;
+    std::string decoded;
+    
+    // the names of the current element's attributes, for finding duplicates
+    std::vector<std::pair<Str_cItr, Str_cItr> > names;
+    
+    bool hasRoot = false;
+    
+    for (TokenVec_cItr itr = vec.begin(); itr != vec.end(); ++itr)
+    {
+        if (itr->type == TextToken || itr->type == CDataToken)
+        {
+            // only fields care for text
+            if (stack.empty() || ! stack.back().field) continue;
+            
+            Str_cItr begin = _docBegin + itr->begin;
+            Str_cItr end = _docBegin + itr->end;
+            
+            if (itr->type == CDataToken) text.append(begin + 9, end - 3);
+            
+            else appendText(begin, end, text);
+            
+            continue;
+        }
+        
+        if (itr->type != TagToken) continue;
+        
+        Str_cItr begin = _docBegin + itr->begin;
+        Str_cItr end = _docBegin + itr->end;
+        
+        bool selfClosed;
+        
+        _tagContents(begin, end, selfClosed);
+        
+        Str_cItr nameEnd = std::find_if(begin, end, ::isspace);
+        
+        if (*begin == '/')
+        {
+            ++begin;
+            
+            if (stack.empty() ||
+                static_cast<std::size_t>(nameEnd - begin) != stack.back().length ||
+                ! std::equal(begin, nameEnd, _docBegin + stack.back().name))
+                throw ParseError("Found closing tag: " + std::string(begin - 1, nameEnd) +
+                                 " that does not close current node!", itr->begin);
+        }
+        
+        else
+        {
+            if (static_cast<std::size_t>(nameEnd - begin) > _limits.maxTokenLength)
+                throw ParseError("Tag name exceeds the maximum token length!", itr->begin);
+            
+            if (++_nodeCount > _limits.maxNodes)
+                throw ParseError("Document exceeds the maximum number of elements!", itr->begin);
+            
+            if (stack.size() + 1 > _limits.maxDepth)
+                throw ParseError("Document exceeds the maximum nesting depth!", itr->begin);
+            
+            BindFrame frame = { 0, 0, 0, static_cast<std::size_t>(begin - _docBegin),
+                                static_cast<std::size_t>(nameEnd - begin), itr->begin };
+            
+            // the root element is the object itself
+            if (stack.empty())
+            {
+                frame.schema = &schema;
+                frame.object = object;
+                
+                hasRoot = true;
+            }
+            
+            // elements inside anything but a struct are skipped
+            else if (stack.back().schema)
+            {
+                const ParsleyBinding::Field * field = stack.back().schema->find(&*begin, nameEnd - begin, false);
+                
+                if (field && field->nested)
+                {
+                    frame.schema = field->schema.get();
+                    frame.object = field->nested->enter(stack.back().object);
+                }
+                
+                else if (field)
+                {
+                    frame.object = stack.back().object;
+                    frame.field = field;
+                    
+                    text.clear();
+                }
+            }
+            
+            // attributes are always checked, but only decoded when bound
+            names.clear();
+            
+            _scanAttrs(nameEnd, end, [&] (Str_cItr key, Str_cItr keyEnd,
+                                          Str_cItr value, Str_cItr valueEnd, std::size_t offset)
+            {
+                for (std::size_t n = 0; n < names.size(); ++n)
+                {
+                    if (names[n].second - names[n].first == keyEnd - key &&
+                        std::equal(key, keyEnd, names[n].first))
+                        throw ParseError("Duplicate attribute!", offset);
+                }
+                
+                names.push_back(std::make_pair(key, keyEnd));
+                
+                if (! frame.schema) return;
+                
+                const ParsleyBinding::Field * field = frame.schema->find(&*key, keyEnd - key, true);
+                
+                if (! field) return;
+                
+                decoded.clear();
+                
+                decodeEntities(value, valueEnd, decoded);
+                
+                assignField(*field, frame.object, decoded.data(), decoded.data() + decoded.size(), offset);
+            });
+            
+            stack.push_back(frame);
+            
+            if (! selfClosed) continue;
+        }
+        
+        const BindFrame& closed = stack.back();
+        
+        if (closed.field)
+            assignField(*closed.field, closed.object, text.data(), text.data() + text.size(), closed.offset);
+        
+        stack.pop_back();
+        
+        // like parse(), whatever follows the root element is ignored
+        if (stack.empty()) break;
+    }
+    
+    if (! stack.empty())
+        throw ParseError("Could not find matching closing tag for: " +
+                         std::string(_docBegin + stack.back().name,
+                                     _docBegin + stack.back().name + stack.back().length),
+                         vec.back().end);
+    
+    if (! hasRoot) throw ParseError("Document contains no elements!");
+}
+
+namespace
+{
+    /*! Records are handed to the workers in batches of about this size. */
+    const std::size_t recordBatchSize = 64 * 1024;
+    
+    /*! Records cut out of a document, wrapped in a copy of its root element. */
+    struct RecordBatch
+    {
+        std::string text;
+        
+        /*! Where the root's start tag and each record begin in text... */
+        std::vector<std::size_t> starts;
+        
+        /*! ...and where they begin in the document. */
+        std::vector<std::size_t> offsets;
+        
+        /*! Translates an offset into text to one into the document. */
+        std::size_t documentOffset(std::size_t offset) const
+        {
+            std::size_t n = std::upper_bound(starts.begin(), starts.end(), offset) - starts.begin() - 1;
+            
+            return offsets[n] + (offset - starts[n]);
+        }
+    };
+    
+    /*! Throws a copy of error, of the same type, at another offset. */
+    void rethrowAt(const ParseError& error, std::size_t offset)
+    {
+        if (dynamic_cast<const EncodingError*>(&error)) throw EncodingError(error.getMessage(), offset);
+        
+        throw ParseError(error.getMessage(), offset);
+    }
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Works through batches of records on a pool of threads and
+    *          hands them back in order.
+    *
+    *   @details Each batch occupies one of window slots from push() until
+    *            it has been consumed, so no more than window batches are
+    *            ever in flight. Exceptions thrown by the workers are
+    *            rethrown on the consuming thread.
+    *
+    ****************************************************************************/
+    
+    class RecordPool
+    {
+        
+    public:
+        
+        typedef std::function<void(std::size_t, RecordBatch&)> Work;
+        
+        typedef std::function<void(std::size_t)> Consumer;
+        
+        /*! Starts threads workers, each running a Work made by makeWork. */
+        RecordPool(const std::function<Work()>& makeWork, unsigned threads, std::size_t window)
+        : _batches(window), _finished(window, false), _next(0), _consumed(0), _cancelled(false)
+        {
+            try
+            {
+                for (unsigned n = 0; n < threads; ++n)
+                    _threads.push_back(std::thread(&RecordPool::_run, this, makeWork()));
+            }
+            
+            catch (...)
+            {
+                _stop();
+                
+                throw;
+            }
+        }
+        
+        /*! Stops the workers once they are done with their current batch. */
+        ~RecordPool() { _stop(); }
+        
+        /*************************************************************************//*!
+        *
+        *   @brief Queues a batch, consuming finished ones until a slot is free.
+        *
+        *   @details The batch is swapped with the one last processed in its
+        *            slot, so their buffers are reused.
+        *
+        ****************************************************************************/
+        
+        void push(RecordBatch& batch, const Consumer& consume)
+        {
+            while (_next - _consumed == _batches.size()) _consumeNext(consume);
+            
+            std::size_t slot = _next++ % _batches.size();
+            
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                
+                std::swap(_batches[slot], batch);
+                
+                _queue.push_back(slot);
+            }
+            
+            _ready.notify_one();
+        }
+        
+        /*! Consumes every batch still in flight. */
+        void finish(const Consumer& consume)
+        {
+            while (_consumed != _next) _consumeNext(consume);
+        }
+        
+    private:
+        
+        void _consumeNext(const Consumer& consume)
+        {
+            std::size_t slot = _consumed % _batches.size();
+            
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                
+                _done.wait(lock, [this, slot] { return _finished[slot] || _error; });
+                
+                if (_error) std::rethrow_exception(_error);
+                
+                _finished[slot] = false;
+            }
+            
+            consume(slot);
+            
+            ++_consumed;
+        }
+        
+        void _run(Work work)
+        {
+            for (;;)
+            {
+                std::size_t slot;
+                
+                {
+                    std::unique_lock<std::mutex> lock(_mutex);
+                    
+                    _ready.wait(lock, [this] { return ! _queue.empty() || _cancelled; });
+                    
+                    if (_cancelled) return;
+                    
+                    slot = _queue.front();
+                    
+                    _queue.pop_front();
+                }
+                
+                try
+                {
+                    work(slot, _batches[slot]);
+                }
+                
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    
+                    if (! _error) _error = std::current_exception();
+                    
+                    _done.notify_one();
+                    
+                    return;
+                }
+                
+                std::lock_guard<std::mutex> lock(_mutex);
+                
+                _finished[slot] = true;
+                
+                _done.notify_one();
+            }
+        }
+        
+        void _stop()
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                
+                _cancelled = true;
+            }
+            
+            _ready.notify_all();
+            
+            for (std::size_t n = 0; n < _threads.size(); ++n) _threads[n].join();
+            
+            _threads.clear();
+        }
+        
+        std::vector<RecordBatch> _batches;
+        
+        /*! Whether the batch in each slot has been worked on. */
+        std::vector<bool> _finished;
+        
+        /*! The slots waiting for a worker. */
+        std::deque<std::size_t> _queue;
+        
+        /*! The number of batches pushed and consumed so far. */
+        std::size_t _next;
+        std::size_t _consumed;
+        
+        std::mutex _mutex;
+        
+        /*! Signalled when a batch is queued or the pool is stopped. */
+        std::condition_variable _ready;
+        
+        /*! Signalled when a batch is finished or a worker failed. */
+        std::condition_variable _done;
+        
+        std::exception_ptr _error;
+        
+        bool _cancelled;
+        
+        std::vector<std::thread> _threads;
+    };
+}
+
+unsigned Parsley::_workerCount(unsigned threads)
+{
+    if (threads) return threads;
+    
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+ParsleyNode * Parsley::_parseRecords(const std::string& text)
+{
+    _depth = 0;
+    _nodeCount = 0;
+    _bindings.clear();
+    
+    _docBegin = text.begin();
+    
+    TokenVec vec = _parse(text.begin(), text.end());
+    
+    return _parseTokens(vec, std::shared_ptr<ParsleyLazyDocument>());
+}
+
+void Parsley::_mapRecords(const std::string& fname, const std::string& recordTag,
+                          unsigned threads, std::size_t window,
+                          const std::function<void(std::size_t, ParsleyNode*)>& map,
+                          const std::function<void(std::size_t)>& consume)
+{
+    _stats = 0;
+    _diagnostics.clear();
+    
+    std::ifstream file;
+    
+    std::size_t size;
+    
+    Compression compression = openFile(fname, file, size);
+    
+    std::size_t sizeHint;
+    
+    std::unique_ptr<ChunkPipe> pipe = openPipe(file, size, compression, sizeHint);
+    
+    // this thread only tokenizes, with its own copy of the settings
+    Parsley reader(*this);
+    
+    reader._recover = false;
+    reader._validating = _validateUtf8;
+    
+    // every worker parses with a copy of its own
+    RecordPool pool([this, &map] () -> RecordPool::Work
+    {
+        std::shared_ptr<Parsley> parser = std::make_shared<Parsley>(*this);
+        
+        // this thread validates the whole document already
+        parser->_isLazy = false;
+        parser->_recover = false;
+        parser->_validating = false;
+        
+        return [parser, &map] (std::size_t slot, RecordBatch& batch)
+        {
+            ParsleyNode * root;
+            
+            try { root = parser->_parseRecords(batch.text); }
+            
+            catch (ParseError& error)
+            {
+                if (error.getOffset() == std::string::npos) throw;
+                
+                rethrowAt(error, batch.documentOffset(error.getOffset()));
+            }
+            
+            ParsleyNode::NodePtr tree(root);
+            
+            for (ParsleyNode * record = root->getFirstChild(); record; record = record->getNextSibling())
+                map(slot, record);
+        };
+    }, _workerCount(threads), window);
+    
+    // the part of the document not tokenized yet, and where it begins
+    std::string str;
+    std::size_t base = 0;
+    
+    std::string chunk;
+    
+    TokenVec vec;
+    
+    // where tokenizing resumes in str, npos until the encoding is known
+    std::size_t position = std::string::npos;
+    
+    // how far past position an unfinished token has been searched
+    std::size_t searched = 0;
+    
+    // the names of the open elements around the records
+    std::vector<std::string> open;
+    
+    std::string rootTag;
+    std::string rootEnd;
+    std::size_t rootOffset = 0;
+    
+    // the nesting depth inside the current record, 0 between records
+    std::size_t inside = 0;
+    
+    // where the part of the current record not yet in the batch begins in str
+    std::size_t recordStart = 0;
+    
+    RecordBatch batch;
+    
+    // moves the current record up to end into the batch
+    auto takeRecord = [&] (std::size_t end)
+    {
+        batch.text.append(str, recordStart, end - recordStart);
+        
+        recordStart = end;
+        
+        if (batch.text.size() - batch.starts.back() > _limits.maxBytes)
+            throw ParseError("Record exceeds the maximum size of " +
+                             std::to_string(_limits.maxBytes) + " bytes!", batch.offsets.back());
+    };
+    
+    bool finished = false;
+    
+    for (bool more = true; more && ! finished; )
+    {
+        if ((more = pipe->pop(chunk))) str.append(chunk);
+        
+        if (position == std::string::npos)
+        {
+            // the encoding and header are known once the first tag is complete
+            if (more && str.find('>') == std::string::npos) continue;
+            
+            std::size_t bom;
+            
+            if (detectEncoding(str, bom) != Utf8)
+                throw EncodingError("Records can only be read from UTF-8 documents!");
+            
+            position = reader._skipHeader(str.begin() + bom, str.end()) - str.begin();
+        }
+        
+        reader._docBegin = str.begin();
+        
+        vec.clear();
+        
+        std::size_t resume;
+        
+        try { resume = reader._scan(str.begin() + position, str.end(), ! more, vec, searched) - str.begin(); }
+        
+        catch (ParseError& error)
+        {
+            if (error.getOffset() == std::string::npos) throw;
+            
+            rethrowAt(error, base + error.getOffset());
+        }
+        
+        for (TokenVec_cItr itr = vec.begin(); itr != vec.end() && ! finished; ++itr)
+        {
+            if (itr->type != TagToken) continue;
+            
+            Str_cItr begin = str.begin() + itr->begin;
+            Str_cItr end = str.begin() + itr->end;
+            
+            bool selfClosed;
+            
+            reader._tagContents(begin, end, selfClosed);
+            
+            Str_cItr nameEnd = std::find_if(begin, end, ::isspace);
+            
+            // inside a record, only the depth matters, the workers check the rest
+            if (inside)
+            {
+                if (*begin != '/')
+                {
+                    if (! selfClosed) ++inside;
+                }
+                
+                else if (! --inside)
+                {
+                    if (recordTag.compare(0, std::string::npos, &*begin + 1, nameEnd - begin - 1))
+                        throw ParseError("Found closing tag: " + std::string(begin, nameEnd) +
+                                         " that does not close current node!", base + itr->begin);
+                    
+                    takeRecord(itr->end);
+                }
+            }
+            
+            else
+            {
+                if (*begin == '/')
+                {
+                    ++begin;
+                    
+                    if (open.empty() || open.back().compare(0, std::string::npos, &*begin, nameEnd - begin))
+                        throw ParseError("Found closing tag: " + std::string(begin - 1, nameEnd) +
+                                         " that does not close current node!", base + itr->begin);
+                    
+                    open.pop_back();
+                    
+                    // like parse(), whatever follows the root element is ignored
+                    finished = open.empty();
+                    
+                    continue;
+                }
+                
+                if (open.size() == 1 && recordTag.compare(0, std::string::npos, &*begin, nameEnd - begin) == 0)
+                {
+                    // a new batch starts with the root's start tag
+                    if (batch.starts.empty())
+                    {
+                        batch.text = rootTag;
+                        
+                        batch.starts.push_back(0);
+                        batch.offsets.push_back(rootOffset);
+                    }
+                    
+                    batch.starts.push_back(batch.text.size());
+                    batch.offsets.push_back(base + itr->begin);
+                    
+                    recordStart = itr->begin;
+                    
+                    if (! selfClosed) inside = 1;
+                    
+                    else takeRecord(itr->end);
+                }
+                
+                else if (! selfClosed)
+                {
+                    if (open.size() + 1 > _limits.maxDepth)
+                        throw ParseError("Document exceeds the maximum nesting depth!", base + itr->begin);
+                    
+                    if (open.empty())
+                    {
+                        rootTag.assign(str, itr->begin, itr->end - itr->begin);
+                        rootEnd = "</" + std::string(begin, nameEnd) + ">";
+                        rootOffset = base + itr->begin;
+                    }
+                    
+                    open.push_back(std::string(begin, nameEnd));
+                }
+                
+                // a root element without children has no records
+                else finished = open.empty();
+            }
+            
+            // a record was completed
+            if (! inside && batch.text.size() >= recordBatchSize)
+            {
+                batch.text += rootEnd;
+                
+                pool.push(batch, consume);
+                
+                batch.text.clear();
+                batch.starts.clear();
+                batch.offsets.clear();
+            }
+        }
+        
+        // the part of the record read so far moves into the batch
+        if (inside) takeRecord(resume);
+        
+        // str only keeps what is not tokenized yet
+        str.erase(0, resume);
+        
+        base += resume;
+        position = 0;
+        recordStart = 0;
+    }
+    
+    if (! finished)
+    {
+        if (open.empty()) throw ParseError("Document contains no elements!");
+        
+        throw ParseError("Could not find matching closing tag for: " + (inside ? recordTag : open.back()),
+                         base + str.size());
+    }
+    
+    if (! batch.starts.empty())
+    {
+        batch.text += rootEnd;
+        
+        pool.push(batch, consume);
+    }
+    
+    pool.finish(consume);
+}
+
+bool Parsley::_isHeader(Str_cItr begin, Str_cItr end)
+{
+    std::string s = condense(begin, end);
+    
+    if (s.size() < 5) return false;
+    
+    return *(s.begin()) == '?' && *(s.end() - 1) == '?' && s.substr(1,3) == "xml";
+}
+
+template <class T>
+T Parsley::_lastNonSpace(T begin, T end)
+{
+    return (condense(begin, end)).end();
+}
+
+ParsleyNode::AttrMap::iterator ParsleyNode::_findAttr(const std::string& key)
+{
+    _realize(LazyAttrs);
+    
+    return attrs.find(String(key.begin(), key.end(), attrs.get_allocator()));
+}
+
+const ParsleyNode::String* ParsleyNode::_attrValue(const std::string& key) const
+{
+    const ParsleyNode * node = _readAttrs();
+    
+    AttrMap::const_iterator itr = node->attrs.find(String(key.begin(), key.end(), node->attrs.get_allocator()));
+    
+    return itr != node->attrs.end() ? &itr->second : 0;
+}
+
+std::string ParsleyNode::getAttr(const std::string& attrKey)
+{
+    const String * value = _attrValue(attrKey);
+    
+    if (! value)
+    { throw ParseError("Could not find attribute key: " + attrKey); }
+    
+    return toStdString(*value);
+}
+
+bool ParsleyNode::hasAttr(const char* key, std::size_t length) const
+{
+    const AttrMap& attrs = _readAttrs()->attrs;
+    
+    // nodes have few attributes, and a scan
+    // needs no String to look the key up with
+    for (AttrMap::const_iterator itr = attrs.begin(), end = attrs.end(); itr != end; ++itr)
+    {
+        if (! itr->first.compare(0, String::npos, key, length)) return true;
+    }
+    
+    return false;
+}
+
+void ParsleyNode::addAttr(String&& key, String&& val)
+{
+    _realize(LazyAttrs);
+    
+    AttrMap::iterator itr = attrs.find(key);
+    
+    if (itr != attrs.end()) itr->second = std::move(val);
+    
+    // moves only if the strings share the map's resource
+    else attrs.emplace(String(std::move(key), attrs.get_allocator()),
+                       String(std::move(val), attrs.get_allocator()));
+    
+    _tagNameResolved = false;
+    _attrNamesResolved = false;
+    
+    _invalidateHash();
+}
+
+void ParsleyNode::addAttr(const char* key, std::size_t keyLength, const char* val, std::size_t valLength)
+{
+    addAttr(String(key, keyLength, attrs.get_allocator()), String(val, valLength, attrs.get_allocator()));
+}
+
+void ParsleyNode::addAttr(const std::string& key, const std::string& val)
+{
+    AttrMap::iterator itr = _findAttr(key);
+    
+    if (itr != attrs.end())
+    { itr->second.assign(val.begin(), val.end()); }
+    
+    // operator[] would default-construct the value with the
+    // default resource, so build both strings explicitly
+    else attrs.emplace(String(key.begin(), key.end(), attrs.get_allocator()),
+                       String(val.begin(), val.end(), attrs.get_allocator()));
+    
+    _tagNameResolved = false;
+    _attrNamesResolved = false;
+    
+    _invalidateHash();
+}
+
+void ParsleyNode::removeAttr(const std::string &key)
+{
+    AttrMap::iterator itr = _findAttr(key);
+    
+    if (itr == attrs.end())
+    { throw ParseError("Could not find attribute key: " + key); }
+    
+    attrs.erase(itr);
+    
+    _tagNameResolved = false;
+    _attrNamesResolved = false;
+    
+    _invalidateHash();
+}
+
+void ParsleyNode::_materialize(unsigned char what, unsigned char discard) const
+{
+    what &= _pending;
+    
+    // clear first, so the node can be modified
+    // below without recursing into this again
+    _pending &= ~(what | discard);
+    
+    if (what)
+    {
+        // keep the document alive even if this
+        // node lets go of it further down
+        std::shared_ptr<ParsleyLazyDocument> doc = _lazy;
+        
+        if (_source) _derive(what);
+        
+        else try { doc->parser._materialize(this, what); }
+        
+        catch (ParseError& error)
+        {
+            error.locate(doc->buffer.data(), doc->buffer.size());
+            
+            throw;
+        }
+    }
+    
+    if (! _pending)
+    {
+        _lazy.reset();
+        _source = 0;
+    }
+}
+
+void ParsleyNode::_derive(unsigned char what) const
+{
+    // like lazy parsing, this only fills in
+    // what the node would have had all along
+    ParsleyNode * node = const_cast<ParsleyNode*>(this);
+    
+    if (what & LazyAttrs) node->_copyAttrs(*_source);
+    
+    if (what & LazyData) node->data.assign(_source->data.begin(), _source->data.end());
+    
+    if (what & LazyChildren)
+    {
+        for (const ParsleyNode * child = _source->firstChild; child != 0; child = child->nextSibling)
+        {
+            ParsleyNode * derived = _makeDerivedNode(child, _lazy, getMemoryResource());
+            
+            node->appendChild(derived);
+            
+            derived->_copyTagName(*child);
+        }
+    }
+}
+
+ParsleyNode* ParsleyNode::_makeDerivedNode(const ParsleyNode * source,
+                                           const std::shared_ptr<ParsleyLazyDocument>& shared,
+                                           ParsleyMemoryResource* resource)
+{
+    ParsleyNode * node = source->_copyShallow(resource);
+    
+    node->_hash = source->_hash;
+    node->_hashValid = source->_hashValid;
+    
+    if (source->firstChild) node->_pending |= LazyChildren;
+    
+    if (! source->attrs.empty()) node->_pending |= LazyAttrs;
+    
+    if (! source->data.empty()) node->_pending |= LazyData;
+    
+    if (node->_pending)
+    {
+        node->_lazy = shared;
+        node->_source = source;
+    }
+    
+    return node;
+}
+
+ParsleyNode* ParsleyNode::_copyShallow(ParsleyMemoryResource* resource) const
+{
+    ParsleyNode * node = new (resource) ParsleyNode(resource);
+    
+    node->tag.assign(tag.begin(), tag.end());
+    node->type = type;
+    node->isClosed = isClosed;
+    node->selfClosed = selfClosed;
+    node->_sourceOffset = _sourceOffset;
+    node->_sourceLength = _sourceLength;
+    
+    return node;
+}
+
+void ParsleyNode::_copyAttrs(const ParsleyNode& source)
+{
+    // both maps are sorted the same way, so
+    // every insertion goes straight to the end
+    for (AttrMap::const_iterator itr = source.attrs.begin(), end = source.attrs.end();
+         itr != end;
+         ++itr)
+    {
+        attrs.emplace_hint(attrs.end(),
+                           String(itr->first, attrs.get_allocator()),
+                           String(itr->second, attrs.get_allocator()));
+    }
+    
+    _attrNamesResolved = false;
+}
+
+void ParsleyNode::_copyTagName(const ParsleyNode& source)
+{
+    if (! source._tagNameResolved) return;
+    
+    nsId = source.nsId;
+    localId = source.localId;
+    
+    _tagNameResolved = true;
+}
+
+ParsleyNode* ParsleyNode::clone(ParsleyMemoryResource* resource) const
+{
+    if (! resource) resource = getMemoryResource();
+    
+    ParsleyNode * root = _copyShallow(resource);
+    
+    // a subtree's offset is relative to a parent the copy doesn't have
+    if (parent) root->_sourceLength = 0;
+    
+    try
+    {
+        // parts a template instance hasn't copied are read from the template
+        const String& content = _readData()->data;
+        
+        root->_copyAttrs(*_readAttrs());
+        root->data.assign(content.begin(), content.end());
+        root->_copyTagName(*this);
+        
+        // a subtree's hash carries over once all of it is copied
+        auto copyHash = [] (const ParsleyNode * source, const ParsleyNode * copy)
+        {
+            copy->_hash = source->_hash;
+            copy->_hashValid = source->_hashValid;
+        };
+        
+        // iterative pre-order walk of the original, with
+        // copy always standing at source's counterpart
+        const ParsleyNode * source = this;
+        ParsleyNode * copy = root;
+        
+        while (true)
+        {
+            const ParsleyNode * next = source->getFirstChild();
+            ParsleyNode * parent = copy;
+            
+            while (! next && source != this)
+            {
+                copyHash(source, copy);
+                
+                next = source->nextSibling;
+                parent = copy->parent;
+                
+                if (! next)
+                {
+                    source = source->parent;
+                    copy = copy->parent;
+                }
+            }
+            
+            if (! next) break;
+            
+            ParsleyNode * child = next->_copyShallow(resource);
+            
+            parent->appendChild(child);
+            
+            const String& content = next->_readData()->data;
+            
+            child->_copyAttrs(*next->_readAttrs());
+            child->data.assign(content.begin(), content.end());
+            child->_copyTagName(*next);
+            
+            source = next;
+            copy = child;
+        }
+        
+        copyHash(this, root);
+    }
+    
+    catch (...)
+    {
+        delete root;
+        
+        throw;
+    }
+    
+    return root;
+}
+
+namespace
+{
+    /*! Adds the heap storage of string, if it has any, to used and its spare capacity to the slack. */
+    template <class String>
+    void countString(const String& string, std::size_t& used, ParsleyMemoryUsage& usage)
+    {
+        const char* object = reinterpret_cast<const char*>(&string);
+        
+        // short strings are kept inside the string object
+        if (! std::less<const char*>()(string.data(), object) &&
+            std::less<const char*>()(string.data(), object + sizeof(String)))
+            return;
+        
+        used += string.size() + 1;
+        
+        usage.slackBytes += string.capacity() - string.size();
+        
+        ++usage.allocations;
+    }
+    
+    /*! Adds the storage of vec to used and its spare capacity to the slack. */
+    template <class Vector>
+    void countVector(const Vector& vec, std::size_t& used, ParsleyMemoryUsage& usage)
+    {
+        if (! vec.capacity()) return;
+        
+        used += vec.size() * sizeof(typename Vector::value_type);
+        
+        usage.slackBytes += (vec.capacity() - vec.size()) * sizeof(typename Vector::value_type);
+        
+        ++usage.allocations;
+    }
+}
+
+ParsleyMemoryUsage ParsleyNode::memoryUsage() const
+{
+    ParsleyMemoryUsage usage;
+    
+    // walks the links directly, as the accessors would
+    // parse whatever a lazy node has left pending
+    for (const ParsleyNode * node = this; node != 0; )
+    {
+        ++usage.nodes;
+        ++usage.allocations;
+        
+        countString(node->tag, usage.stringBytes, usage);
+        countString(node->data, usage.stringBytes, usage);
+        
+        for (AttrMap::const_iterator itr = node->attrs.begin(), end = node->attrs.end();
+             itr != end;
+             ++itr)
+        {
+            // the entry and the tree node's colour and three links
+            usage.attributeBytes += sizeof(AttrMap::value_type) + 4 * sizeof(void*);
+            
+            ++usage.allocations;
+            
+            countString(itr->first, usage.attributeBytes, usage);
+            countString(itr->second, usage.attributeBytes, usage);
+        }
+        
+        countVector(node->attrNames, usage.indexBytes, usage);
+        
+        if (node->_childIndex)
+        {
+            usage.indexBytes += sizeof(ChildIndex);
+            
+            ++usage.allocations;
+            
+            countVector(*node->_childIndex, usage.indexBytes, usage);
+        }
+        
+        if (node->firstChild)
+        { node = node->firstChild; continue; }
+        
+        while (node != this && ! node->nextSibling)
+            node = node->parent;
+        
+        node = (node == this) ? 0 : node->nextSibling;
+    }
+    
+    usage.nodeBytes = usage.nodes * (nodeHeaderSize + sizeof(ParsleyNode));
+    
+    return usage;
+}
+
+namespace
+{
+    /*! Spreads the bits of h, as the finalizer of MurmurHash3 does. */
+    inline std::uint64_t mixHash(std::uint64_t h)
+    {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        
+        return h;
+    }
+    
+    /*! Folds value into the running hash h, so that the order of the values matters. */
+    inline std::uint64_t combineHash(std::uint64_t h, std::uint64_t value)
+    {
+        return mixHash(h ^ (value + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2)));
+    }
+    
+    /*! Hashes length bytes eight at a time, starting from the length so that strings next to each other can't trade characters. */
+    std::uint64_t hashBytes(const char* bytes, std::size_t length)
+    {
+        std::uint64_t h = length * 0x9e3779b97f4a7c15ULL;
+        
+        for ( ; length >= 8; bytes += 8, length -= 8)
+        {
+            std::uint64_t word;
+            
+            std::memcpy(&word, bytes, 8);
+            
+            h ^= word * 0x87c37b91114253d5ULL;
+            h = ((h << 31) | (h >> 33)) * 0x4cf5ad432745937fULL;
+        }
+        
+        std::uint64_t tail = 0;
+        
+        std::memcpy(&tail, bytes, length);
+        
+        return mixHash(h ^ (tail * 0x87c37b91114253d5ULL));
+    }
+}
+
+void ParsleyNode::_computeHash() const
+{
+    const String& data = _readData()->data;
+    const AttrMap& attrs = _readAttrs()->attrs;
+    const ParsleyNode * children = _readChildren();
+    
+    std::uint64_t h = combineHash(type, hashBytes(tag.data(), tag.size()));
+    
+    h = combineHash(h, hashBytes(data.data(), data.size()));
+    
+    // the counts keep attributes and children apart
+    h = combineHash(h, attrs.size());
+    
+    for (AttrMap::const_iterator itr = attrs.begin(), end = attrs.end(); itr != end; ++itr)
+    {
+        h = combineHash(h, hashBytes(itr->first.data(), itr->first.size()));
+        h = combineHash(h, hashBytes(itr->second.data(), itr->second.size()));
+    }
+    
+    h = combineHash(h, children->_childCount);
+    
+    for (const ParsleyNode * child = children->firstChild; child; child = child->nextSibling)
+        h = combineHash(h, child->_hash);
+    
+    _hash = h;
+    _hashValid = true;
+}
+
+std::uint64_t ParsleyNode::getHash() const
+{
+    // post-order walk over the outdated part of the subtree,
+    // hashing every node once all of its children are hashed
+    const ParsleyNode * node = this;
+    
+    while (! _hashValid)
+    {
+        // the children of a template's nodes are all hashed
+        const ParsleyNode * child = node->_readChildren()->firstChild;
+        
+        while (child && child->_hashValid) child = child->nextSibling;
+        
+        if (child)
+        { node = child; continue; }
+        
+        node->_computeHash();
+        
+        if (node == this) break;
+        
+        // carry on with the next outdated sibling, then the parent
+        const ParsleyNode * next = node->nextSibling;
+        
+        while (next && next->_hashValid) next = next->nextSibling;
+        
+        node = next ? next : node->parent;
+    }
+    
+    return _hash;
+}
+
+std::vector<ParsleyDifference> ParsleyNode::diff(const ParsleyNode& other) const
+{
+    std::vector<ParsleyDifference> differences;
+    
+    if (getHash() == other.getHash()) return differences;
+    
+    // what is still to be reported, last first: entries with both
+    // nodes set are pairs of subtrees that have yet to be compared
+    std::vector<ParsleyDifference> pending;
+    
+    // like the accessors, the differences hand out nodes to modify
+    ParsleyDifference root = { ParsleyDifference::Changed,
+                               const_cast<ParsleyNode*>(this),
+                               const_cast<ParsleyNode*>(&other) };
+    
+    pending.push_back(root);
+    
+    std::vector<ParsleyNode*> before;
+    std::vector<ParsleyNode*> after;
+    
+    std::vector<ParsleyDifference> children;
+    
+    // how often each hash occurs among the children not yet matched
+    std::unordered_map<std::uint64_t, std::size_t> leftBefore;
+    std::unordered_map<std::uint64_t, std::size_t> leftAfter;
+    
+    while (! pending.empty())
+    {
+        ParsleyDifference item = pending.back();
+        
+        pending.pop_back();
+        
+        if (! item.before || ! item.after)
+        {
+            differences.push_back(item);
+            
+            continue;
+        }
+        
+        ParsleyNode * a = item.before;
+        ParsleyNode * b = item.after;
+        
+        // nodes of a different kind are replaced as a whole
+        if (a->type != b->type || a->tag != b->tag)
+        {
+            ParsleyDifference removed = { ParsleyDifference::Removed, a, 0 };
+            ParsleyDifference inserted = { ParsleyDifference::Inserted, 0, b };
+            
+            differences.push_back(removed);
+            differences.push_back(inserted);
+            
+            continue;
+        }
+        
+        if (a->data != b->data || a->attrs != b->attrs) differences.push_back(item);
+        
+        before.clear();
+        after.clear();
+        
+        for (ParsleyNode * child = a->firstChild; child; child = child->nextSibling)
+            before.push_back(child);
+        
+        for (ParsleyNode * child = b->firstChild; child; child = child->nextSibling)
+            after.push_back(child);
+        
+        // equal children at the start and at the end pair up
+        std::size_t head = 0;
+        
+        while (head < before.size() && head < after.size() &&
+               before[head]->_hash == after[head]->_hash)
+            ++head;
+        
+        std::size_t endBefore = before.size();
+        std::size_t endAfter = after.size();
+        
+        while (endBefore > head && endAfter > head &&
+               before[endBefore - 1]->_hash == after[endAfter - 1]->_hash)
+        {
+            --endBefore;
+            --endAfter;
+        }
+        
+        // the rest in order: a child that turns up unchanged further on
+        // in the other list is kept for that, others pair up by position
+        // while their kinds agree
+        children.clear();
+        
+        leftBefore.clear();
+        leftAfter.clear();
+        
+        for (std::size_t k = head; k < endBefore; ++k) ++leftBefore[before[k]->_hash];
+        
+        for (std::size_t k = head; k < endAfter; ++k) ++leftAfter[after[k]->_hash];
+        
+        std::size_t i = head;
+        std::size_t j = head;
+        
+        while (i < endBefore || j < endAfter)
+        {
+            ParsleyNode * x = (i < endBefore) ? before[i] : 0;
+            ParsleyNode * y = (j < endAfter) ? after[j] : 0;
+            
+            bool keepX = x && y && x->_hash != y->_hash && leftAfter[x->_hash] > 0;
+            bool keepY = x && y && x->_hash != y->_hash && leftBefore[y->_hash] > 0;
+            
+            if (x && y && (x->_hash == y->_hash ||
+                           (keepX == keepY && x->type == y->type && x->tag == y->tag)))
+            {
+                if (x->_hash != y->_hash)
+                {
+                    ParsleyDifference pair = { ParsleyDifference::Changed, x, y };
+                    
+                    children.push_back(pair);
+                }
+                
+                --leftBefore[x->_hash];
+                --leftAfter[y->_hash];
+                
+                ++i;
+                ++j;
+            }
+            
+            // otherwise take from the list with more children left,
+            // unless only the other child turns up again later
+            else if (x && (! y || keepY || (! keepX && endBefore - i >= endAfter - j)))
+            {
+                ParsleyDifference removed = { ParsleyDifference::Removed, x, 0 };
+                
+                children.push_back(removed);
+                
+                --leftBefore[x->_hash];
+                
+                ++i;
+            }
+            
+            else
+            {
+                ParsleyDifference inserted = { ParsleyDifference::Inserted, 0, y };
+                
+                children.push_back(inserted);
+                
+                --leftAfter[y->_hash];
+                
+                ++j;
+            }
+        }
+        
+        pending.insert(pending.end(), children.rbegin(), children.rend());
+    }
+    
+    return differences;
+}
+
+template <class Lookup, class Intern>
+void ParsleyNode::_assignTagName(const Lookup& lookup, const Intern& intern) const
+{
+    ParsleyNames::Id prefix;
+    
+    splitName(tag, prefix, localId, intern);
+    
+    // unprefixed tags are in the default namespace, if any
+    nsId = lookup(prefix);
+    
+    _tagNameResolved = true;
+}
+
+template <class Lookup>
+void ParsleyNode::_assignAttrNames(const Lookup& lookup) const
+{
+    attrNames.clear();
+    
+    for (AttrMap::iterator itr = const_cast<AttrMap&>(attrs).begin(); itr != attrs.end(); ++itr)
+    {
+        ParsleyNames::Id prefix;
+        
+        AttrName name;
+        
+        splitName(itr->first, prefix, name.local, internName);
+        
+        if (prefix == xmlnsPrefix || (prefix == ParsleyNames::None && name.local == xmlnsPrefix))
+            name.ns = xmlnsNamespace;
+        
+        // unprefixed attributes are in no namespace at all
+        else name.ns = prefix == ParsleyNames::None ? ParsleyNames::None : lookup(prefix);
+        
+        name.attr = itr;
+        
+        attrNames.push_back(name);
+    }
+    
+    _attrNamesResolved = true;
+}
+
+void ParsleyNode::_resolveNames(bool attributes) const
+{
+    auto lookup = [this] (ParsleyNames::Id prefix) { return _lookupNamespace(prefix); };
+    
+    if (attributes)
+    {
+        _realize(LazyAttrs);
+        
+        _assignAttrNames(lookup);
+    }
+    
+    else _assignTagName(lookup, internName);
+}
+
+ParsleyNames::Id ParsleyNode::_lookupNamespace(ParsleyNames::Id prefix) const
+{
+    if (prefix == xmlPrefix) return xmlNamespace;
+    
+    std::string key = "xmlns";
+    
+    if (prefix != ParsleyNames::None) key += ":" + ParsleyNames::getName(prefix);
+    
+    String declaration(key.begin(), key.end(), attrs.get_allocator());
+    
+    for (const ParsleyNode * node = this; node != 0; node = node->parent)
+    {
+        node->_realize(LazyAttrs);
+        
+        AttrMap::const_iterator itr = node->attrs.find(declaration);
+        
+        if (itr != node->attrs.end())
+        { return ParsleyNames::intern(itr->second.data(), itr->second.size()); }
+    }
+    
+    return ParsleyNames::None;
+}
+
+ParsleyNode::AttrMap::iterator ParsleyNode::_findAttr(ParsleyNames::Id ns, ParsleyNames::Id localName)
+{
+    _resolveAttrNames();
+    
+    for (AttrNameVec::const_iterator itr = attrNames.begin(); itr != attrNames.end(); ++itr)
+    {
+        if (itr->ns == ns && itr->local == localName) return itr->attr;
+    }
+    
+    return attrs.end();
+}
+
+std::string ParsleyNode::getAttr(ParsleyNames::Id ns, ParsleyNames::Id localName)
+{
+    AttrMap::iterator itr = _findAttr(ns, localName);
+    
+    if (itr == attrs.end())
+    {
+        throw ParseError("Could not find attribute: {" + ParsleyNames::getName(ns) + "}" +
+                         ParsleyNames::getName(localName));
+    }
+    
+    return toStdString(itr->second);
+}
+
+ParsleyNode::NodeVec ParsleyNode::getElementsByTagName(ParsleyNames::Id ns, ParsleyNames::Id localName)
+{
+    _realize(LazyChildren);
+    
+    NodeVec vec;
+    
+    for (ParsleyNode * itr = firstChild; itr != 0; itr = itr->nextSibling)
+    {
+        if (itr->type == ElementNode &&
+            itr->getLocalName() == localName &&
+            itr->getNamespace() == ns)
+        { vec.push_back(itr); }
+    }
+    
+    return vec;
+}
+
+ParsleyNode* ParsleyNode::getNthChild(unsigned int n) const
+{
+    _realize(LazyChildren);
+    
+    if (n >= _childCount) return 0;
+    
+    // walking a few siblings is cheaper than an index
+    if (! _childIndexValid && n < 8)
+    {
+        ParsleyNode* node = firstChild;
+        
+        while(n--)
+        { node = node->nextSibling; }
+        
+        return node;
+    }
+    
+    if (! _childIndexValid) _buildChildIndex();
+    
+    return (*_childIndex)[n];
+}
+
+void ParsleyNode::_buildChildIndex() const
+{
+    if (! _childIndex)
+    {
+        ParsleyAllocator<ChildIndex> allocator(getMemoryResource());
+        
+        ChildIndex * index = allocator.allocate(1);
+        
+        _childIndex = new (index) ChildIndex(allocator);
+    }
+    
+    _childIndex->clear();
+    _childIndex->reserve(_childCount);
+    
+    for (ParsleyNode* node = firstChild; node != 0; node = node->nextSibling)
+    { _childIndex->push_back(node); }
+    
+    _childIndexValid = true;
+}
+
+ParsleyNode::NodeVec ParsleyNode::getElementsByTagName(const std::string& tagName)
+{
+    _realize(LazyChildren);
+    
+    NodeVec vec;
+    
+    ParsleyNode * itr = firstChild;
+    
+    while (itr != 0)
+    {
+        if (itr->type == ElementNode &&
+            itr->tag.size() == tagName.size() &&
+            std::equal(itr->tag.begin(), itr->tag.end(), tagName.begin()))
+        { vec.push_back(itr); }
+        
+        itr = itr->nextSibling;
+    }
+    
+    return vec;
+}
+
+void ParsleyNode::insertData(const std::string::size_type ind, const std::string& newData)
+{
+    _realize(LazyData);
+    
+    if (ind < data.size()) data.insert(ind, newData.data(), newData.size());
+    
+    else throw ParseError("Index out ouf bounds!");
+    
+    _invalidateHash();
+}
+
+void ParsleyNode::replaceData(const std::string& oldData, const std::string& newData)
+{
+    _realize(LazyData);
+    
+    if (oldData.empty()) return;
+    
+    String::size_type pos = data.find(oldData.data(), 0, oldData.size());
+    
+    while (pos != String::npos)
+    {
+        data.replace(pos, oldData.size(), newData.data(), newData.size());
+        
+        pos = data.find(oldData.data(), pos + newData.size(), oldData.size());
+        
+        _invalidateHash();
+    }
+}
+
+std::string ParsleyNode::substringData(const std::string::size_type ind,
+                                       std::string::size_type count)
+{
+    const String& data = _readData()->data;
+    
+    if (ind > data.size()) throw ParseError("Index out ouf bounds!");
+    
+    count = std::min(count, data.size() - ind);
+    
+    return std::string(data.data() + ind, count);
+}
+
+ParsleyNode::NodeVec ParsleyNode::getElementsByAttrName(const std::string& attrName)
+{
+    _realize(LazyChildren);
+    
+    NodeVec vec;
+    
+    ParsleyNode * itr = firstChild;
+    
+    while (itr != 0)
+    {
+        if (itr->findAttr(attrName))
+        { vec.push_back(itr); }
+        
+        itr = itr->nextSibling;
+    }
+    
+    return vec;
+}
+
+bool ParsleyNode::insertChild(ParsleyNode* childOfThisNode, ParsleyNode * node)
+{
+    _realize(LazyChildren);
+    
+    if (childOfThisNode == 0 ||
+        childOfThisNode->parent != this)
+        return false;
+    
+    node->parent = this;
+    
+    // the declarations in scope may differ here
+    node->_tagNameResolved = false;
+    node->_attrNamesResolved = false;
+    
+    // if there is a previous sibling, connect it with the
+    // node, else the node becomes the first child
+    node->prevSibling = childOfThisNode->prevSibling;
+    
+    if (childOfThisNode->prevSibling != 0)
+        childOfThisNode->prevSibling->nextSibling = node;
+    
+    else firstChild = node;
+    
+    // connect the node with the child
+    node->nextSibling = childOfThisNode;
+    childOfThisNode->prevSibling = node;
+    
+    ++_childCount;
+    _childIndexValid = false;
+    
+    _invalidateHash();
+    
+    return true;
+}
+
+bool ParsleyNode::removeChild(ParsleyNode* childOfThisNode)
+{
+    return detachChild(childOfThisNode) != 0;
+}
+
+ParsleyNode::NodePtr ParsleyNode::detachChild(ParsleyNode* childOfThisNode)
+{
+    _realize(LazyChildren);
+    
+    // check if valid node
+    if (childOfThisNode == 0 ||
+        childOfThisNode->parent != this)
+        return NodePtr();
+    
+    // if there is a previous sibling
+    // and a next, connect those two
+    if (childOfThisNode->prevSibling != 0 &&
+        childOfThisNode->nextSibling != 0)
+    {
+        // connect the previous and the next
+        childOfThisNode->prevSibling->nextSibling =
+        childOfThisNode->nextSibling;
+        
+        childOfThisNode->nextSibling->prevSibling =
+        childOfThisNode->prevSibling;
+    }
+    
+    // if this is the last child of a node
+    // connect it to the previous if there
+    // is one, else make the parent's last
+    // child pointer be 0
+    if (childOfThisNode == lastChild)
+    {
+        if (childOfThisNode->prevSibling != 0)
+        {
+            lastChild = childOfThisNode->prevSibling;
+            lastChild->nextSibling = 0;
+        }
+        
+        else lastChild = 0;
+    }
+    
+    // same as for last child, but for previous child
+    if (childOfThisNode == firstChild)
+    {
+        if (childOfThisNode->nextSibling != 0)
+        {
+            firstChild = childOfThisNode->nextSibling;
+            firstChild->prevSibling = 0;
+        }
+        
+        else firstChild = 0;
+    }
+    
+    childOfThisNode->parent = 0;
+    childOfThisNode->prevSibling = 0;
+    childOfThisNode->nextSibling = 0;
+    
+    --_childCount;
+    
+    // removing the last child keeps the index intact
+    if (_childIndexValid && ! _childIndex->empty() && _childIndex->back() == childOfThisNode)
+        _childIndex->pop_back();
+    
+    else _childIndexValid = false;
+    
+    _invalidateHash();
+    
+    return NodePtr(childOfThisNode);
+}
+
+Parsley::TokenVec Parsley::_parse(Str_cItr begin, Str_cItr end)
+{
+    TokenVec vec;
+    
+    std::size_t searched = 0;
+    
+    _scan(begin, end, true, vec, searched);
+    
+    return vec;
+}
+
+Str_cItr Parsley::_scan(Str_cItr begin, Str_cItr end, bool final, TokenVec& vec, std::size_t& searched)
+{
+    Str_cItr i = begin;
+    Str_cItr j = i;
+    
+    Str_cItr checked = begin;
+    
+    // the token at begin is known not to end before here, and
+    // only that first token can start before it
+    Str_cItr resume = begin + searched;
+    
+    searched = 0;
+    
+    while (i != end)
+    {
+        // unfinished text has no '<' before resume, an
+        // unfinished tag is found where it starts
+        j = findChar(*i == '<' ? i : std::max(i, resume), end, '<');
+        
+        // text may go on in the next part of the document
+        if (j == end && ! final)
+        {
+            searched = end - i;
+            
+            break;
+        }
+        
+        // text between tags, unless it's only whitespace
+        if (std::find_if_not(i, j, ::isspace) != j)
+        {
+            if (static_cast<std::size_t>(j - i) > _limits.maxTokenLength)
+                throw ParseError("Text exceeds the maximum token length!", i - _docBegin);
+            
+            Token token = { static_cast<std::size_t>(i - _docBegin),
+                            static_cast<std::size_t>(j - _docBegin),
+                            TextToken };
+            
+            vec.push_back(token);
+        }
+        
+        if (j == end) break;
+        
+        TokenType type = TagToken;
+        
+        // where to look for the terminator
+        Str_cItr from = j;
+        
+        const char* terminator = ">";
+        std::size_t length = 1;
+        
+        // comments, CDATA and processing instructions may
+        // contain '>', so find their proper terminators
+        if (startsWith(j, end, "<!--", 4))
+        {
+            type = CommentToken;
+            from = j + 4;
+            terminator = "-->";
+            length = 3;
+        }
+        
+        else if (startsWith(j, end, "<![CDATA[", 9))
+        {
+            type = CDataToken;
+            from = j + 9;
+            terminator = "]]>";
+            length = 3;
+        }
+        
+        else if (startsWith(j, end, "<?", 2))
+        {
+            type = InstructionToken;
+            from = j + 2;
+            terminator = "?>";
+            length = 2;
+        }
+        
+        else if (startsWith(j, end, "<!DOCTYPE", 9))
+        {
+            type = DoctypeToken;
+            
+            // an internal subset ends in "]>"
+            Str_cItr close = findChar(j, end, '>');
+            Str_cItr subset = findChar(j, close, '[');
+            
+            if (subset != close)
+            {
+                from = subset;
+                terminator = "]>";
+                length = 2;
+            }
+        }
+        
+        bool terminated;
+        
+        // a '>' in a quoted attribute value doesn't end the tag
+        if (type == TagToken)
+        {
+            i = findTagEnd(std::max(j, resume), end, &from);
+            
+            terminated = i != end;
+            
+            if (terminated) ++i;
+        }
+        
+        else
+        {
+            // the terminator may straddle what was searched before
+            if (resume - from >= static_cast<std::ptrdiff_t>(length))
+                from = resume - (length - 1);
+            
+            i = findTerminator(from, end, terminator, length);
+            
+            // the terminator may also end the document exactly
+            terminated = i != end ||
+                         (static_cast<std::size_t>(end - from) >= length &&
+                          std::equal(end - length, end, terminator));
+        }
+        
+        if (! terminated)
+        {
+            // the token may be completed by the next part of the
+            // document, and needn't be searched again up to here
+            if (! final)
+            {
+                searched = (type == TagToken ? from : end) - j;
+                
+                i = j;
+                
+                break;
+            }
+            
+            ParseError error("Could not find matching brackets '<' '>' !", j - _docBegin);
+            
+            if (! _recover) throw error;
+            
+            // drop the unterminated tag at the end
+            _diagnose(error);
+            
+            break;
+        }
+        
+        if (static_cast<std::size_t>(i - j) > _limits.maxTokenLength)
+            throw ParseError("Tag exceeds the maximum token length!", j - _docBegin);
+        
+        // validate in blocks right behind the scan,
+        // while they are still in cache
+        if (_validating && i - checked >= 16384)
+        {
+            _checkUtf8(checked, i);
+            
+            checked = i;
+        }
+        
+        if (type == TagToken ||
+            type == CDataToken ||
+            (_keepComments && (type == CommentToken || type == InstructionToken)))
+        {
+            Token token = { static_cast<std::size_t>(j - _docBegin),
+                            static_cast<std::size_t>(i - _docBegin),
+                            type };
+            
+            vec.push_back(token);
+        }
+    }
+    
+    // tokens start with '<', so no character is split here
+    if (_validating) _checkUtf8(checked, final ? end : i);
+    
+    return final ? end : i;
+}
+
+void ParsleyNode::prependChild(ParsleyNode *node)
+{
+    _realize(LazyChildren);
+    
+    if (node == this)
+        throw ParseError("Prepending Node to self");
+    
+    node->parent = this;
+    
+    // the declarations in scope may differ here
+    node->_tagNameResolved = false;
+    node->_attrNamesResolved = false;
+    
+    if (firstChild != 0)
+    {
+        firstChild->prevSibling = node;
+        
+        node->nextSibling = firstChild;
+    }
+    
+    firstChild = node;
+    
+    if (lastChild == 0)
+        lastChild = firstChild;
+    
+    ++_childCount;
+    _childIndexValid = false;
+    
+    _invalidateHash();
+}
+
+void ParsleyNode::appendChild(ParsleyNode *node)
+{
+    _realize(LazyChildren);
+    
+    if (node == this)
+        throw ParseError("Appending Node to self");
+    
+    // appending keeps the index up to date,
+    // so rows can be added and read in turn
+    if (_childIndexValid) _childIndex->push_back(node);
+    
+    node->parent = this;
+    
+    // the declarations in scope may differ here
+    node->_tagNameResolved = false;
+    node->_attrNamesResolved = false;
+    
+    if (lastChild != 0)
+    {
+        lastChild->nextSibling = node;
+        
+        node->prevSibling = lastChild;
+    }
+    
+    lastChild = node;
+    
+    if (firstChild == 0)
+        firstChild = lastChild;
+    
+    ++_childCount;
+    
+    _invalidateHash();
+}
+
+void Parsley::_declareNamespaces(const ParsleyNode * node)
+{
+    const ParsleyNode::AttrMap& attrs = node->attrs;
+    
+    if (attrs.empty()) return;
+    
+    // keys are sorted, so the declarations are all
+    // in one run starting at "xmlns", if any
+    ParsleyNode::String xmlns("xmlns", attrs.get_allocator());
+    
+    for (ParsleyNode::AttrMap::const_iterator itr = attrs.lower_bound(xmlns); itr != attrs.end(); ++itr)
+    {
+        const ParsleyNode::String& key = itr->first;
+        
+        if (key.compare(0, 5, xmlns) != 0) break;
+        
+        NamespaceBinding binding;
+        
+        if (key.size() == 5) binding.prefix = ParsleyNames::None;
+        
+        else if (key[5] == ':') binding.prefix = _intern(key.data() + 6, key.size() - 6);
+        
+        else continue;
+        
+        binding.ns = _intern(itr->second.data(), itr->second.size());
+        
+        _bindings.push_back(binding);
+    }
+}
+
+ParsleyNames::Id Parsley::_intern(const char* name, std::size_t length)
+{
+    _nameKey.assign(name, length);
+    
+    std::unordered_map<std::string, ParsleyNames::Id>::const_iterator itr = _names.ids.find(_nameKey);
+    
+    if (itr != _names.ids.end()) return itr->second;
+    
+    ParsleyNames::Id id = ParsleyNames::intern(name, length, _resource);
+    
+    // documents with ever new names would grow the cache for good
+    if (_names.ids.size() >= nameCacheSize) _names.ids.clear();
+    
+    _names.ids.emplace(_nameKey, id);
+    
+    return id;
+}
+
+ParsleyNames::Id Parsley::_lookupNamespace(ParsleyNames::Id prefix) const
+{
+    if (prefix == xmlPrefix) return xmlNamespace;
+    
+    for (std::vector<NamespaceBinding>::const_reverse_iterator itr = _bindings.rbegin(); itr != _bindings.rend(); ++itr)
+    {
+        if (itr->prefix == prefix) return itr->ns;
+    }
+    
+    return ParsleyNames::None;
+}
+
+template <class Callback>
+void Parsley::_scanAttrs(Str_cItr begin, Str_cItr end, Callback callback) const
+{
+    std::size_t count = 0;
+    
+    // single pass over the tag, handing slices
+    // of the document to the callback
+    while ((begin = skipSpace(begin, end)) != end)
+    {
+        std::size_t offset = begin - _docBegin;
+        
+        Str_cItr keyEnd = std::find_if(begin, end, [] (char c) { return c == '=' || ::isspace(c); });
+        
+        Str_cItr key = begin;
+        
+        begin = skipSpace(keyEnd, end);
+        
+        if (begin == end || *begin != '=')
+            throw ParseError("Attribute " + std::string(key, keyEnd) + " has no value!", offset);
+        
+        begin = skipSpace(++begin, end);
+        
+        if (begin == end || (*begin != '"' && *begin != '\''))
+            throw ParseError("Attribute value must be quoted!", offset);
+        
+        char quote = *begin++;
+        
+        Str_cItr valueEnd = std::find(begin, end, quote);
+        
+        if (valueEnd == end)
+            throw ParseError("Unterminated attribute value!", offset);
+        
+        if (key == keyEnd)
+            throw ParseError("Attribute without a name!", offset);
+        
+        callback(key, keyEnd, begin, valueEnd, offset);
+        
+        if (++count > _limits.maxAttributes)
+            throw ParseError("Element exceeds the maximum number of attributes!", offset);
+        
+        begin = valueEnd + 1;
+    }
+}
+
+void Parsley::_getAttrs(Str_cItr begin, Str_cItr end, ParsleyNode * node) const
+{
+    ParsleyNode::AttrMap& attrs = node->attrs;
+    
+    // build the key and value strings directly from the document
+    _scanAttrs(begin, end, [&attrs] (Str_cItr key, Str_cItr keyEnd,
+                                     Str_cItr value, Str_cItr valueEnd, std::size_t offset)
+    {
+        ParsleyNode::String name(key, keyEnd, attrs.get_allocator());
+        
+        ParsleyNode::String decoded(attrs.get_allocator());
+        
+        decoded.reserve(valueEnd - value);
+        
+        decodeEntities(value, valueEnd, decoded);
+        
+        // emplace() won't overwrite, so a successful
+        // insert means the key wasn't there before
+        if (! attrs.emplace(std::move(name), std::move(decoded)).second)
+            throw ParseError("Duplicate attribute!", offset);
+    });
+}
+
+void Parsley::_tagContents(Str_cItr& begin, Str_cItr& end, bool& selfClosed) const
+{
+    Str_cItr i,j;
+    
+    i = std::find(begin, end, '<');
+    
+    j = findTagEnd(i, end);
+    
+    std::size_t offset = begin - _docBegin;
+    
+    if (j == end)
+        throw ParseError("Could not find matching brackets '<' '>' !", offset);
+    
+    // remove brackets
+    ++i;
+    
+    while (j != i && ::isspace(*(j - 1))) --j;
+    
+    // a trailing '/' marks a self-closing tag
+    selfClosed = j != i && *(j - 1) == '/';
+    
+    if (selfClosed) --j;
+    
+    if (i == j)
+        throw ParseError("Empty tag found!", offset);
+    
+    begin = i;
+    end = j;
+}
+ParsleyNode * Parsley::_makeNode(Str_cItr begin, Str_cItr end)
+{
+    std::size_t offset = begin - _docBegin;
+    
+    bool selfClosed;
+    
+    _tagContents(begin, end, selfClosed);
+    
+    Str_cItr nameEnd = std::find_if(begin, end, ::isspace);
+    
+    if (static_cast<std::size_t>(nameEnd - begin) > _limits.maxTokenLength)
+        throw ParseError("Tag name exceeds the maximum token length!", offset);
+    
+    std::unique_ptr<ParsleyNode> node(new (_resource) ParsleyNode(_resource));
+    
+    node->tag.assign(begin, nameEnd);
+    
+    Clock::time_point start;
+    
+    if (_stats) start = Clock::now();
+    
+    _getAttrs(nameEnd, end, node.get());
+    
+    if (_stats)
+    {
+        _stats->attrSeconds += secondsSince(start);
+        _stats->attributes += node->attrs.size();
+    }
+    
+    node->selfClosed = selfClosed;
+    
+    return node.release();
+}
+std::size_t Parsley::_matchTokens(const TokenVec& tokens, std::vector<std::size_t>& match)
+{
+    static const char* nameEnd = " \t\r\n/>";
+    
+    match.assign(tokens.size(), 0);
+    
+    // indices of the currently open start tags
+    std::vector<std::size_t> open;
+    
+    std::size_t root = tokens.size();
+    
+    for (std::size_t i = 0; i < tokens.size(); ++i)
+    {
+        Str_cItr begin = _docBegin + tokens[i].begin;
+        Str_cItr end = _docBegin + tokens[i].end;
+        
+        if (tokens[i].type != TagToken) continue;
+        
+        if (*(begin + 1) == '/')
+        {
+            if (open.empty())
+                throw ParseError("Found closing tag that does not close any node!", tokens[i].begin);
+            
+            Str_cItr name = begin + 2;
+            Str_cItr nameLast = std::find_first_of(name, end, nameEnd, nameEnd + 6);
+            
+            Str_cItr other = _docBegin + tokens[open.back()].begin + 1;
+            Str_cItr otherLast = std::find_first_of(other, end, nameEnd, nameEnd + 6);
+            
+            if (nameLast - name != otherLast - other || ! std::equal(name, nameLast, other))
+                throw ParseError("Found closing tag: " + std::string(name, nameLast) +
+                                 " that does not close current node!", tokens[i].begin);
+            
+            match[open.back()] = i;
+            
+            open.pop_back();
+            
+            // everything after the root is ignored
+            if (open.empty()) break;
+            
+            continue;
+        }
+        
+        if (++_nodeCount > _limits.maxNodes)
+            throw ParseError("Document exceeds the maximum number of elements!", tokens[i].begin);
+        
+        if (open.size() + 1 > _limits.maxDepth)
+            throw ParseError("Document exceeds the maximum nesting depth!", tokens[i].begin);
+        
+        if (_stats)
+        {
+            ++_stats->nodes;
+            
+            _stats->maxDepth = std::max(_stats->maxDepth, open.size() + 1);
+        }
+        
+        if (root == tokens.size()) root = i;
+        
+        Str_cItr last = end - 2;
+        
+        while (last != begin && ::isspace(*last)) --last;
+        
+        if (*last == '/')
+        {
+            match[i] = i;
+            
+            if (open.empty()) break;
+        }
+        
+        else open.push_back(i);
+    }
+    
+    if (root == tokens.size())
+        throw ParseError("Document contains no elements!");
+    
+    if (! open.empty())
+        throw ParseError("Could not find matching closing tag!", tokens[open.back()].begin);
+    
+    return root;
+}
+
+ParsleyNode * Parsley::_makeLazyNode(const std::shared_ptr<ParsleyLazyDocument>& doc, std::size_t index)
+{
+    const Token& token = doc->tokens[index];
+    
+    bool selfClosed;
+    
+    Str_cItr begin = _docBegin + token.begin;
+    Str_cItr end = _docBegin + token.end;
+    
+    _tagContents(begin, end, selfClosed);
+    
+    Str_cItr nameEnd = std::find_if(begin, end, ::isspace);
+    
+    ParsleyNode * node = new (_resource) ParsleyNode(_resource);
+    
+    node->tag.assign(begin, nameEnd);
+    node->selfClosed = selfClosed;
+    node->isClosed = true;
+    
+    node->_pending = selfClosed ? 0 : ParsleyNode::LazyChildren | ParsleyNode::LazyData;
+    
+    // only bother with attributes if there is more than the name
+    if (skipSpace(nameEnd, end) != end)
+        node->_pending |= ParsleyNode::LazyAttrs;
+    
+    if (node->_pending)
+    {
+        node->_lazy = doc;
+        node->_lazyToken = index;
+    }
+    
+    return node;
+}
+
+void Parsley::_materialize(const ParsleyNode * constNode, unsigned char what)
+{
+    // the node is logically unchanged, it only
+    // fills in what it would have had all along
+    ParsleyNode * node = const_cast<ParsleyNode*>(constNode);
+    
+    const ParsleyLazyDocument& doc = *node->_lazy;
+    
+    const std::size_t index = node->_lazyToken;
+    
+    const Token& token = doc.tokens[index];
+    
+    if (what & ParsleyNode::LazyAttrs)
+    {
+        bool selfClosed;
+        
+        Str_cItr begin = _docBegin + token.begin;
+        Str_cItr end = _docBegin + token.end;
+        
+        _tagContents(begin, end, selfClosed);
+        
+        try { _getAttrs(std::find_if(begin, end, ::isspace), end, node); }
+        
+        catch (...)
+        {
+            // leave everything pending, so the next
+            // access reports the error again
+            node->attrs.clear();
+            node->_pending |= what;
+            
+            throw;
+        }
+    }
+    
+    if (! (what & (ParsleyNode::LazyChildren | ParsleyNode::LazyData))) return;
+    
+    // walk the tokens directly inside this node,
+    // skipping over the children's contents
+    for (std::size_t i = index + 1, end = doc.match[index]; i < end; )
+    {
+        const Token& child = doc.tokens[i];
+        
+        if (child.type == TagToken)
+        {
+            if (what & ParsleyNode::LazyChildren)
+                node->appendChild(_makeLazyNode(node->_lazy, i));
+            
+            i = doc.match[i] + 1;
+            
+            continue;
+        }
+        
+        if (child.type == CommentToken || child.type == InstructionToken)
+        {
+            if (what & ParsleyNode::LazyChildren)
+                node->appendChild(_makeMarkupNode(child));
+        }
+        
+        else if (what & ParsleyNode::LazyData)
+            _appendData(child, node);
+        
+        ++i;
+    }
+}
+
+void Parsley::_appendData(const Token& token, ParsleyNode * node) const
+{
+    Str_cItr begin = _docBegin + token.begin;
+    Str_cItr end = _docBegin + token.end;
+    
+    std::size_t size = node->data.size();
+    
+    // CDATA is taken verbatim, without the "<![CDATA[" and "]]>"
+    if (token.type == CDataToken) node->data.append(begin + 9, end - 3);
+    
+    else appendText(begin, end, node->data);
+    
+    if (_stats) _stats->textBytes += node->data.size() - size;
+}
+
+ParsleyNode * Parsley::_makeMarkupNode(const Token& token) const
+{
+    Str_cItr begin = _docBegin + token.begin;
+    Str_cItr end = _docBegin + token.end;
+    
+    std::unique_ptr<ParsleyNode> node(new (_resource) ParsleyNode(_resource));
+    
+    node->isClosed = true;
+    
+    node->_sourceOffset = token.begin;
+    node->_sourceLength = token.end - token.begin;
+    
+    if (token.type == CommentToken)
+    {
+        node->type = ParsleyNode::CommentNode;
+        
+        node->data.assign(begin + 4, end - 3);
+    }
+    
+    else
+    {
+        node->type = ParsleyNode::InstructionNode;
+        
+        // the target becomes the tag, the rest the data
+        Str_cItr target = begin + 2;
+        Str_cItr targetEnd = std::find_if(target, end - 2, ::isspace);
+        
+        node->tag.assign(target, targetEnd);
+        node->data.assign(skipSpace(targetEnd, end - 2), end - 2);
+    }
+    
+    if (_hashing) node->_computeHash();
+    
+    return node.release();
+}
+
+bool Parsley::_closesAncestor(const ParsleyNode::String& closingTag, const ParsleyNode * node) const
+{
+    for ( ; node != 0; node = node->parent)
+    {
+        if (closingTag.size() == node->tag.size() + 1 &&
+            std::equal(closingTag.begin() + 1, closingTag.end(), node->tag.begin()))
+            return true;
+    }
+    
+    return false;
+}
+
+Parsley::TokenVec_cItr Parsley::_makeNodeTree(TokenVec_cItr itr, TokenVec_cItr end, ParsleyNode * parent)
+{
+    Str_cItr begin = _docBegin + itr->begin;
+    Str_cItr last = _docBegin + itr->end;
+    
+    if (itr->type == TextToken || itr->type == CDataToken)
+        _appendData(*itr, parent);
+    
+    else if (itr->type == CommentToken || itr->type == InstructionToken)
+        parent->appendChild(_makeMarkupNode(*itr));
+    
+    else
+    {
+        // owned here until it is appended to the tree
+        std::unique_ptr<ParsleyNode> node;
+        
+        try { node.reset(_makeNode(begin, last)); }
+        
+        catch (ParseError& error)
+        {
+            if (! _recover) throw;
+            
+            // drop the broken tag, its contents go to the parent
+            _diagnose(error);
+            
+            return itr;
+        }
+        
+        // check if the node is a closing tag
+        bool isClosing = (! node->tag.empty() && *(node->tag.begin()) == '/');
+        
+        // if this is a closing tag, close the parent
+        if (isClosing)
+        {
+            bool isClosingOfPar = node->tag.size() == parent->tag.size() + 1 &&
+                                  std::equal(node->tag.begin() + 1,
+                                             node->tag.end() , parent->tag.begin());
+            
+            if (isClosingOfPar)
+            {
+                if (parent->isClosed)
+                    throw ParseError("Found duplicate closing tag for opening tag: " +
+                                     toStdString(parent->tag), itr->begin);
+                
+                parent->isClosed = true;
+                
+            } else if (! _recover)
+                throw ParseError("Found closing tag: " + toStdString(node->tag) +
+                                 " that does not close current node!", itr->begin);
+            
+            else if (_closesAncestor(node->tag, parent))
+            {
+                _diagnose(ParseError("Closed unterminated element: " +
+                                     toStdString(parent->tag), itr->begin));
+                
+                parent->isClosed = true;
+                
+                // hand the closing tag back up to the ancestor it belongs to
+                --itr;
+            }
+            
+            else _diagnose(ParseError("Skipped closing tag: " + toStdString(node->tag) +
+                                      " that closes no open element", itr->begin));
+        }
+        
+        else
+        {
+            if (++_nodeCount > _limits.maxNodes)
+                throw ParseError("Document exceeds the maximum number of elements!", itr->begin);
+            
+            if (_depth + 1 > _limits.maxDepth)
+                throw ParseError("Document exceeds the maximum nesting depth!", itr->begin);
+            
+            node->_sourceOffset = itr->begin;
+            
+            // append node to current parent
+            parent->appendChild(node.get());
+            
+            ParsleyNode* child = node.release();
+            
+            // resolve names against the declarations in scope,
+            // including the ones on the element itself
+            std::size_t scope = _bindings.size();
+            
+            _declareNamespaces(child);
+            
+            child->_assignTagName([this] (ParsleyNames::Id prefix) { return _lookupNamespace(prefix); },
+                                  [this] (const char* name, std::size_t length) { return _intern(name, length); });
+            
+            if (_stats)
+            {
+                ++_stats->nodes;
+                
+                _stats->maxDepth = std::max(_stats->maxDepth, _depth + 1);
+            }
+            
+            // a self-closing node has no content to recurse into
+            if (child->selfClosed) child->isClosed = true;
+            
+            ++_depth;
+            
+            while (! child->isClosed)
+            {
+                if (++itr == end)
+                {
+                    ParseError error("Could not find matching closing tag for: " +
+                                     toStdString(child->tag), (itr - 1)->end);
+                    
+                    if (! _recover) throw error;
+                    
+                    _diagnose(error);
+                    
+                    // close it, and every open element above it
+                    child->isClosed = true;
+                    
+                    --itr;
+                    
+                    break;
+                }
+                
+                itr = _makeNodeTree(itr, end, child);
+            }
+            
+            // the element ends with its closing tag, and its
+            // children are remembered relative to its start
+            child->_sourceLength = itr->end - child->_sourceOffset;
+            
+            for (ParsleyNode * node = child->firstChild; node; node = node->nextSibling)
+                node->_sourceOffset -= child->_sourceOffset;
+            
+            // its children are hashed by now, and still in cache
+            if (_hashing) child->_computeHash();
+            
+            --_depth;
+            
+            _bindings.resize(scope);
+        }
+    }
+    
+    return itr;
+}
+
+void Parsley::_nodeToString(const ParsleyNode *node, std::string& str, const std::string& indent) const
+{
+    str += indent;
+    str += "<";
+    
+    str.append(node->tag.begin(), node->tag.end());
+    
+    const ParsleyNode * attrs = node->_readAttrs();
+    
+    for (ParsleyNode::AttrMap::const_iterator itr = attrs->attrs.begin(), end = attrs->attrs.end();
+         itr != end;
+         ++itr)
+    {
+        str += " ";
+        str.append(itr->first.begin(), itr->first.end());
+        str += "=\"";
+        escape(itr->second, str, true);
+        str += "\"";
+    }
+    
+    if (node->selfClosed) str += "/";
+    
+    str += ">";
+}
+
+void Parsley::_treeToString(const ParsleyNode * root, std::string& str, std::string& indent) const
+{
+    // siblings are handled by the loop and children by
+    // recursion, so the stack only grows with depth
+    for (const ParsleyNode * node = root; node != 0; node = node->parent ? node->nextSibling : 0)
+    {
+        // a node derived from a template reads the parts it
+        // hasn't copied yet from there, so saving copies nothing
+        const ParsleyNode * content = node->_readData();
+        const ParsleyNode * children = node->_readChildren();
+        
+        if (node->type == ParsleyNode::CommentNode)
+        {
+            str += indent;
+            str += "<!--";
+            str.append(content->data.begin(), content->data.end());
+            str += "-->\n";
+            
+            continue;
+        }
+        
+        if (node->type == ParsleyNode::InstructionNode)
+        {
+            str += indent;
+            str += "<?";
+            str.append(node->tag.begin(), node->tag.end());
+            
+            if (! content->data.empty())
+            {
+                str += " ";
+                str.append(content->data.begin(), content->data.end());
+            }
+            
+            str += "?>\n";
+            
+            continue;
+        }
+        
+        std::string::size_type mark = str.size();
+        
+        _nodeToString(node, str, indent);
+        
+        if (node->selfClosed)
+        {
+            str += "\n";
+            
+            continue;
+        }
+        
+        // short leaf nodes go on a single line
+        if (! children->firstChild && str.size() - mark + indent.size() + content->data.size() + 2 <= 50)
+            escape(content->data, str, false);
+        
+        else
+        {
+            str += "\n";
+            
+            if (! content->data.empty())
+            {
+                str += indent;
+                escape(content->data, str, false);
+                str += "\n";
+            }
+            
+            if (children->firstChild)
+            {
+                indent += "\t";
+                
+                _treeToString(children->firstChild, str, indent);
+                
+                indent.erase(indent.size() - 1);
+            }
+            
+            str += indent;
+        }
+        
+        str += "</";
+        str.append(node->tag.begin(), node->tag.end());
+        str += ">\n";
+    }
+}
+
+ParsleyDocument Parsley::parseDocument(const std::string& fname, ParseStats * stats)
+{
+    return ParsleyDocument(ParsleyNode::NodePtr(parse(fname, stats)));
+}
+
+ParsleyNode * Parsley::reparse(ParsleyDocument& document, const std::string& fname,
+                               std::size_t begin, std::size_t oldEnd, std::size_t newEnd)
+{
+    ParsleyNode * root = document.getRoot();
+    
+    // the elements strictly enclosing the change, outermost first, with their offsets
+    std::vector<std::pair<ParsleyNode*, std::size_t> > path;
+    
+    bool afterRoot = false;
+    
+    if (root && root->_sourceLength && ! _recover && begin <= oldEnd && begin <= newEnd)
+    {
+        afterRoot = begin >= root->_sourceOffset + root->_sourceLength;
+        
+        std::size_t offset = root->_sourceOffset;
+        
+        for (ParsleyNode * node = afterRoot ? 0 : root; node; )
+        {
+            if (! node->_sourceLength || begin <= offset || oldEnd >= offset + node->_sourceLength) break;
+            
+            path.push_back(std::make_pair(node, offset));
+            
+            // find the last child starting before the change
+            std::size_t low = 0;
+            std::size_t high = node->getChildCount();
+            
+            while (low < high)
+            {
+                std::size_t mid = (low + high) / 2;
+                
+                if (offset + node->getNthChild(mid)->_sourceOffset < begin) low = mid + 1;
+                
+                else high = mid;
+            }
+            
+            node = low ? node->getNthChild(low - 1) : 0;
+            
+            if (node && node->type != ParsleyNode::ElementNode) break;
+            
+            if (node) offset += node->_sourceOffset;
+        }
+    }
+    
+    std::ifstream file;
+    
+    std::size_t size;
+    
+    // the root element is only replaced by parsing the whole file again
+    if ((afterRoot || path.size() > 1) && openFile(fname, file, size) == Uncompressed)
+    {
+        // offsets only count bytes of the file in UTF-8
+        std::string text(root->_sourceOffset, '\0');
+        
+        std::size_t bom;
+        
+        if (! text.empty()) file.read(&text[0], text.size());
+        
+        if (! file || detectEncoding(text, bom) != Utf8) path.clear();
+        
+        else if (afterRoot)
+        {
+            std::size_t rootEnd = root->_sourceOffset + root->_sourceLength;
+            
+            text.assign(size - std::min(size, rootEnd), '\0');
+            
+            file.seekg(rootEnd);
+            
+            if (! text.empty() && ! file.read(&text[0], text.size())) throw FileReadError();
+            
+            _docBegin = text.begin();
+            
+            _validating = _validateUtf8;
+            
+            // parse() tokenizes what follows the root element too, but builds
+            // nothing from it, so the tree only changes if that now fails
+            try
+            {
+                _parse(text.begin(), text.end());
+                
+                return 0;
+            }
+            
+            catch (ParseError&) { }
+        }
+        
+        for (std::size_t n = path.size(); n-- > 1; )
+        {
+            ParsleyNode * node = path[n].first;
+            
+            std::size_t length = node->_sourceLength - (oldEnd - begin) + (newEnd - begin);
+            
+            if (path[n].second + length > size) continue;
+            
+            text.resize(length);
+            
+            file.seekg(path[n].second);
+            
+            if (! file.read(&text[0], length)) throw FileReadError();
+            
+            ParsleyNode * replacement = _reparseElement(text, node);
+            
+            if (! replacement) continue;
+            
+            replacement->_sourceOffset = node->_sourceOffset;
+            
+            ParsleyNode * parent = node->parent;
+            
+            parent->insertChild(node, replacement);
+            
+            parent->detachChild(node);
+            
+            // what follows the element moves by the difference
+            // in length, wrapping around if it became shorter
+            for (node = replacement; node->parent; node = node->parent)
+            {
+                for (ParsleyNode * sibling = node->nextSibling; sibling; sibling = sibling->nextSibling)
+                    sibling->_sourceOffset += newEnd - oldEnd;
+                
+                node->parent->_sourceLength += newEnd - oldEnd;
+            }
+            
+            return replacement;
+        }
+    }
+    
+    document = parseDocument(fname);
+    
+    return document.getRoot();
+}
+
+ParsleyNode * Parsley::_reparseElement(const std::string& text, const ParsleyNode * old)
+{
+    _stats = 0;
+    _depth = 0;
+    _nodeCount = 0;
+    _bindings.clear();
+    _diagnostics.clear();
+    
+    // the namespaces declared around the old element apply again
+    std::vector<const ParsleyNode*> ancestors;
+    
+    for (const ParsleyNode * node = old->parent; node; node = node->parent)
+        ancestors.push_back(node);
+    
+    for (std::size_t n = ancestors.size(); n-- > 0; ++_depth)
+        _declareNamespaces(ancestors[n]);
+    
+    _docBegin = text.begin();
+    
+    _validating = _validateUtf8;
+    
+    std::unique_ptr<ParsleyNode> pseudo(new ParsleyNode);
+    
+    try
+    {
+        TokenVec vec = _parse(text.begin(), text.end());
+        
+        if (vec.empty() || vec.front().type != TagToken) return 0;
+        
+        TokenVec_cItr itr = _makeNodeTree(vec.begin(), vec.end(), pseudo.get());
+        
+        // the new element must take up all of the text, and nothing else
+        if (itr + 1 != vec.end() || ! pseudo->firstChild) return 0;
+    }
+    
+    // the caller tries a larger part of the document instead
+    catch (ParseError&)
+    {
+        return 0;
+    }
+    
+    return pseudo->detachChild(pseudo->firstChild).release();
+}
+
+void Parsley::save(ParsleyNode* node,
+                   const std::string& fname,
+                   bool deleteTree,
+                   bool addHeader)
+{
+    _write(node, fname, addHeader);
+    
+    if (deleteTree) delete node;
+}
+
+void Parsley::save(const ParsleyDocument& document,
+                   const std::string& fname,
+                   bool addHeader)
+{
+    _write(document.getRoot(), fname, addHeader);
+}
+
+void Parsley::_write(const ParsleyNode * node, const std::string& fname, bool addHeader) const
+{
+    static std::string headerStr = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+    std::string treeStr;
+    
+    if (addHeader)
+    { treeStr = headerStr; }
+    
+    std::string indent;
+    
+    _treeToString(node, treeStr, indent);
+    
+    std::ofstream outFile(fname);
+    
+    outFile << treeStr;
+    
+    outFile.close();
+}
+
+ParsleyNode::~ParsleyNode()
 {
-    if (! findAttr(attrKey))
-    { throw ParseError("Could not find attribute key: " + attrKey); }
+    // don't parse children only to delete them
+    _pending = 0;
+    
+    // each child hands its own children over before it goes,
+    // so a deep tree doesn't take a stack frame per level
+    while(hasChildren())
+    {
+        NodePtr child = detachChild(firstChild);
+        
+        child->_pending = 0;
+        
+        while(child->hasChildren())
+        { appendChild(child->detachChild(child->firstChild)); }
+    }
     
-    return attrs[attrKey];
+    if (_childIndex)
+    {
+        ParsleyAllocator<ChildIndex> allocator(getMemoryResource());
+        
+        _childIndex->~ChildIndex();
+        
+        allocator.deallocate(_childIndex, 1);
+    }
 }
 
-void ParsleyNode::removeAttr(const std::string &key)
+ParsleyNode::NodePtr ParsleyDocument::release()
 {
-    if (! findAttr(key))
-    { throw ParseError("Could not find attribute key: " + key); }
+    ParsleyNode::NodePtr root;
+    
+    // the arena goes away with the document,
+    // so a compacted tree has to leave it first
+    if (_arena && _root) root.reset(_root->clone(_upstream));
+    
+    else root = std::move(_root);
     
-    attrs.erase(key);
+    reset();
+    
+    return root;
 }
 
-ParsleyNode* ParsleyNode::getNthChild(unsigned int n) const
+void ParsleyDocument::reset(ParsleyNode::NodePtr root)
 {
-    ParsleyNode* node = firstChild;
+    _root = std::move(root);
     
-    while(n-- && node)
-    { node = firstChild->nextSibling; }
-    
-    return node;
+    // keep the arena for as long as the tree lives in it
+    if (_arena && ! (_root && _root->getMemoryResource() == _arena.get()))
+        _arena.reset();
 }
 
-ParsleyNode::NodeVec ParsleyNode::getElementsByTagName(const std::string& tagName)
+void ParsleyDocument::compact()
 {
-    NodeVec vec;
+    if (! _root) return;
     
-    ParsleyNode * itr = firstChild;
+    if (! _arena) _upstream = _root->getMemoryResource();
     
-    while (itr != 0)
+    // parse everything pending first, so that it is measured
+    for (const ParsleyNode * node = _root.get(); node != 0; )
     {
-        if (itr->tag == tagName)
-        { vec.push_back(itr); }
+        node->_realize(ParsleyNode::LazyAll);
         
-        itr = itr->nextSibling;
+        if (node->firstChild)
+        { node = node->firstChild; continue; }
+        
+        while (node && ! node->nextSibling)
+            node = node->parent;
+        
+        if (node) node = node->nextSibling;
     }
     
-    return vec;
-}
-
-void ParsleyNode::insertData(const std::string::size_type ind, const std::string& newData)
-{
-    if (ind < data.size()) data.insert(ind, newData);
+    ParsleyMemoryUsage usage = _root->memoryUsage();
     
-    else throw ParseError("Index out ouf bounds!");
+    // the copy has neither slack nor indices, but every allocation may
+    // need padding: nodes to the maximum alignment, the rest after a
+    // string to at most a pointer's
+    std::size_t size = usage.nodeBytes + usage.stringBytes + usage.attributeBytes
+                       + usage.nodes * alignof(std::max_align_t)
+                       + (usage.allocations - usage.nodes) * alignof(void*);
+    
+    std::unique_ptr<ParsleyArenaResource> arena(new ParsleyArenaResource(size, _upstream));
+    
+    ParsleyNode::NodePtr root(_root->clone(arena.get()));
+    
+    // later edits get small blocks rather than one twice the tree's size
+    arena->setBlockSize(4096);
+    
+    // the old tree may live in the old arena
+    _root = std::move(root);
+    _arena = std::move(arena);
 }
 
-ParsleyNode::NodeVec ParsleyNode::getElementsByAttrName(const std::string& attrName)
+ParsleyTemplate::ParsleyTemplate(ParsleyDocument&& document)
+: _shared(std::make_shared<ParsleyLazyDocument>())
 {
-    NodeVec vec;
+    _shared->source = document.release();
     
-    ParsleyNode * itr = firstChild;
-    
-    while (itr != 0)
+    // realize and resolve everything now, as the
+    // tree must not change once instances read it
+    for (const ParsleyNode * node = _shared->source.get(); node != 0; )
     {
-        if (itr->findAttr(attrName))
-        { vec.push_back(itr); }
+        node->_realize(ParsleyNode::LazyAll);
+        node->_resolveTagName();
+        node->_resolveAttrNames();
         
-        itr = itr->nextSibling;
+        if (node->firstChild)
+        { node = node->firstChild; continue; }
+        
+        while (node && ! node->nextSibling)
+            node = node->parent;
+        
+        if (node) node = node->nextSibling;
     }
     
-    return vec;
+    // hash it too, so that instances take the hashes over
+    if (_shared->source) _shared->source->getHash();
 }
 
-bool ParsleyNode::insertChild(ParsleyNode* childOfThisNode, ParsleyNode * node)
+ParsleyDocument ParsleyTemplate::instantiate(ParsleyMemoryResource* resource) const
 {
-    if (childOfThisNode == 0 ||
-        childOfThisNode->parent != this)
-        return false;
+    const ParsleyNode * source = _shared->source.get();
     
-    // connect the node with the child
-    node->nextSibling = childOfThisNode;
-    childOfThisNode->prevSibling = node;
+    if (! source) return ParsleyDocument();
     
-    // if there was a previous sibling, connect it with the node
-    if( childOfThisNode->prevSibling != 0)
-    {
-        node->prevSibling = childOfThisNode->prevSibling;
-        
-        childOfThisNode->prevSibling->nextSibling = node;
-    }
+    ParsleyNode::NodePtr root(ParsleyNode::_makeDerivedNode(source, _shared, resource));
     
-    return true;
+    root->_copyTagName(*source);
+    
+    return ParsleyDocument(std::move(root));
 }
 
-bool ParsleyNode::removeChild(ParsleyNode* childOfThisNode)
+const ParsleyNode* ParsleyTemplate::getRoot() const
 {
-    // check if valid node
-    if (childOfThisNode == 0 ||
-        childOfThisNode->parent != this)
-        return false;
+    return _shared->source.get();
+}
+
+namespace
+{
+    /*************************************************************************//*!
+    *
+    *   @brief Whether [name, name + length) may be used as a tag or attribute name.
+    *
+    *   @details A cheap approximation of the XML Name production: rejects
+    *            empty names, a leading digit, '-' or '.', and any markup,
+    *            quote or whitespace character. Non-ASCII bytes are allowed.
+    *
+    ****************************************************************************/
     
-    // if there is a previous sibling
-    // and a next, connect those two
-    if (childOfThisNode->prevSibling != 0 &&
-        childOfThisNode->nextSibling != 0)
+    bool isValidName(const char* name, std::size_t length)
     {
-        // connect the previous and the next
-        childOfThisNode->prevSibling->nextSibling =
-        childOfThisNode->nextSibling;
+        if (length == 0 || ::isdigit(static_cast<unsigned char>(*name)) || *name == '-' || *name == '.')
+            return false;
         
-        childOfThisNode->nextSibling->prevSibling =
-        childOfThisNode->prevSibling;
-    }
-    
-    // if this is the last child of a node
-    // connect it to the previous if there
-    // is one, else make the parent's last
-    // child pointer be 0
-    if (childOfThisNode == lastChild)
-    {
-        if (childOfThisNode->prevSibling != 0)
+        for (const char* end = name + length; name != end; ++name)
         {
-            lastChild = childOfThisNode->prevSibling;
-            lastChild->nextSibling = 0;
+            switch (*name)
+            {
+                case ' ': case '\t': case '\r': case '\n':
+                case '<': case '>': case '&': case '"': case '\'':
+                case '=': case '/': case '?': case '!':
+                    return false;
+            }
         }
         
-        else lastChild = 0;
+        return true;
     }
     
-    // same as for last child, but for previous child
-    if (childOfThisNode == firstChild)
+    void checkName(const char* name, std::size_t length)
     {
-        if (childOfThisNode->nextSibling != 0)
-        {
-            firstChild = childOfThisNode->nextSibling;
-            firstChild->prevSibling = 0;
-        }
-        
-        else firstChild = 0;
+        if (! isValidName(name, length))
+            throw WriterError("Invalid name: '" + std::string(name, length) + "'!");
     }
-    
-    delete childOfThisNode;
-    
-    return true;
 }
 
-Parsley::StrVec Parsley::_parse(Str_cItr begin, Str_cItr end)
+ParsleyWriter::ParsleyWriter()
+: _flushSize(0),
+  _tagOpen(false),
+  _hasRoot(false),
+  _started(false)
+{ }
+
+ParsleyWriter::ParsleyWriter(const std::string& fname, std::size_t flushSize)
+: _file(fname, std::ios::binary),
+  _flushSize(flushSize),
+  _tagOpen(false),
+  _hasRoot(false),
+  _started(false)
 {
-    StrVec vec;
-    
-    std::string s;
-    
-    Str_cItr i = begin;
-    Str_cItr j = i;
+    if (! _file.is_open()) throw FileOpenError();
     
-    while (j != end)
+    _sink = [this] (const char* data, std::size_t size)
     {
-        j = std::find(i, end, '<');
-        
-        s = std::string(i,j);
-        
-        if (! s.empty()
-            && s.substr(0,4) != "<!--"
-            && std::find_if_not(s.begin(), s.end(), ::isspace) != s.end())
-            vec.push_back(s);
+        _file.write(data, size);
         
-        i = std::find(j, end, '>');
-        
-        s = std::string(j,++i);
-        
-        if (! s.empty()
-            && s.substr(0,4) != "<!--"
-            && std::find_if_not(s.begin(), s.end(), ::isspace) != s.end())
-            vec.push_back(s);
-    }
-    
-    return vec;
+        if (! _file.good()) throw FileWriteError();
+    };
 }
 
-void ParsleyNode::prependChild(ParsleyNode *node)
+ParsleyWriter::ParsleyWriter(Sink sink, std::size_t flushSize)
+: _sink(std::move(sink)),
+  _flushSize(flushSize),
+  _tagOpen(false),
+  _hasRoot(false),
+  _started(false)
+{ }
+
+ParsleyWriter::~ParsleyWriter()
 {
-    if (node == this)
-        throw ParseError("Prepending Node to self");
+    // destructors must not throw, so a failing sink loses the rest
+    try { _flush(); }
     
-    node->parent = this;
+    catch (...) { }
+}
+
+ParsleyWriter& ParsleyWriter::header()
+{
+    if (_started) throw WriterError("The XML header must come first!");
     
-    if (firstChild != 0)
-    {
-        firstChild->prevSibling = node;
-        
-        node->nextSibling = firstChild;
-    }
+    _buffer += "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
     
-    firstChild = node;
+    _started = true;
     
-    if (lastChild == 0)
-        lastChild = firstChild;
+    return *this;
 }
 
-void ParsleyNode::appendChild(ParsleyNode *node)
+ParsleyWriter& ParsleyWriter::startElement(const char* name, std::size_t length)
 {
-    if (node == this)
-        throw ParseError("Appending Node to self");
-    
-    node->parent = this;
+    checkName(name, length);
     
-    if (lastChild != 0)
+    if (_open.empty())
     {
-        lastChild->nextSibling = node;
+        if (_hasRoot) throw WriterError("Document can only have one root element!");
         
-        node->prevSibling = lastChild;
+        _hasRoot = true;
     }
     
-    lastChild = node;
+    else _closeStartTag();
     
-    if (firstChild == 0)
-        firstChild = lastChild;
-}
-
-ParsleyNode::AttrMap Parsley::_getAttrs(Str_cItr begin, Str_cItr end) const
-{
-    ParsleyNode::AttrMap attrs;
+    _flushIfFull();
     
-    Str_cItr j;
+    _buffer += '<';
+    _buffer.append(name, length);
     
-    j = begin;
+    _open.push_back(_names.size());
+    _names.append(name, length);
     
-    while (begin != end)
-    {
-        // find first non-space char
-        begin = std::find_if_not(j, end, ::isspace);
-        
-        // find '=', lambda expression
-        j = std::find_if(begin, end, [&] (const char& c) { return c == '='; });
-        
-        // from the first non-space char to the '=' is the key
-        std::string key(begin,j);
-        
-        key = condense(key.begin(), key.end());
-        
-        // find the pair of parantheses
-        
-        begin = std::find(j, end, '\"');
-        
-        // need to increment begin to get the content anyway
-        j = std::find(++begin, end, '\"');
-        
-        // the value is between the parantheses
-        std::string val(begin, j);
-        
-        val = condense(val.begin(), val.end());
-        
-        // create new entry
-        attrs[key] = val;
-        
-        begin = ++j;
-    }
+    _tagOpen = true;
+    _started = true;
     
-    return attrs;
+    return *this;
 }
 
-bool Parsley::_isSelfClosing(Str_cItr begin, Str_cItr end) const
+ParsleyWriter& ParsleyWriter::attr(const char* name, std::size_t nameLength,
+                                   const char* value, std::size_t valueLength)
 {
-    while (end != begin && isspace(*end--));
+    if (! _tagOpen) throw WriterError("Attributes must directly follow their start tag!");
     
-    return *end == '/';
-}
-
-ParsleyNode * Parsley::_makeNode(Str_cItr begin, Str_cItr end, bool docHead)
-{
-    Str_cItr i,j;
+    checkName(name, nameLength);
     
-    i = std::find(begin, end, '<');
+    // start tags rarely have more than a handful of attributes
+    for (std::vector<Span>::const_iterator itr = _attrs.begin(), end = _attrs.end();
+         itr != end;
+         ++itr)
+    {
+        if (itr->length == nameLength && ! _buffer.compare(itr->begin, nameLength, name, nameLength))
+            throw WriterError("Duplicate attribute: '" + std::string(name, nameLength) + "'!");
+    }
     
-    j = std::find(i, end, '>');
+    _buffer += ' ';
     
-    if (j == end)
-        throw ParseError("Could not find matching brackets '<' '>' !");
+    Span span = { _buffer.size(), nameLength };
     
+    _attrs.push_back(span);
     
-    if (docHead) ++i, --j;
+    _buffer.append(name, nameLength);
+    _buffer += "=\"";
+    escape(value, value + valueLength, _buffer, true);
+    _buffer += '"';
     
-    // remove brackets
-    std::string curr(++i,j);
+    return *this;
+}
+
+ParsleyWriter& ParsleyWriter::text(const char* data, std::size_t length)
+{
+    if (_open.empty()) throw WriterError("Text must be inside an element!");
     
-    if (curr.empty())
-        throw ParseError("Empty tag found!");
+    _closeStartTag();
     
-    std::string tag = splitOne(curr.begin(), curr.end());
+    escape(data, data + length, _buffer, false);
     
-    curr.erase(0,tag.size());
+    _flushIfFull();
     
-    ParsleyNode::AttrMap attrs = _getAttrs(curr.begin(), curr.end());
+    return *this;
+}
+
+ParsleyWriter& ParsleyWriter::comment(const std::string& text)
+{
+    if (text.find("--") != std::string::npos || (! text.empty() && text.back() == '-'))
+        throw WriterError("Comments cannot contain '--' or end with '-'!");
     
-    ParsleyNode * node = new ParsleyNode;
+    _closeStartTag();
     
-    node->tag = tag;
-    node->attrs = attrs;
+    _buffer += "<!--";
+    _buffer += text;
+    _buffer += "-->";
     
-    node->selfClosed = _isSelfClosing(curr.begin(), curr.end());
+    _started = true;
     
-    return node;
+    return *this;
 }
 
-Parsley::StrVec_cItr Parsley::_makeNodeTree(StrVec_cItr itr, StrVec_cItr end, ParsleyNode * parent)
+ParsleyWriter& ParsleyWriter::instruction(const std::string& target, const std::string& data)
 {
-    if (std::find(itr->begin(), itr->end(), '<') == itr->end())
-        parent->data += strip(itr->begin(), itr->end());
+    checkName(target.data(), target.size());
     
-    else
+    if (data.find("?>") != std::string::npos)
+        throw WriterError("Processing instructions cannot contain '?>'!");
+    
+    _closeStartTag();
+    
+    _buffer += "<?";
+    _buffer += target;
+    
+    if (! data.empty())
     {
-        ParsleyNode* node;
-        
-        node = _makeNode(itr->begin(), itr->end());
-        
-        // check if the node is a closing tag
-        bool isClosing = (node->tag.end() - node->tag.begin() > 2 &&
-        *(node->tag.begin()) == '/');
-        
-        // if this is a closing tag, close the parent
-        if (node->selfClosed)
-            parent->selfClosed = true;
-        
-        else if (isClosing)
-        {
-            bool isClosingOfPar = std::equal(node->tag.begin() + 1,
-                                             node->tag.end() , parent->tag.begin());
-            
-            if (isClosingOfPar)
-            {
-                if (parent->isClosed)
-                    throw ParseError("Found duplicate closing tag for opening tag: " + parent->tag);
-                
-                parent->isClosed = true;
-                
-            } else
-                throw ParseError("Found closing tag: " + node->tag + "that does not close current node!");
-        }
-        
-        else
-        {
-            // append node to current parent
-            parent->appendChild(node);
-            
-            while (! node->isClosed)
-            {
-                itr = _makeNodeTree(++itr, end, node);
-                
-                if (itr == end)
-                    throw ParseError("Could not find matching closing tag!");
-            }
-        }
+        _buffer += ' ';
+        _buffer += data;
     }
     
-    return itr;
+    _buffer += "?>";
+    
+    _started = true;
+    
+    return *this;
 }
 
-std::string Parsley::_nodeToString(const ParsleyNode *node, std::string indent, bool docHead) const
+ParsleyWriter& ParsleyWriter::endElement()
 {
-    std::string str;
+    if (_open.empty()) throw WriterError("No element left to close!");
     
-    if (node != 0)
+    if (_tagOpen)
     {
-        str = "<";
-        
-        if (docHead) str += "?";
-        
-        str += node->tag;
-        
-        for (ParsleyNode::AttrMap::const_iterator itr = node->attrs.begin(), end = node->attrs.end();
-             itr != end;
-             ++itr)
-        {
-            str += " " + itr->first + "=\"" + itr->second + "\"";
-        }
-        
-        if (docHead) str += "?";
-        
-        if (node->selfClosed) str += "/";
-        
-        str += ">";
+        _buffer += "/>";
         
-        str = indent + str + "\n";
-        
-        if (node->hasData())
-            str += indent + node->data + "\n";
+        _tagOpen = false;
+        _attrs.clear();
     }
     
-    return str;
-}
-
-std::string Parsley::_treeToString(const ParsleyNode * root, std::string& str, std::string indent) const
-{
-    if (root != 0)
+    else
     {
-        std::string nodeStr = _nodeToString(root,indent);
-        
-        str += nodeStr;
-        
-        if (root->hasChildren())
-            _treeToString(root->firstChild, str,indent + "\t");
-        
-        if (! root->selfClosed)
-        {
-            if (! root->hasChildren() && nodeStr.size() <= 50)
-            {
-                std::string::const_iterator i = std::find(str.rbegin(), str.rend(), '>').base() - 1;
-                
-                while (i != str.end())
-                    if (*i == '\n' || *i == '\t')
-                        i = str.erase(i++);
-                    else ++i;
-                
-            } else str += indent;
-            
-            str += "</" + root->tag + ">\n";
-        }
-        
-        if (root->parent && !root->isLastChild())
-            _treeToString(root->nextSibling, str,indent);
+        _buffer += "</";
+        _buffer.append(_names, _open.back(), std::string::npos);
+        _buffer += '>';
     }
     
-    return str;
+    _names.erase(_open.back());
+    _open.pop_back();
+    
+    _flushIfFull();
+    
+    return *this;
 }
 
-void Parsley::save(ParsleyNode* node,
-                      const std::string& fname,
-                      bool deleteTree,
-                      bool addHeader)
+void ParsleyWriter::finish()
 {
-    static std::string headerStr = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
-    std::string treeStr;
+    if (! _open.empty())
+        throw WriterError("Element not closed: '" + _names.substr(_open.back()) + "'!");
     
-    if (addHeader)
-    { treeStr = headerStr; }
+    if (! _hasRoot) throw WriterError("Document contains no elements!");
     
-    _treeToString(node,treeStr);
+    _flush();
     
-    std::ofstream outFile(fname);
+    if (_file.is_open() && ! _file.flush()) throw FileWriteError();
+}
+
+void ParsleyWriter::reset()
+{
+    _buffer.clear();
+    _names.clear();
+    _open.clear();
+    _attrs.clear();
     
-    outFile << treeStr;
+    _tagOpen = false;
+    _hasRoot = false;
+    _started = false;
+}
+
+void ParsleyWriter::_closeStartTag()
+{
+    if (! _tagOpen) return;
     
-    outFile.close();
+    _buffer += '>';
     
-    if (deleteTree) delete node;
+    _tagOpen = false;
+    _attrs.clear();
 }
 
-ParsleyNode::~ParsleyNode()
+void ParsleyWriter::_flush()
 {
-    while(hasChildren())
-    { removeFirstChild(); }
+    if (! _sink || _buffer.empty()) return;
+    
+    _sink(_buffer.data(), _buffer.size());
+    
+    _buffer.clear();
 }
@@ -8,12 +8,47 @@
 #ifndef __Parsley__
 #define __Parsley__
 
+#include "ParsleyBinding.h"
+#include "ParsleyErrors.h"
+#include "ParsleyMemory.h"
+#include "ParsleyNames.h"
+
 #include <string>
 #include <vector>
 #include <map>
+#include <cstdint>
+#include <unordered_map>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <type_traits>
+#include <utility>
 
 typedef std::string::const_iterator Str_cItr;
 
+struct ParsleyLazyDocument;
+
+struct ParsleyMemoryUsage;
+
+struct ParsleyDifference;
+
+template <class Iterator>
+class ParsleyRange;
+
+template <class Iterator, class Predicate>
+class ParsleyFilterIterator;
+
+class ParsleyChildIterator;
+
+class ParsleyDescendantIterator;
+
+class ParsleyAncestorIterator;
+
+struct ParsleyTagFilter;
+
+struct ParsleyAttrFilter;
+
 /*************************************************************************//*!
 *
 *   @brief An ParsleyNode is a single node in an XML document.
@@ -23,6 +58,12 @@ typedef std::string::const_iterator Str_cItr;
 *            top-level node has a parent, children and sibling and has
 *            many methods to work with and navigate these.
 *
+*            Nodes of documents parsed in lazy mode (see Parsley::setLazy())
+*            parse their children, attributes and data the first time any
+*            of them is accessed. This is transparent, but means that even
+*            const accessors may modify a node, so a lazy document must not
+*            be read from several threads at once.
+*
 ****************************************************************************/
 
 class ParsleyNode
@@ -33,7 +74,48 @@ public:
     typedef std::vector<ParsleyNode*> NodeVec;
     typedef NodeVec::const_iterator NodeVec_cItr;
     
-    ParsleyNode()
+    /*! Owns a detached node and its subtree. The ParsleyNode pointers returned by accessors never own. */
+    typedef std::unique_ptr<ParsleyNode> NodePtr;
+    
+    typedef ParsleyRange<ParsleyChildIterator> ChildRange;
+    typedef ParsleyRange<ParsleyDescendantIterator> DescendantRange;
+    typedef ParsleyRange<ParsleyAncestorIterator> AncestorRange;
+    
+    typedef ParsleyRange<ParsleyFilterIterator<ParsleyDescendantIterator, ParsleyTagFilter> > TagRange;
+    typedef ParsleyRange<ParsleyFilterIterator<ParsleyDescendantIterator, ParsleyAttrFilter> > AttrRange;
+    
+    /*! Passed as the maximum depth to descend without limit. */
+    static const unsigned int AnyDepth = std::numeric_limits<unsigned int>::max();
+    
+    /*! The kinds of node in a document. */
+    enum Type
+    {
+        /*! An element, with a tag, attributes, data and children. */
+        ElementNode,
+        
+        /*! A comment, whose text is the node's data. */
+        CommentNode,
+        
+        /*! A processing instruction, whose target is the tag and the rest the data. */
+        InstructionNode
+    };
+    
+    /*! The string type of tags, data and attributes, allocated from the node's resource. */
+    typedef std::basic_string<char, std::char_traits<char>, ParsleyAllocator<char> > String;
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Constructor.
+    *
+    *   @param resource The memory resource for the node's strings and attributes.
+    *
+    ****************************************************************************/
+    
+    ParsleyNode(ParsleyMemoryResource* resource = ParsleyMemoryResource::getDefault())
+    : attrs(std::less<String>(), resource),
+      tag(resource),
+      data(resource),
+      attrNames(resource)
     { }
     
     /*************************************************************************//*!
@@ -42,482 +124,2209 @@ public:
     *
     *   @param tagName The tag name of the XML Node.
     *
+    *   @param resource The memory resource for the node's strings and attributes.
+    *
     ****************************************************************************/
     
-    ParsleyNode(const std::string& tagName)
-    : tag(tagName)
+    ParsleyNode(const std::string& tagName,
+                ParsleyMemoryResource* resource = ParsleyMemoryResource::getDefault())
+    : attrs(std::less<String>(), resource),
+      tag(tagName.begin(), tagName.end(), resource),
+      data(resource),
+      attrNames(resource)
     { }
     
     ~ParsleyNode();
     
+    
     /*************************************************************************//*!
     *
-    *   @brief Returns the value of the attribute with the key attrKey.
+    *   @brief Creates a new node whose memory is drawn entirely from resource.
     *
-    *   @param attrKey The key of the attribute.
+    *   @details The node itself, its tag, data and attributes are allocated
+    *            from resource, and returned to it when the node is deleted.
+    *            Plain new ParsleyNode uses the default resource.
     *
-    *   @throws ParseError if the key is not found.
+    *   @param tagName The tag name of the XML Node.
     *
-    *   @return The corresponding value of the key, if existent.
+    *   @param resource The memory resource to allocate from.
     *
     ****************************************************************************/
     
-    std::string getAttr(const std::string& attrKey);
+    static ParsleyNode* create(const std::string& tagName, ParsleyMemoryResource* resource)
+    { return new (resource) ParsleyNode(tagName, resource); }
     
     
     /*************************************************************************//*!
     *
-    *   @brief Searches for an attribute in the XML node.
+    *   @brief Creates a comment node.
     *
-    *   @param key The key of the attribute to find.
+    *   @param text The text of the comment.
     *
-    *   @return True if the attribute was found, else false.
+    *   @param resource The memory resource to allocate from.
     *
     ****************************************************************************/
     
-    bool findAttr(const std::string& key)
-    { return attrs.find(key) != attrs.end(); }
+    static ParsleyNode* createComment(const std::string& text,
+                                      ParsleyMemoryResource* resource = ParsleyMemoryResource::getDefault());
     
     
     /*************************************************************************//*!
     *
-    *   @brief Adds a new attribute to the node.
-    *
-    *   @details Use this method to add a new attribute, setAttr() will not 
-    *            automatically add new attribute if the one passed is
-    *            non-existent.
+    *   @brief Creates a processing instruction node, e.g. <?target data?>.
     *
-    *   @param key The key of the new attribute.
+    *   @param target The target of the processing instruction.
     *
-    *   @param value The value of the new attribute.
+    *   @param data The remainder of the processing instruction.
     *
-    *   @see setAttr()
+    *   @param resource The memory resource to allocate from.
     *
     ****************************************************************************/
     
-    void addAttr(const std::string& key, const std::string& val)
-    { attrs[key] = val; }
+    static ParsleyNode* createInstruction(const std::string& target,
+                                          const std::string& data,
+                                          ParsleyMemoryResource* resource = ParsleyMemoryResource::getDefault());
     
     
     /*************************************************************************//*!
     *
-    *   @brief Sets a new value for an attribute.
-    *
-    *   @details This method does not add new attributes if the passed key is
-    *            not found. Use addAttr() to add a new attribute.
-    *
-    *   @param value The new value of the attribute.
+    *   @brief Returns what kind of node this is.
     *
-    *   @param key The key of the attribute to change.
+    ****************************************************************************/
+    
+    Type getType() const { return type; }
+    
+    
+    /*************************************************************************//*!
     *
-    *   @see addAttr()
+    *   @brief Returns the memory resource the node's storage is allocated from.
     *
     ****************************************************************************/
-    void setAttr(const std::string& key, const std::string& val)
-    { if (findAttr(key)) addAttr(key, val); }
+    
+    ParsleyMemoryResource* getMemoryResource() const
+    { return tag.get_allocator().getResource(); }
     
     
     /*************************************************************************//*!
     *
-    *   @brief Removes an attribute.
+    *   @brief Returns a deep copy of this node and its subtree.
     *
-    *   @param key The key of the attribute to remove.
+    *   @details The copy is made in a single pass over the subtree and has
+    *            no parent. Pass a ParsleyArenaResource to make the copy
+    *            cheap to allocate and to free.
     *
-    *   @throws ParseError if the key is not found.
+    *   @param resource The memory resource to allocate the copy from, or
+    *                   null to use this node's resource.
+    *
+    *   @return The root of the copy, which the caller owns.
     *
     ****************************************************************************/
     
-    void removeAttr(const std::string& key);
+    ParsleyNode* clone(ParsleyMemoryResource* resource = 0) const;
     
     
     /*************************************************************************//*!
     *
-    *   @brief Returns the node's tag name.
+    *   @brief Reports the memory held by this node and its subtree.
     *
-    *   @return The node's tag name.
+    *   @details Walks the subtree without parsing anything a lazy node has
+    *            left pending, so pending parts and the text they would be
+    *            parsed from are not included. Strings short enough to be
+    *            stored inside the string object count towards the node
+    *            rather than the heap.
     *
     ****************************************************************************/
     
-    std::string getTag() { return tag; }
+    ParsleyMemoryUsage memoryUsage() const;
     
     
     /*************************************************************************//*!
     *
-    *   @brief Returns the node's tag name.
+    *   @brief Returns a hash of this node and its subtree.
     *
-    *   @return The node's tag name.
+    *   @details The hash covers the type, tag, data and attributes of every
+    *            node in the subtree and the order of the children, but not
+    *            namespace bindings in scope above it or whether an empty
+    *            element was written self-closed. Each node keeps its hash
+    *            and edits mark it and its ancestors out of date, so once
+    *            computed, getting it again takes constant time and after an
+    *            edit only the nodes on the path to it are hashed again.
+    *            Parsley::setHashing() has them computed while parsing.
+    *
+    *            Subtrees with equal content have equal hashes, across
+    *            documents. The hash is not cryptographic, and it may differ
+    *            between platforms and versions, so don't store it.
+    *
+    *   @return A 64 bit hash of the subtree.
     *
     ****************************************************************************/
     
-    void setTag(const std::string& name) { tag = name; }
+    std::uint64_t getHash() const;
     
     
     /*************************************************************************//*!
     *
-    *   @brief Returns a vector of nodes with the tag name tagName.
+    *   @brief Whether this subtree has the same content as other's.
     *
-    *   @param tagName The tag name to search for.
+    *   @details Compares the subtrees' hashes, so this takes constant time
+    *            once they are up to date. Different subtrees only compare
+    *            equal if their 64 bit hashes collide, which doesn't happen
+    *            by chance in practice but can be arranged on purpose.
     *
-    *   @return A vector of nodes. Might be empty.
+    *   @see getHash()
     *
     ****************************************************************************/
     
-    NodeVec getElementsByTagName(const std::string& tagName);
+    bool isEqual(const ParsleyNode& other) const
+    { return this == &other || getHash() == other.getHash(); }
     
     
     /*************************************************************************//*!
     *
-    *   @brief Returns a vector of nodes with the attribute key attrName.
+    *   @brief Lists the differences between this subtree and other.
     *
-    *   @param attrName The attribute key to search for.
+    *   @details Walks both subtrees together, skipping every pair of
+    *            subtrees whose hashes are equal, so the cost depends on the
+    *            changed nodes and their children rather than on the size of
+    *            the trees. Children are matched in order: equal children at
+    *            the start and end of both lists pair up first. Of the rest,
+    *            a child that appears unchanged further on in the other list
+    *            is kept for it, and the others pair up by position as long
+    *            as their type and tag agree. A child without a counterpart
+    *            is reported as removed or inserted as a whole. The
+    *            differences are listed in document order.
     *
-    *   @return A vector of nodes. Might be empty.
+    *   @param other The subtree to compare with, taken as the newer one.
+    *
+    *   @return The differences; empty if the subtrees are equal.
     *
     ****************************************************************************/
     
-    NodeVec getElementsByAttrName(const std::string& attrName);
+    std::vector<ParsleyDifference> diff(const ParsleyNode& other) const;
     
     
+    static void* operator new(std::size_t size)
+    { return operator new(size, ParsleyMemoryResource::getDefault()); }
+    
+    static void* operator new(std::size_t size, ParsleyMemoryResource* resource);
+    
+    static void operator delete(void* ptr);
+    
+    static void operator delete(void* ptr, ParsleyMemoryResource*)
+    { operator delete(ptr); }
+    
     /*************************************************************************//*!
     *
-    *   @brief Returns the data of the node (the text between the tags).
+    *   @brief Returns the value of the attribute with the key attrKey.
     *
-    *   @return The data of the node.
+    *   @param attrKey The key of the attribute.
+    *
+    *   @throws ParseError if the key is not found.
+    *
+    *   @return The corresponding value of the key, if existent.
     *
     ****************************************************************************/
     
-    std::string getData() const { return data; }
+    std::string getAttr(const std::string& attrKey);
     
     
     /*************************************************************************//*!
     *
-    *   @brief Returns the length of the node's data (the text between the tags).
+    *   @brief Searches for an attribute in the XML node.
     *
-    *   @return The node's data's length.
+    *   @param key The key of the attribute to find.
+    *
+    *   @return True if the attribute was found, else false.
     *
     ****************************************************************************/
     
-    std::string::size_type getDataLength() const { return data.size(); }
+    bool findAttr(const std::string& key)
+    { return _attrValue(key) != 0; }
     
     
     /*************************************************************************//*!
     *
-    *   @brief Whether the node has data (text between the tags).
+    *   @brief Whether the node has an attribute with the given key.
     *
-    *   @return True if the node has data, else fals.
+    *   @details Unlike findAttr(), builds no string to search with.
+    *
+    *   @param key The key of the attribute.
+    *
+    *   @param length The length of the key in bytes.
     *
     ****************************************************************************/
     
-    bool hasData() const { return ! data.empty(); }
+    bool hasAttr(const char* key, std::size_t length) const;
     
     
     /*************************************************************************//*!
     *
-    *   @brief Sets the node's data (the text between the tags).
+    *   @brief Adds a new attribute to the node.
     *
-    *   @param newData The std::string that becomes the new data.
+    *   @details Use this method to add a new attribute, setAttr() will not 
+    *            automatically add new attribute if the one passed is
+    *            non-existent.
+    *
+    *   @param key The key of the new attribute.
+    *
+    *   @param value The value of the new attribute.
+    *
+    *   @see setAttr()
     *
     ****************************************************************************/
     
-    void setData(const std::string& newData) { data = newData; }
+    void addAttr(const std::string& key, const std::string& val);
     
     
     /*************************************************************************//*!
     *
-    *   @brief Appends to the node's data (the text between the tags).
+    *   @brief Adds a new attribute to the node, taking over key and value.
     *
-    *   @param newData The std::string to append to the node's data.
+    *   @details Strings allocated from the node's memory resource are moved
+    *            in without copying.
+    *
+    *   @see addAttr()
     *
     ****************************************************************************/
     
-    void appendData(const std::string& newData) {data += newData; }
+    void addAttr(String&& key, String&& val);
     
     
     /*************************************************************************//*!
     *
-    *   @brief Inserts new data to the node's data (the text between the tags).
-    *
-    *   @param ind The position where to insert the new data.
+    *   @brief Adds a new attribute to the node from character ranges.
     *
-    *   @param newData The new data to insert.
+    *   @details Copies the characters straight into the node, without
+    *            building an intermediate std::string.
     *
-    *   @throws ParseError if the index is out of bounds.
+    *   @see addAttr()
     *
     ****************************************************************************/
     
-    void insertData(const std::string::size_type ind, const std::string& newData);
+    void addAttr(const char* key, std::size_t keyLength, const char* val, std::size_t valLength);
+    
+    /*! Adds a new attribute to the node. */
+    void addAttr(const char* key, const char* val)
+    { addAttr(key, std::char_traits<char>::length(key), val, std::char_traits<char>::length(val)); }
     
     
     /*************************************************************************//*!
     *
-    *   @brief Replaces any data matching oldData with newData.
+    *   @brief Sets a new value for an attribute.
     *
-    *   @param oldData The data to replace.
+    *   @details This method does not add new attributes if the passed key is
+    *            not found. Use addAttr() to add a new attribute.
     *
-    *   @param newData The new data to insert instead of oldData.
+    *   @param value The new value of the attribute.
+    *
+    *   @param key The key of the attribute to change.
+    *
+    *   @see addAttr()
     *
     ****************************************************************************/
+    void setAttr(const std::string& key, const std::string& val)
+    { if (findAttr(key)) addAttr(key, val); }
     
-    void replaceData(const std::string& oldData, const std::string& newData)
-    { data.replace(oldData.begin(), oldData.end(), newData); }
     
     /*************************************************************************//*!
     *
-    *   @brief Splits the data at ind and returns the data starting at that point.
+    *   @brief Removes an attribute.
     *
-    *   @param ind The position where to split.
+    *   @param key The key of the attribute to remove.
     *
-    *   @return The split data, starting at ind.
+    *   @throws ParseError if the key is not found.
     *
     ****************************************************************************/
     
-    std::string splitData(const std::string::size_type ind)
-    { return data.substr(ind); }
+    void removeAttr(const std::string& key);
+    
     
     /*************************************************************************//*!
     *
-    *   @brief Returns a substring of the node's data.
-    *
-    *   @param ind The starting position of where to substring.
+    *   @brief Returns the node's tag name.
     *
-    *   @param count The number of characters to substring starting at ind.
+    *   @return The node's tag name.
     *
     ****************************************************************************/
     
-    std::string substringData(const std::string::size_type ind,
-                              std::string::size_type count = std::string::npos)
-    { return data.substr(ind,count); }
+    std::string getTag() { return std::string(tag.begin(), tag.end()); }
     
     
     /*************************************************************************//*!
     *
-    *   @brief Deletes the node's data.
+    *   @brief Whether the node's tag name equals name, without copying it.
+    *
+    *   @param name The tag name to compare with.
+    *
+    *   @param length The length of the name in bytes.
     *
     ****************************************************************************/
     
-    void deleteData() { data.erase(); }
+    bool hasTag(const char* name, std::size_t length) const
+    { return ! tag.compare(0, String::npos, name, length); }
     
     
     /*************************************************************************//*!
     *
-    *   @brief Returns a pointer to the node's parent.
+    *   @brief Returns the node's tag name.
     *
-    *   @return Returns an ParsleyNode* if the parent exists, else returns NULL.
+    *   @return The node's tag name.
     *
     ****************************************************************************/
     
-    ParsleyNode* getParent() const { return parent; }
+    void setTag(const std::string& name)
+    { tag.assign(name.begin(), name.end()); _tagNameResolved = false; _invalidateHash(); }
     
     
     /*************************************************************************//*!
     *
-    *   @brief Returns a pointer to the node's previous sibling.
+    *   @brief Sets the node's tag name, taking over name.
     *
-    *   @return Returns an ParsleyNode* if the previous sibling exists, else returns NULL.
+    *   @details A string allocated from the node's memory resource is moved
+    *            in without copying.
     *
     ****************************************************************************/
     
-    ParsleyNode* getPrevSibling() const { return prevSibling; }
+    void setTag(String&& name)
+    { tag = std::move(name); _tagNameResolved = false; _invalidateHash(); }
     
     
     /*************************************************************************//*!
     *
-    *   @brief Returns a pointer to the node's next sibling.
-    *
-    *   @return Returns an ParsleyNode* if the next sibling exists, else returns NULL.
+    *   @brief Sets the node's tag name from a range of characters.
     *
     ****************************************************************************/
     
-    ParsleyNode* getNextSibling() const { return nextSibling; }
+    void setTag(const char* name, std::size_t length)
+    { tag.assign(name, length); _tagNameResolved = false; _invalidateHash(); }
+    
+    /*! Sets the node's tag name. */
+    void setTag(const char* name)
+    { setTag(name, std::char_traits<char>::length(name)); }
     
     
     /*************************************************************************//*!
     *
-    *   @brief Returns a pointer to the node's first child, if existent.
+    *   @brief Returns the Id of the namespace the node's tag belongs to.
     *
-    *   @return Returns an ParsleyNode* if a first child exists, else returns NULL.
+    *   @details Tag names are resolved against the xmlns declarations in
+    *            scope once, while parsing. For nodes that were created or
+    *            changed afterwards, or that are parsed lazily, and for
+    *            attribute names, this happens on first use instead, from the
+    *            declarations of the node and its ancestors at that time.
+    *            Declarations added above a node whose names were already
+    *            resolved do not affect it.
+    *
+    *   @return The namespace's Id, or ParsleyNames::None if the tag is in
+    *           no namespace.
+    *
+    *   @see ParsleyNames
     *
     ****************************************************************************/
     
-    ParsleyNode* getFirstChild() const { return firstChild; }
+    ParsleyNames::Id getNamespace() const { _resolveTagName(); return nsId; }
     
     
     /*************************************************************************//*!
     *
-    *   @brief Returns a pointer to the node's last child, if existent.
+    *   @brief Returns the Id of the tag name without its prefix.
     *
-    *   @return Returns an ParsleyNode* if a last child exists, else returns NULL.
+    *   @see getNamespace()
     *
     ****************************************************************************/
     
-    ParsleyNode* getLastChild() const { return lastChild; }
+    ParsleyNames::Id getLocalName() const { _resolveTagName(); return localId; }
     
     
     /*************************************************************************//*!
     *
-    *   @brief Returns a pointer to the node's nth child, if existent.
+    *   @brief Returns a vector of nodes with the tag name tagName.
     *
-    *   @return Returns an ParsleyNode* if nth child exists, else returns NULL.
+    *   @param tagName The tag name to search for.
+    *
+    *   @return A vector of nodes. Might be empty.
     *
     ****************************************************************************/
     
-    ParsleyNode* getNthChild(unsigned int n) const;
+    NodeVec getElementsByTagName(const std::string& tagName);
     
     
     /*************************************************************************//*!
     *
-    *   @brief Whether this node is the parent's last child.
+    *   @brief Returns a vector of nodes with the attribute key attrName.
     *
-    *   @return Returns true if this node is the parent's last child, else false.
+    *   @param attrName The attribute key to search for.
+    *
+    *   @return A vector of nodes. Might be empty.
     *
     ****************************************************************************/
     
-    bool isLastChild() const
-    { return parent->lastChild != 0 && this == parent->lastChild; }
+    NodeVec getElementsByAttrName(const std::string& attrName);
     
     
     /*************************************************************************//*!
     *
-    *   @brief Whether this node is the parent's first child.
+    *   @brief Returns a vector of nodes with the given namespace and local name.
     *
-    *   @return Returns true if this node is the parent's first child, else false.
+    *   @details Matches on the interned Ids, regardless of the prefix the
+    *            document binds the namespace to.
+    *
+    *   @param ns The Id of the namespace, ParsleyNames::None for none.
+    *
+    *   @param localName The Id of the local name.
+    *
+    *   @return A vector of nodes. Might be empty.
     *
     ****************************************************************************/
     
-    bool isFirstChild() const
-    { return parent->lastChild != 0 && this == parent->firstChild; }
+    NodeVec getElementsByTagName(ParsleyNames::Id ns, ParsleyNames::Id localName);
     
     
     /*************************************************************************//*!
     *
-    *   @brief Whether this node has children.
+    *   @brief Returns a vector of nodes with the given namespace URI and local name.
     *
-    *   @return Returns true if this node has children, else false.
+    *   @details Names never interned match nothing and are not added to
+    *            ParsleyNames.
+    *
+    *   @param nsUri The namespace URI, empty for none.
+    *
+    *   @param localName The local name.
+    *
+    *   @return A vector of nodes. Might be empty.
     *
     ****************************************************************************/
     
-    bool hasChildren() const { return firstChild != 0 && lastChild != 0; }
+    NodeVec getElementsByTagName(const std::string& nsUri, const std::string& localName)
+    { return getElementsByTagName(ParsleyNames::find(nsUri), ParsleyNames::find(localName)); }
     
     
     /*************************************************************************//*!
     *
-    *   @brief Whether this node has a parent.
+    *   @brief Returns a lazy range over the node's children.
     *
-    *   @return Returns true if this node has a parent, else false.
+    *   @details Ranges can be used in range-based for loops and with the
+    *            standard algorithms. They allocate nothing and visit nodes
+    *            only as they are iterated, so stopping early is free. A
+    *            range must not be used after the nodes it is iterating
+    *            have been removed from the tree.
     *
     ****************************************************************************/
-
-    bool hasParent() const { return parent; }
+    
+    ChildRange getChildren() const;
     
     
     /*************************************************************************//*!
     *
-    *   @brief Insert a new child at position 0.
+    *   @brief Returns a lazy range over the node's descendants, in pre-order.
     *
-    *   @param node The new node which will become this node's first child.
+    *   @details The node itself is not part of the range. In lazy
+    *            documents, only the levels actually reached are parsed.
+    *
+    *   @param maxDepth How far to descend: 1 for the children only, 2 for
+    *                   the grandchildren too and so on.
     *
     ****************************************************************************/
-
-    void prependChild(ParsleyNode * node);
+    
+    DescendantRange getDescendants(unsigned int maxDepth = AnyDepth) const;
     
     
     /*************************************************************************//*!
     *
-    *   @brief Append a new child.
-    *
-    *   @param node The new node which will become this node's last child.
+    *   @brief Returns a lazy range over the node's ancestors, from its parent up.
     *
     ****************************************************************************/
     
-    void appendChild(ParsleyNode* node);
+    AncestorRange getAncestors() const;
     
     
     /*************************************************************************//*!
     *
-    *   @brief Insert a new child at the position of childOfThisNode.
-    *
-    *   @param childOfThisNode A child of this node, at the position of
-    *          which to insert the new node.
+    *   @brief Returns a lazy range over the descendant elements with the tag name tagName.
     *
-    *   @param node The new node to insert.
+    *   @param tagName The tag name to search for. The characters are not
+    *                  copied, so they must live as long as the range,
+    *                  which string literals always do.
     *
-    *   @return Returns true if successful, else false (e.g. child wasn't of this node)
+    *   @param maxDepth How far to descend, see getDescendants().
     *
     ****************************************************************************/
     
-    bool insertChild(ParsleyNode* childOfThisNode, ParsleyNode * node);
+    TagRange getDescendantsByTagName(const char* tagName, unsigned int maxDepth = AnyDepth) const;
     
     
     /*************************************************************************//*!
     *
-    *   @brief Removes a child.
+    *   @brief Returns a lazy range over the descendants with the attribute key attrName.
     *
-    *   @param childOfThisNode. The child of this node which is to be removed.
+    *   @param attrName The attribute key to search for. The characters are
+    *                   not copied, so they must live as long as the range.
+    *
+    *   @param maxDepth How far to descend, see getDescendants().
     *
     ****************************************************************************/
     
-    bool removeChild(ParsleyNode* childOfThisNode);
+    AttrRange getDescendantsByAttrName(const char* attrName, unsigned int maxDepth = AnyDepth) const;
     
     
     /*************************************************************************//*!
     *
-    *   @brief Removes the node's first child.
+    *   @brief Returns the value of the attribute with the given namespace and local name.
+    *
+    *   @details Unprefixed attributes are in no namespace, not in the
+    *            default one.
+    *
+    *   @param ns The Id of the namespace, ParsleyNames::None for none.
+    *
+    *   @param localName The Id of the local name.
+    *
+    *   @throws ParseError if the attribute is not found.
     *
     ****************************************************************************/
     
-    void removeFirstChild() { removeChild(firstChild); }
+    std::string getAttr(ParsleyNames::Id ns, ParsleyNames::Id localName);
     
     
     /*************************************************************************//*!
     *
-    *   @brief Removes the node's last child.
+    *   @brief Searches for an attribute by namespace and local name.
+    *
+    *   @return True if the attribute was found, else false.
     *
     ****************************************************************************/
     
-    void removeLastChild() { removeChild(lastChild); }
-    
-private:
-    
-    friend class Parsley;
+    bool findAttr(ParsleyNames::Id ns, ParsleyNames::Id localName)
+    { return _findAttr(ns, localName) != attrs.end(); }
     
-    typedef std::map<std::string,std::string> AttrMap;
     
-    AttrMap attrs;
+    /*************************************************************************//*!
+    *
+    *   @brief Returns the data of the node (the text between the tags).
+    *
+    *   @return The data of the node.
+    *
+    ****************************************************************************/
     
-    std::string tag;
+    std::string getData() const
+    { const String& data = _readData()->data; return std::string(data.begin(), data.end()); }
     
-    std::string data;
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Returns the length of the node's data (the text between the tags).
+    *
+    *   @return The node's data's length.
+    *
+    ****************************************************************************/
+    
+    std::string::size_type getDataLength() const { return _readData()->data.size(); }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Whether the node has data (text between the tags).
+    *
+    *   @return True if the node has data, else fals.
+    *
+    ****************************************************************************/
+    
+    bool hasData() const { return ! _readData()->data.empty(); }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Sets the node's data (the text between the tags).
+    *
+    *   @param newData The std::string that becomes the new data.
+    *
+    ****************************************************************************/
+    
+    void setData(const std::string& newData)
+    { _discard(LazyData); data.assign(newData.begin(), newData.end()); _invalidateHash(); }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Sets the node's data, taking over newData.
+    *
+    *   @details A string allocated from the node's memory resource is moved
+    *            in without copying, so large texts can be built in place:
+    *
+    *            ParsleyNode::String text(node->getMemoryResource());
+    *            ...
+    *            node->setData(std::move(text));
+    *
+    ****************************************************************************/
+    
+    void setData(String&& newData)
+    { _discard(LazyData); data = std::move(newData); _invalidateHash(); }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Sets the node's data from a range of characters.
+    *
+    ****************************************************************************/
+    
+    void setData(const char* newData, std::size_t length)
+    { _discard(LazyData); data.assign(newData, length); _invalidateHash(); }
+    
+    /*! Sets the node's data. */
+    void setData(const char* newData)
+    { setData(newData, std::char_traits<char>::length(newData)); }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Appends to the node's data (the text between the tags).
+    *
+    *   @param newData The std::string to append to the node's data.
+    *
+    ****************************************************************************/
+    
+    void appendData(const std::string& newData)
+    { _realize(LazyData); data.append(newData.begin(), newData.end()); _invalidateHash(); }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Appends a range of characters to the node's data.
+    *
+    ****************************************************************************/
+    
+    void appendData(const char* newData, std::size_t length)
+    { _realize(LazyData); data.append(newData, length); _invalidateHash(); }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Inserts new data to the node's data (the text between the tags).
+    *
+    *   @param ind The position where to insert the new data.
+    *
+    *   @param newData The new data to insert.
+    *
+    *   @throws ParseError if the index is out of bounds.
+    *
+    ****************************************************************************/
+    
+    void insertData(const std::string::size_type ind, const std::string& newData);
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Replaces any data matching oldData with newData.
+    *
+    *   @param oldData The data to replace.
+    *
+    *   @param newData The new data to insert instead of oldData.
+    *
+    ****************************************************************************/
+    
+    void replaceData(const std::string& oldData, const std::string& newData);
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Splits the data at ind and returns the data starting at that point.
+    *
+    *   @param ind The position where to split.
+    *
+    *   @return The split data, starting at ind.
+    *
+    ****************************************************************************/
+    
+    std::string splitData(const std::string::size_type ind)
+    { return substringData(ind); }
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Returns a substring of the node's data.
+    *
+    *   @param ind The starting position of where to substring.
+    *
+    *   @param count The number of characters to substring starting at ind.
+    *
+    ****************************************************************************/
+    
+    std::string substringData(const std::string::size_type ind,
+                              std::string::size_type count = std::string::npos);
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Deletes the node's data.
+    *
+    ****************************************************************************/
+    
+    void deleteData() { _discard(LazyData); data.erase(); _invalidateHash(); }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Returns a pointer to the node's parent.
+    *
+    *   @return Returns an ParsleyNode* if the parent exists, else returns NULL.
+    *
+    ****************************************************************************/
+    
+    ParsleyNode* getParent() const { return parent; }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Returns a pointer to the node's previous sibling.
+    *
+    *   @return Returns an ParsleyNode* if the previous sibling exists, else returns NULL.
+    *
+    ****************************************************************************/
+    
+    ParsleyNode* getPrevSibling() const { return prevSibling; }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Returns a pointer to the node's next sibling.
+    *
+    *   @return Returns an ParsleyNode* if the next sibling exists, else returns NULL.
+    *
+    ****************************************************************************/
+    
+    ParsleyNode* getNextSibling() const { return nextSibling; }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Returns a pointer to the node's first child, if existent.
+    *
+    *   @return Returns an ParsleyNode* if a first child exists, else returns NULL.
+    *
+    ****************************************************************************/
+    
+    ParsleyNode* getFirstChild() const { _realize(LazyChildren); return firstChild; }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Returns a pointer to the node's last child, if existent.
+    *
+    *   @return Returns an ParsleyNode* if a last child exists, else returns NULL.
+    *
+    ****************************************************************************/
+    
+    ParsleyNode* getLastChild() const { _realize(LazyChildren); return lastChild; }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Returns a pointer to the node's nth child, if existent.
+    *
+    *   @details Takes constant time: beyond the first few children, the
+    *            node builds an index of its children, which it keeps up to
+    *            date while children are appended and rebuilds on the next
+    *            call after other changes to its children.
+    *
+    *   @param n The position of the child, counting from 0.
+    *
+    *   @return Returns an ParsleyNode* if nth child exists, else returns NULL.
+    *
+    ****************************************************************************/
+    
+    ParsleyNode* getNthChild(unsigned int n) const;
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Returns the number of children of the node, in constant time.
+    *
+    ****************************************************************************/
+    
+    std::size_t getChildCount() const { _realize(LazyChildren); return _childCount; }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Whether this node is the parent's last child.
+    *
+    *   @return Returns true if this node is the parent's last child, else false.
+    *
+    ****************************************************************************/
+    
+    bool isLastChild() const
+    { return parent->lastChild != 0 && this == parent->lastChild; }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Whether this node is the parent's first child.
+    *
+    *   @return Returns true if this node is the parent's first child, else false.
+    *
+    ****************************************************************************/
+    
+    bool isFirstChild() const
+    { return parent->lastChild != 0 && this == parent->firstChild; }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Whether this node has children.
+    *
+    *   @return Returns true if this node has children, else false.
+    *
+    ****************************************************************************/
+    
+    bool hasChildren() const
+    { _realize(LazyChildren); return firstChild != 0 && lastChild != 0; }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Whether this node has a parent.
+    *
+    *   @return Returns true if this node has a parent, else false.
+    *
+    ****************************************************************************/
+
+    bool hasParent() const { return parent; }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Insert a new child at position 0.
+    *
+    *   @param node The new node which will become this node's first child.
+    *
+    ****************************************************************************/
+
+    void prependChild(ParsleyNode * node);
+    
+    /*! Insert a new child at position 0, taking ownership of it. */
+    void prependChild(NodePtr&& node)
+    { prependChild(node.get()); node.release(); }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Append a new child.
+    *
+    *   @param node The new node which will become this node's last child.
+    *
+    ****************************************************************************/
+    
+    void appendChild(ParsleyNode* node);
+    
+    /*! Append a new child, taking ownership of it. */
+    void appendChild(NodePtr&& node)
+    { appendChild(node.get()); node.release(); }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Insert a new child at the position of childOfThisNode.
+    *
+    *   @param childOfThisNode A child of this node, at the position of
+    *          which to insert the new node.
+    *
+    *   @param node The new node to insert.
+    *
+    *   @return Returns true if successful, else false (e.g. child wasn't of this node)
+    *
+    ****************************************************************************/
+    
+    bool insertChild(ParsleyNode* childOfThisNode, ParsleyNode * node);
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Removes a child.
+    *
+    *   @param childOfThisNode. The child of this node which is to be removed.
+    *
+    ****************************************************************************/
+    
+    bool removeChild(ParsleyNode* childOfThisNode);
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Removes a child without deleting it.
+    *
+    *   @param childOfThisNode The child to detach.
+    *
+    *   @return The child, now owned by the caller, or null if it is not a
+    *           child of this node.
+    *
+    ****************************************************************************/
+    
+    NodePtr detachChild(ParsleyNode* childOfThisNode);
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Removes the node's first child.
+    *
+    ****************************************************************************/
+    
+    void removeFirstChild() { removeChild(getFirstChild()); }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Removes the node's last child.
+    *
+    ****************************************************************************/
+    
+    void removeLastChild() { removeChild(getLastChild()); }
+    
+private:
+    
+    friend class Parsley;
+    
+    friend class ParsleyTemplate;
+    
+    friend class ParsleyDocument;
+    
+    typedef std::map<String,
+                     String,
+                     std::less<String>,
+                     ParsleyAllocator<std::pair<const String,String> > > AttrMap;
+    
+    AttrMap::iterator _findAttr(const std::string& key);
+    
+    AttrMap::iterator _findAttr(ParsleyNames::Id ns, ParsleyNames::Id localName);
+    
+    /*! The resolved name of an attribute. */
+    struct AttrName
+    {
+        ParsleyNames::Id ns;
+        ParsleyNames::Id local;
+        
+        AttrMap::iterator attr;
+    };
+    
+    typedef std::vector<AttrName, ParsleyAllocator<AttrName> > AttrNameVec;
+    
+    typedef std::vector<ParsleyNode*, ParsleyAllocator<ParsleyNode*> > ChildIndex;
+    
+    /*! Fills _childIndex with the children in order. */
+    void _buildChildIndex() const;
+    
+    /*! Resolves the tag's name, if not done yet. */
+    void _resolveTagName() const
+    { if (! _tagNameResolved) _resolveNames(false); }
+    
+    /*! Resolves the attributes' names, if not done yet. */
+    void _resolveAttrNames() const
+    { if (! _attrNamesResolved) _resolveNames(true); }
+    
+    /*! Resolves the tag's or the attributes' names against the declarations in scope. */
+    void _resolveNames(bool attributes) const;
+    
+    /*! Splits the tag and resolves its prefix with lookup, interning names with intern. */
+    template <class Lookup, class Intern>
+    void _assignTagName(const Lookup& lookup, const Intern& intern) const;
+    
+    /*! Splits the attribute keys and resolves their prefixes with lookup. */
+    template <class Lookup>
+    void _assignAttrNames(const Lookup& lookup) const;
+    
+    /*! Finds the namespace bound to prefix on this node or its ancestors. */
+    ParsleyNames::Id _lookupNamespace(ParsleyNames::Id prefix) const;
+    
+    /*! The parts of a lazy node that have not been parsed yet. */
+    enum
+    {
+        LazyChildren = 1,
+        LazyAttrs    = 2,
+        LazyData     = 4,
+        LazyAll      = LazyChildren | LazyAttrs | LazyData
+    };
+    
+    /*! Parses the parts in what that are still pending. */
+    void _realize(unsigned char what) const
+    { if (_pending & what) _materialize(what); }
+    
+    /*! Marks the parts in what as parsed without parsing them, as they are about to be overwritten. */
+    void _discard(unsigned char what)
+    { if (_pending & what) _materialize(0, what); }
+    
+    void _materialize(unsigned char what, unsigned char discard = 0) const;
+    
+    /*! Copies the parts in what from _source, the template node this node derives from. */
+    void _derive(unsigned char what) const;
+    
+    /*! Returns the node to read the data from: the template node while it is not copied, else this node. */
+    const ParsleyNode* _readData() const
+    { if ((_pending & LazyData) && _source) return _source; _realize(LazyData); return this; }
+    
+    /*! Returns the node to read the attributes from, like _readData(). */
+    const ParsleyNode* _readAttrs() const
+    { if ((_pending & LazyAttrs) && _source) return _source; _realize(LazyAttrs); return this; }
+    
+    /*! Returns the node to read the children from, like _readData(). */
+    const ParsleyNode* _readChildren() const
+    { if ((_pending & LazyChildren) && _source) return _source; _realize(LazyChildren); return this; }
+    
+    /*! Returns the value of the attribute key, or 0, reading it through to the template node. */
+    const String* _attrValue(const std::string& key) const;
+    
+    /*! Creates a node deriving from source, copying its parts only when they are accessed. */
+    static ParsleyNode* _makeDerivedNode(const ParsleyNode * source,
+                                         const std::shared_ptr<ParsleyLazyDocument>& shared,
+                                         ParsleyMemoryResource* resource);
+    
+    /*! Returns a new node with this node's tag, type and flags, but nothing else. */
+    ParsleyNode* _copyShallow(ParsleyMemoryResource* resource) const;
+    
+    /*! Copies the attributes of source into this node's resource. */
+    void _copyAttrs(const ParsleyNode& source);
+    
+    /*! Takes over the resolved tag name of source, once this node has been placed in the same context. */
+    void _copyTagName(const ParsleyNode& source);
+    
+    /*! Marks the hashes of this node and its ancestors out of date. */
+    void _invalidateHash()
+    {
+        // a node's hash is only up to date if its children's are,
+        // so the ancestors above an outdated one are outdated too
+        for (ParsleyNode * node = this; node && node->_hashValid; node = node->parent)
+            node->_hashValid = false;
+    }
+    
+    /*! Hashes the node from its own content and its children's hashes, which must be up to date. */
+    void _computeHash() const;
+    
+    AttrMap attrs;
+    
+    String tag;
+    
+    String data;
+    
+    Type type = ElementNode;
+    
+    /*! The namespace and local name of the tag, once _tagNameResolved. */
+    mutable ParsleyNames::Id nsId = ParsleyNames::None;
+    mutable ParsleyNames::Id localId = ParsleyNames::None;
+    
+    /*! The resolved names of the attributes, once _attrNamesResolved. */
+    mutable AttrNameVec attrNames;
+    
+    mutable bool _tagNameResolved = false;
+    mutable bool _attrNamesResolved = false;
     
     ParsleyNode* parent       = 0;
     
-    ParsleyNode* prevSibling  = 0;
-    ParsleyNode* nextSibling  = 0;
+    ParsleyNode* prevSibling  = 0;
+    ParsleyNode* nextSibling  = 0;
+    
+    ParsleyNode* firstChild   = 0;
+    ParsleyNode* lastChild    = 0;
+    
+    /*! The children in order, if _childIndexValid. Only allocated when needed. */
+    mutable ChildIndex * _childIndex = 0;
+    
+    bool isClosed = false;
+    bool selfClosed = false;
+    
+    /*! Bitmask of the Lazy* parts of this node not yet parsed. */
+    mutable unsigned char _pending = 0;
+    
+    mutable bool _childIndexValid = false;
+    
+    unsigned int _childCount = 0;
+    
+    /*! Index of this node's start tag in the lazy document. */
+    std::size_t _lazyToken = 0;
+    
+    /*! The template node the pending parts are copied from, if this node was derived from a ParsleyTemplate. */
+    mutable const ParsleyNode * _source = 0;
+    
+    /*! The document this node is lazily parsed from, while anything is pending. */
+    mutable std::shared_ptr<ParsleyLazyDocument> _lazy;
+    
+    /*! Where the node began in its file, relative to its parent, or to the file for the root. */
+    std::size_t _sourceOffset = 0;
+    
+    /*! The number of bytes the node took up in its file, 0 if it was not parsed from one. */
+    std::size_t _sourceLength = 0;
+    
+    /*! The hash of the node and its subtree, if _hashValid. */
+    mutable std::uint64_t _hash = 0;
+    
+    mutable bool _hashValid = false;
+};
+
+/*************************************************************************//*!
+*
+*   @brief A pair of iterators that can be used in range-based for loops.
+*
+****************************************************************************/
+
+template <class Iterator>
+class ParsleyRange
+{
+    
+public:
+    
+    typedef Iterator iterator;
+    typedef Iterator const_iterator;
+    
+    ParsleyRange(Iterator first, Iterator last)
+    : _begin(first), _end(last)
+    { }
+    
+    Iterator begin() const { return _begin; }
+    
+    Iterator end() const { return _end; }
+    
+    /*! Whether the range has no nodes, found without iterating it. */
+    bool empty() const { return _begin == _end; }
+    
+    /*! Returns the first node of the range, or null if it is empty. */
+    ParsleyNode* front() const { return empty() ? 0 : *_begin; }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Returns the nodes of this range for which predicate returns true.
+    *
+    *   @param predicate Callable with a ParsleyNode* and returning bool.
+    *
+    ****************************************************************************/
+    
+    template <class Predicate>
+    ParsleyRange<ParsleyFilterIterator<Iterator, Predicate> > filter(Predicate predicate) const
+    {
+        typedef ParsleyFilterIterator<Iterator, Predicate> Filtered;
+        
+        return ParsleyRange<Filtered>(Filtered(_begin, _end, predicate), Filtered(_end, _end, predicate));
+    }
+    
+private:
+    
+    Iterator _begin;
+    
+    Iterator _end;
+};
+
+/*! The member types the standard library expects of the node iterators. */
+struct ParsleyNodeIteratorBase
+{
+    typedef std::forward_iterator_tag iterator_category;
+    typedef ParsleyNode* value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef ParsleyNode* const* pointer;
+    typedef ParsleyNode* const& reference;
+};
+
+/*************************************************************************//*!
+*
+*   @brief Iterates over a node and its following siblings.
+*
+****************************************************************************/
+
+class ParsleyChildIterator : public ParsleyNodeIteratorBase
+{
+    
+public:
+    
+    explicit ParsleyChildIterator(ParsleyNode* node = 0)
+    : _node(node)
+    { }
+    
+    ParsleyNode* const& operator*() const { return _node; }
+    
+    ParsleyChildIterator& operator++()
+    { _node = _node->getNextSibling(); return *this; }
+    
+    ParsleyChildIterator operator++(int)
+    { ParsleyChildIterator old(*this); ++*this; return old; }
+    
+    bool operator==(const ParsleyChildIterator& other) const { return _node == other._node; }
+    
+    bool operator!=(const ParsleyChildIterator& other) const { return _node != other._node; }
+    
+private:
+    
+    ParsleyNode* _node;
+};
+
+/*************************************************************************//*!
+*
+*   @brief Iterates over the descendants of a node in pre-order.
+*
+*   @details Walks the tree through the nodes' links, so it needs no stack
+*            and never recurses, however deep the document.
+*
+****************************************************************************/
+
+class ParsleyDescendantIterator : public ParsleyNodeIteratorBase
+{
+    
+public:
+    
+    /*! Constructs the end iterator. */
+    ParsleyDescendantIterator()
+    : _root(0), _node(0), _depth(0), _maxDepth(0)
+    { }
+    
+    /*! Constructs an iterator at the first descendant of root, if maxDepth allows any. */
+    ParsleyDescendantIterator(const ParsleyNode* root, unsigned int maxDepth)
+    : _root(root),
+      _node(maxDepth ? root->getFirstChild() : 0),
+      _depth(1),
+      _maxDepth(maxDepth)
+    { }
+    
+    ParsleyNode* const& operator*() const { return _node; }
+    
+    /*! Returns how far below the root the current node is, 1 for its children. */
+    unsigned int getDepth() const { return _depth; }
+    
+    ParsleyDescendantIterator& operator++()
+    {
+        // only look at the children if we may descend,
+        // so lazy documents don't parse deeper levels
+        if (_depth < _maxDepth)
+        {
+            if (ParsleyNode* child = _node->getFirstChild())
+            {
+                _node = child;
+                ++_depth;
+                
+                return *this;
+            }
+        }
+        
+        while (! _node->getNextSibling())
+        {
+            _node = _node->getParent();
+            --_depth;
+            
+            if (_node == _root)
+            {
+                _node = 0;
+                
+                return *this;
+            }
+        }
+        
+        _node = _node->getNextSibling();
+        
+        return *this;
+    }
+    
+    ParsleyDescendantIterator operator++(int)
+    { ParsleyDescendantIterator old(*this); ++*this; return old; }
+    
+    bool operator==(const ParsleyDescendantIterator& other) const { return _node == other._node; }
+    
+    bool operator!=(const ParsleyDescendantIterator& other) const { return _node != other._node; }
+    
+private:
+    
+    const ParsleyNode* _root;
+    
+    ParsleyNode* _node;
+    
+    unsigned int _depth;
+    
+    unsigned int _maxDepth;
+};
+
+/*************************************************************************//*!
+*
+*   @brief Iterates from a node up through its ancestors.
+*
+****************************************************************************/
+
+class ParsleyAncestorIterator : public ParsleyNodeIteratorBase
+{
+    
+public:
+    
+    explicit ParsleyAncestorIterator(ParsleyNode* node = 0)
+    : _node(node)
+    { }
+    
+    ParsleyNode* const& operator*() const { return _node; }
+    
+    ParsleyAncestorIterator& operator++()
+    { _node = _node->getParent(); return *this; }
+    
+    ParsleyAncestorIterator operator++(int)
+    { ParsleyAncestorIterator old(*this); ++*this; return old; }
+    
+    bool operator==(const ParsleyAncestorIterator& other) const { return _node == other._node; }
+    
+    bool operator!=(const ParsleyAncestorIterator& other) const { return _node != other._node; }
+    
+private:
+    
+    ParsleyNode* _node;
+};
+
+/*************************************************************************//*!
+*
+*   @brief Skips the nodes of another iterator for which a predicate is false.
+*
+****************************************************************************/
+
+template <class Iterator, class Predicate>
+class ParsleyFilterIterator : public ParsleyNodeIteratorBase
+{
+    
+public:
+    
+    ParsleyFilterIterator(Iterator first, Iterator last, Predicate predicate)
+    : _itr(first), _end(last), _predicate(predicate)
+    { _skip(); }
+    
+    ParsleyNode* const& operator*() const { return *_itr; }
+    
+    /*! Returns the underlying iterator. */
+    const Iterator& base() const { return _itr; }
+    
+    ParsleyFilterIterator& operator++()
+    { ++_itr; _skip(); return *this; }
+    
+    ParsleyFilterIterator operator++(int)
+    { ParsleyFilterIterator old(*this); ++*this; return old; }
+    
+    bool operator==(const ParsleyFilterIterator& other) const { return _itr == other._itr; }
+    
+    bool operator!=(const ParsleyFilterIterator& other) const { return _itr != other._itr; }
+    
+private:
+    
+    void _skip()
+    { while (_itr != _end && ! _predicate(*_itr)) ++_itr; }
+    
+    Iterator _itr;
+    
+    Iterator _end;
+    
+    Predicate _predicate;
+};
+
+/*! Matches elements by tag name, without copying the name. */
+struct ParsleyTagFilter
+{
+    ParsleyTagFilter(const char* name)
+    : name(name), length(std::char_traits<char>::length(name))
+    { }
+    
+    bool operator()(const ParsleyNode* node) const
+    { return node->getType() == ParsleyNode::ElementNode && node->hasTag(name, length); }
+    
+    const char* name;
+    
+    std::size_t length;
+};
+
+/*! Matches nodes by attribute key, without copying the key. */
+struct ParsleyAttrFilter
+{
+    ParsleyAttrFilter(const char* key)
+    : key(key), length(std::char_traits<char>::length(key))
+    { }
+    
+    bool operator()(const ParsleyNode* node) const
+    { return node->hasAttr(key, length); }
+    
+    const char* key;
+    
+    std::size_t length;
+};
+
+inline ParsleyNode::ChildRange ParsleyNode::getChildren() const
+{
+    return ChildRange(ParsleyChildIterator(getFirstChild()), ParsleyChildIterator());
+}
+
+inline ParsleyNode::DescendantRange ParsleyNode::getDescendants(unsigned int maxDepth) const
+{
+    return DescendantRange(ParsleyDescendantIterator(this, maxDepth), ParsleyDescendantIterator());
+}
+
+inline ParsleyNode::AncestorRange ParsleyNode::getAncestors() const
+{
+    return AncestorRange(ParsleyAncestorIterator(parent), ParsleyAncestorIterator());
+}
+
+inline ParsleyNode::TagRange ParsleyNode::getDescendantsByTagName(const char* tagName, unsigned int maxDepth) const
+{
+    return getDescendants(maxDepth).filter(ParsleyTagFilter(tagName));
+}
+
+inline ParsleyNode::AttrRange ParsleyNode::getDescendantsByAttrName(const char* attrName, unsigned int maxDepth) const
+{
+    return getDescendants(maxDepth).filter(ParsleyAttrFilter(attrName));
+}
+
+/*************************************************************************//*!
+*
+*   @brief An XML document, owning its tree of nodes.
+*
+*   @details A ParsleyDocument deletes its tree when it goes out of scope.
+*            It can be moved but not copied, so ownership is always
+*            explicit. The nodes reached from getRoot() are non-owning
+*            handles that stay valid as long as the document holds them.
+*
+****************************************************************************/
+
+class ParsleyDocument
+{
+    
+public:
+    
+    ParsleyDocument() { }
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Constructs a document owning the tree rooted at root.
+    *
+    ****************************************************************************/
+    
+    explicit ParsleyDocument(ParsleyNode::NodePtr root)
+    : _root(std::move(root))
+    { }
+    
+    ParsleyDocument(ParsleyDocument&& other) = default;
+    
+    /*! Deletes the current tree before the arena it may have been compacted into. */
+    ParsleyDocument& operator=(ParsleyDocument&& other)
+    {
+        _root = std::move(other._root);
+        _arena = std::move(other._arena);
+        _upstream = other._upstream;
+        
+        return *this;
+    }
+    
+    ParsleyDocument(const ParsleyDocument&) = delete;
+    
+    ParsleyDocument& operator=(const ParsleyDocument&) = delete;
+    
+    /*! Returns the root node, or null if the document is empty. */
+    ParsleyNode* getRoot() const { return _root.get(); }
+    
+    /*! Whether the document holds a tree. */
+    bool empty() const { return ! _root; }
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Gives up ownership of the tree, leaving the document empty.
+    *
+    *   @details The tree of a compacted document is first copied back to
+    *            the resource it was allocated from before compact().
+    *
+    ****************************************************************************/
+    
+    ParsleyNode::NodePtr release();
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Deletes the current tree, if any, and takes ownership of root.
+    *
+    ****************************************************************************/
+    
+    void reset(ParsleyNode::NodePtr root = ParsleyNode::NodePtr());
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Moves the tree into a single block of memory, in document order.
+    *
+    *   @details A tree that has been edited for a long time ends up spread
+    *            across the heap, with strings that have outgrown their
+    *            contents. compact() copies it into one arena sized from
+    *            memoryUsage(), with every node followed by its strings and
+    *            attributes and the nodes laid out in the order a traversal
+    *            visits them, then frees the old tree. Strings leave the
+    *            spare capacity they have built up behind.
+    *
+    *            The arena belongs to the document. Memory freed by later
+    *            edits is only reclaimed by the next compact(), and nodes
+    *            detached from a compacted tree must be deleted before the
+    *            document is, or cloned out of it. The arena draws from the
+    *            resource the tree was allocated from when it was first
+    *            compacted. Lazily parsed parts are parsed in full.
+    *
+    *            Pointers to nodes of the old tree are invalidated.
+    *
+    ****************************************************************************/
+    
+    void compact();
+    
+    /*! Returns the bytes reserved by the arena the tree was compacted into, or 0. */
+    std::size_t getArenaBytes() const { return _arena ? _arena->getBytesReserved() : 0; }
+    
+private:
+    
+    /*! Declared before _root, so that the tree is deleted first. */
+    std::unique_ptr<ParsleyArenaResource> _arena;
+    
+    /*! The resource the tree used before it was first compacted. */
+    ParsleyMemoryResource* _upstream = 0;
+    
+    ParsleyNode::NodePtr _root;
+};
+
+/*************************************************************************//*!
+*
+*   @brief A read-only document from which modified copies are made cheaply.
+*
+*   @details A template takes over a document and freezes it. instantiate()
+*            then returns a new document that shares the template's tree
+*            copy-on-write: reading a node's data or attributes, saving,
+*            cloning and hashing the instance read the template's nodes
+*            directly. A node copies the children, attributes or data of
+*            its template counterpart only when they are modified, or
+*            when they are handed out by a call that could modify them,
+*            such as getFirstChild(), or looked up by namespace.
+*            An instance therefore costs in proportion to the part of it
+*            that is navigated or edited, not to the size of the template.
+*
+*            The template's tree is never modified again, so instances can
+*            be created and used on several threads at once, as long as
+*            every single instance is used by one thread at a time. Copies
+*            of a ParsleyTemplate share the same tree, which stays alive as
+*            long as any instance derived from it.
+*
+****************************************************************************/
+
+class ParsleyTemplate
+{
+    
+public:
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Constructs a template from a document.
+    *
+    *   @details Parses whatever a lazily parsed document has left pending
+    *            and resolves all names, so that the tree never has to be
+    *            modified again.
+    *
+    *   @param document The document to take over.
+    *
+    ****************************************************************************/
+    
+    explicit ParsleyTemplate(ParsleyDocument&& document);
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Returns a new document derived from the template.
+    *
+    *   @param resource The memory resource to allocate the instance's nodes from.
+    *
+    *   @return A document that reads like a copy of the template.
+    *
+    ****************************************************************************/
+    
+    ParsleyDocument instantiate(ParsleyMemoryResource* resource = ParsleyMemoryResource::getDefault()) const;
+    
+    /*! Returns the template's root node, or null if the document was empty. */
+    const ParsleyNode* getRoot() const;
+    
+private:
+    
+    std::shared_ptr<ParsleyLazyDocument> _shared;
+};
+
+/*************************************************************************//*!
+*
+*   @brief Statistics collected by Parsley::parse() when requested.
+*
+*   @details Pass a pointer to a ParseStats object to Parsley::parse() to
+*            have it filled in. Timings are wall-clock seconds. Tree
+*            building time does not include attribute parsing, which is
+*            reported separately. When no ParseStats object is passed,
+*            none of these figures are collected.
+*
+****************************************************************************/
+
+struct ParseStats
+{
+    /*! Number of bytes read from the file. */
+    std::size_t bytesRead = 0;
+    
+    /*! Seconds spent reading the file. */
+    double ioSeconds = 0;
+    
+    /*! Seconds spent transcoding UTF-16 or Latin-1 input to UTF-8. */
+    double transcodeSeconds = 0;
+    
+    /*! Seconds spent splitting the document into tokens. */
+    double tokenizeSeconds = 0;
+    
+    /*! Seconds spent building the node tree, minus attribute parsing. */
+    double treeSeconds = 0;
+    
+    /*! Seconds spent parsing attributes. */
+    double attrSeconds = 0;
+    
+    /*! Number of tokens (tags and text runs) found. */
+    std::size_t tokens = 0;
+    
+    /*! Number of element nodes created. */
+    std::size_t nodes = 0;
+    
+    /*! Number of attributes parsed. */
+    std::size_t attributes = 0;
+    
+    /*! Number of bytes of text data stored in nodes. */
+    std::size_t textBytes = 0;
+    
+    /*! Maximum element nesting depth, the root being at depth 1. */
+    std::size_t maxDepth = 0;
+    
+    /*! Number of allocations from memory resources and for tokens, not counting the read buffer. */
+    std::size_t allocations = 0;
+};
+
+/*************************************************************************//*!
+*
+*   @brief The memory held by a subtree, as reported by ParsleyNode::memoryUsage().
+*
+*   @details Byte counts are what the tree asked its memory resource for,
+*            leaving out the resource's own bookkeeping. Capacity that
+*            strings and vectors have reserved beyond their contents is
+*            reported separately as slack.
+*
+****************************************************************************/
+
+struct ParsleyMemoryUsage
+{
+    /*! Number of nodes in the subtree. */
+    std::size_t nodes = 0;
+    
+    /*! Bytes of the node objects themselves. */
+    std::size_t nodeBytes = 0;
+    
+    /*! Bytes of tag and data strings stored outside their nodes. */
+    std::size_t stringBytes = 0;
+    
+    /*! Bytes of attribute entries, with their names and values. */
+    std::size_t attributeBytes = 0;
+    
+    /*! Bytes of child indices and resolved attribute names. */
+    std::size_t indexBytes = 0;
+    
+    /*! Bytes reserved by strings and vectors but not used. */
+    std::size_t slackBytes = 0;
+    
+    /*! Number of separate allocations making up the subtree. */
+    std::size_t allocations = 0;
+    
+    /*! Returns all bytes held by the subtree, slack included. */
+    std::size_t getTotalBytes() const
+    { return nodeBytes + stringBytes + attributeBytes + indexBytes + slackBytes; }
+};
+
+/*************************************************************************//*!
+*
+*   @brief A difference between two subtrees, as found by ParsleyNode::diff().
+*
+****************************************************************************/
+
+struct ParsleyDifference
+{
+    enum Kind
+    {
+        /*! The node is in both trees, but its data or attributes differ. */
+        Changed,
+        
+        /*! The node and its subtree are only in the old tree. */
+        Removed,
+        
+        /*! The node and its subtree are only in the new tree. */
+        Inserted
+    };
+    
+    Kind kind;
+    
+    /*! The node in the old tree, null if inserted. */
+    ParsleyNode* before;
+    
+    /*! The node in the new tree, null if removed. */
+    ParsleyNode* after;
+};
+
+/*************************************************************************//*!
+*
+*   @brief Limits that Parsley::parse() enforces on a document.
+*
+*   @details Use these to guard against hostile or pathological input. Every
+*            limit but maxDepth and maxDiagnostics defaults to unlimited. A
+*            document that exceeds one of them makes parse() throw a
+*            ParseError carrying the byte offset at which the limit was hit,
+*            except maxDiagnostics: past it, recovery goes on, but further
+*            problems are not recorded.
+*
+*            maxDepth defaults to 2048, as building and saving a tree
+*            recurse once per level, and deeper documents could overflow
+*            the stack.
+*
+****************************************************************************/
+
+struct ParseLimits
+{
+    /*! Maximum element nesting depth, the root being at depth 1. */
+    std::size_t maxDepth = 2048;
+    
+    /*! Maximum number of elements in the document. */
+    std::size_t maxNodes = std::numeric_limits<std::size_t>::max();
+    
+    /*! Maximum number of attributes on a single element. */
+    std::size_t maxAttributes = std::numeric_limits<std::size_t>::max();
+    
+    /*! Maximum length of a single tag or run of text, in bytes. */
+    std::size_t maxTokenLength = std::numeric_limits<std::size_t>::max();
+    
+    /*! Maximum size of the document, in bytes. */
+    std::size_t maxBytes = std::numeric_limits<std::size_t>::max();
+    
+    /*! Maximum number of problems recorded in recovery mode. */
+    std::size_t maxDiagnostics = 1000;
+};
+
+/*************************************************************************//*!
+*
+*   @brief The Parsley class parses and manages XML documents and nodes.
+*
+****************************************************************************/
+
+class Parsley
+{
+    
+public:
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Method to manually open and parse an existing XML document.
+    *
+    *   @details The encoding is detected from the byte order mark or, failing
+    *            that, the encoding declared in the XML header. UTF-16 and
+    *            Latin-1 (ISO-8859-1) documents are transcoded to UTF-8 before
+    *            parsing, so nodes always hold UTF-8. Other encodings, and
+    *            malformed UTF-16, are rejected with an EncodingError. Error
+    *            offsets in transcoded documents refer to the UTF-8 text.
+    *
+    *            If Parsley is built with PARSLEY_WITH_ZLIB or
+    *            PARSLEY_WITH_ZSTD, gzip and zstd files are decompressed on a
+    *            separate thread while the parser tokenizes what has arrived.
+    *            Error offsets then refer to the decompressed text. Corrupt
+    *            or unsupported compressed files throw a DecompressionError.
+    *
+    *   @param fname The name of the file to parse.
+    *
+    *   @param stats If non-null, filled with statistics about this parse.
+    *
+    ****************************************************************************/
+    
+    ParsleyNode * parse(const std::string& fname, ParseStats * stats = 0);
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Sets the memory resource that parsed documents are allocated from.
+    *
+    *   @details All nodes, strings and attributes of documents returned by
+    *            parse() are drawn from resource, which must outlive them.
+    *            If the resource throws (e.g. a ParsleyBudgetResource throwing
+    *            MemoryLimitError), parse() releases the partial tree and
+    *            rethrows.
+    *
+    *   @param resource The memory resource, or null for the default one.
+    *
+    ****************************************************************************/
+    
+    void setMemoryResource(ParsleyMemoryResource* resource)
+    { _resource = resource ? resource : ParsleyMemoryResource::getDefault(); }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Returns the memory resource that parsed documents are allocated from.
+    *
+    ****************************************************************************/
     
-    ParsleyNode* firstChild   = 0;
-    ParsleyNode* lastChild    = 0;
+    ParsleyMemoryResource* getMemoryResource() const { return _resource; }
     
-    bool isClosed = false;
-    bool selfClosed = false;
-};
-
-/*************************************************************************//*!
-*
-*   @brief The Parsley class parses and manages XML documents and nodes.
-*
-****************************************************************************/
-
-class Parsley
-{
     
-public:
+    /*************************************************************************//*!
+    *
+    *   @brief Sets the limits parse() enforces on documents.
+    *
+    *   @param limits The new limits.
+    *
+    *   @see ParseLimits
+    *
+    ****************************************************************************/
+    
+    void setLimits(const ParseLimits& limits) { _limits = limits; }
+    
     
     /*************************************************************************//*!
     *
-    *   @brief Method to manually open and parse an existing XML document.
+    *   @brief Returns the limits parse() enforces on documents.
+    *
+    ****************************************************************************/
+    
+    const ParseLimits& getLimits() const { return _limits; }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Turns lazy parsing on or off.
+    *
+    *   @details In lazy mode, parse() only validates the document's structure
+    *            and records where each element begins and ends. A node's
+    *            children, attributes and data are parsed the first time they
+    *            are accessed, so only the parts of a document that are read
+    *            are ever built. The file's contents are kept in memory until
+    *            every node that still refers to them has been fully parsed
+    *            or deleted. Attribute syntax errors and attribute limits are
+    *            only detected, and thrown as ParseError, on that first access.
+    *
+    *   @param lazy Whether to parse lazily.
+    *
+    ****************************************************************************/
+    
+    void setLazy(bool lazy) { _isLazy = lazy; }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Whether lazy parsing is on.
+    *
+    ****************************************************************************/
+    
+    bool isLazy() const { return _isLazy; }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Whether to keep comments and processing instructions.
+    *
+    *   @details By default, comments and processing instructions are skipped
+    *            without being copied. When kept, they become nodes of type
+    *            ParsleyNode::CommentNode or ParsleyNode::InstructionNode
+    *            among their parent's children and are written back by save().
+    *            Those outside the root element are always dropped. CDATA
+    *            sections are always kept, as part of their parent's data.
+    *
+    *            A node's text is a single string, so a kept comment keeps
+    *            its place among its element siblings but not within the
+    *            surrounding text: save() writes the parent's text first and
+    *            its children after it, and <r>a<!--c-->b</r> is saved as
+    *            <r>ab<!--c--></r>.
+    *
+    *   @param keep Whether to keep comments and processing instructions.
+    *
+    ****************************************************************************/
+    
+    void setKeepComments(bool keep) { _keepComments = keep; }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Whether comments and processing instructions are kept.
+    *
+    ****************************************************************************/
+    
+    bool getKeepComments() const { return _keepComments; }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Whether to check that UTF-8 documents are well-formed.
+    *
+    *   @details When enabled, each stretch of the document is validated as
+    *            the tokenizer passes over it, while it is still in cache, and
+    *            the parse fails with an EncodingError at the first malformed,
+    *            overlong or surrogate sequence. Transcoded documents are
+    *            valid by construction and are not checked again. Off by
+    *            default, in which case bytes are passed through unchecked.
+    *
+    *   @param validate Whether to validate UTF-8.
+    *
+    ****************************************************************************/
+    
+    void setValidateUtf8(bool validate) { _validateUtf8 = validate; }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Whether UTF-8 documents are validated.
+    *
+    ****************************************************************************/
+    
+    bool getValidateUtf8() const { return _validateUtf8; }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Whether to read files on a separate thread, ahead of the parser.
+    *
+    *   @details By default, a file is read as a whole before it is parsed.
+    *            With read-ahead, a thread reads it in 256 KiB blocks, up to
+    *            three blocks ahead, while the parser tokenizes the blocks that
+    *            have arrived. Disk and CPU then work at the same time, which
+    *            pays off for files on network or slow storage that are not
+    *            in the page cache. Compressed files are always read this way.
+    *
+    *   @param readAhead Whether to read ahead.
+    *
+    ****************************************************************************/
+    
+    void setReadAhead(bool readAhead) { _readAhead = readAhead; }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Whether files are read ahead of the parser.
+    *
+    ****************************************************************************/
+    
+    bool getReadAhead() const { return _readAhead; }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Whether to repair malformed documents instead of failing.
+    *
+    *   @details In recovery mode, parse() keeps going where it would
+    *            otherwise throw a ParseError, and returns the best tree it
+    *            can build:
+    *
+    *            - an element left open is closed when a closing tag for one
+    *              of its ancestors, or the end of the document, is reached
+    *            - a closing tag that matches no open element is skipped
+    *            - a tag that cannot be parsed, e.g. because of an
+    *              unterminated attribute value, is skipped, its contents
+    *              going to the enclosing element
+    *            - an unterminated tag at the end of the document is dropped
+    *            - invalid UTF-8, if validated, is kept as it is
+    *
+    *            Each of these is recorded in getDiagnostics(), a run of
+    *            invalid UTF-8 bytes as one, up to ParseLimits::maxDiagnostics.
+    *            Documents without any element and exceeded ParseLimits still
+    *            throw.
+    *            Recovery implies eager parsing, setLazy() is ignored.
+    *
+    *   @param recover Whether to recover from errors.
+    *
+    ****************************************************************************/
+    
+    void setRecover(bool recover) { _recover = recover; }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Whether malformed documents are repaired.
+    *
+    ****************************************************************************/
+    
+    bool getRecover() const { return _recover; }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Whether to hash every element while parsing it.
+    *
+    *   @details Each element is hashed as soon as its closing tag is
+    *            reached, while its contents are still in cache, so that
+    *            ParsleyNode::getHash(), isEqual() and diff() can be used on
+    *            the document straight away. Without it, nodes are hashed the
+    *            first time their hash is asked for. Ignored in lazy mode.
+    *            Off by default.
+    *
+    *   @param hashing Whether to hash elements while parsing.
+    *
+    ****************************************************************************/
+    
+    void setHashing(bool hashing) { _hashing = hashing; }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Whether elements are hashed while parsing.
+    *
+    ****************************************************************************/
+    
+    bool getHashing() const { return _hashing; }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Returns the problems repaired during the last parse().
+    *
+    *   @details Each entry is the ParseError that would have been thrown,
+    *            with its offset, line, column and excerpt. Empty unless in
+    *            recovery mode.
+    *
+    ****************************************************************************/
+    
+    const std::vector<ParseError>& getDiagnostics() const { return _diagnostics; }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Parses an XML document into a ParsleyDocument that owns it.
+    *
+    *   @details Same as parse(), but the tree is freed with the document.
+    *
+    *   @param fname The name of the file to parse.
+    *
+    *   @param stats If non-null, filled with statistics about this parse.
+    *
+    ****************************************************************************/
+    
+    ParsleyDocument parseDocument(const std::string& fname, ParseStats * stats = 0);
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Brings a document up to date after part of its file changed.
+    *
+    *   @details Parsley remembers where in the file each node was parsed
+    *            from. Only the innermost element enclosing the change is
+    *            read and parsed again, and its new node takes the place of
+    *            the old one. All nodes outside of it stay as they are, so
+    *            pointers to them remain valid. If the element no longer
+    *            parses on its own, e.g. because the change removed its
+    *            closing tag, its parent is tried instead, and so on.
+    *
+    *            The whole file is parsed again if the change touches the
+    *            tags of the root element or anything before it, and for
+    *            documents that were parsed lazily, in recovery mode, or
+    *            from a compressed or non UTF-8 file. Changes after the end
+    *            of the root element leave the tree as it is, but like
+    *            parse(), they must still be well-formed markup.
+    *
+    *            The tree must still match the file as it was last parsed.
+    *            Nodes added or changed since then are not accounted for.
+    *
+    *   @param document A document parsed from fname with the same settings.
+    *
+    *   @param fname The name of the changed file.
+    *
+    *   @param begin The offset of the first changed byte.
+    *
+    *   @param oldEnd The end of the changed bytes in the old file.
+    *
+    *   @param newEnd The end of the bytes that replaced them in the new file.
+    *
+    *   @return The node that was parsed again, which is the root if the
+    *           whole file was, or null if nothing changed.
+    *
+    *   @throws ParseError if the changed document is malformed.
+    *
+    ****************************************************************************/
+    
+    ParsleyNode * reparse(ParsleyDocument& document, const std::string& fname,
+                          std::size_t begin, std::size_t oldEnd, std::size_t newEnd);
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Fills a struct straight from an XML document, without a tree.
+    *
+    *   @details The root element is mapped onto object by schema, its child
+    *            elements and attributes onto the members bound to their names
+    *            and so on down. Elements and attributes the schema does not
+    *            mention are skipped, and no nodes are ever built. The document
+    *            is checked for well-formedness and ParseLimits as by parse().
+    *            Lazy and recovery mode do not apply.
+    *
+    *   @param fname The name of the file to read.
+    *
+    *   @param schema The mapping of the document onto T.
+    *
+    *   @param object The struct to fill.
+    *
+    *   @throws ParseError if the document is malformed or a value cannot
+    *           be converted to its member's type.
+    *
+    *   @see ParsleySchema
+    *
+    ****************************************************************************/
+    
+    template <class T>
+    void bind(const std::string& fname, const ParsleySchema<T>& schema, T& object)
+    { _bind(fname, schema, &object); }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Processes the records of a large document on several threads.
+    *
+    *   @details Records are the child elements of the root element tagged
+    *            recordTag. This thread reads the document and only finds
+    *            where each record starts and ends. Records are then parsed
+    *            in batches on worker threads, and map is called on each one
+    *            there. consume then gets the results on this thread, in
+    *            document order. Only a few batches per thread are in flight
+    *            at once, so memory stays bounded however large the document
+    *            is.
+    *
+    *            A record's parent is a copy of the root element without its
+    *            other children, so its attributes and namespace declarations
+    *            still apply. Anything in the root element other than records
+    *            is skipped. The records and the tree around them are freed
+    *            after map returns. Only UTF-8 documents are supported.
+    *            Compressed documents are read like parse() reads them.
+    *            ParseLimits::maxBytes applies to each record, the other
+    *            limits to each batch. Lazy and recovery mode do not apply.
+    *
+    *            @code
+    *            parser.mapRecords("orders.xml", "order",
+    *                              [] (ParsleyNode* order) { return total(order); },
+    *                              [&] (double total) { sum += total; });
+    *            @endcode
+    *
+    *   @param fname The name of the file to read.
+    *
+    *   @param recordTag The tag name of the records, as written in the
+    *                    document.
+    *
+    *   @param map Called on a worker thread with each record. Its result is
+    *              handed to consume. It is called on several threads at
+    *              once, so it must be safe to call concurrently.
+    *
+    *   @param consume Called with each result, in document order.
+    *
+    *   @param threads The number of worker threads, 0 for one per core.
+    *
+    *   @throws ParseError if the document is malformed. The error gives the
+    *           byte offset in the document, but no line or excerpt.
     *
     ****************************************************************************/
     
-    ParsleyNode * parse(const std::string& fname);
+    template <class Map, class Consume>
+    void mapRecords(const std::string& fname, const std::string& recordTag,
+                    Map map, Consume consume, unsigned threads = 0)
+    {
+        typedef typename std::decay<decltype(map(static_cast<ParsleyNode*>(0)))>::type Result;
+        
+        // the results of each batch in flight
+        std::vector<std::vector<Result> > results(2 * _workerCount(threads));
+        
+        _mapRecords(fname, recordTag, threads, results.size(),
+                    [&] (std::size_t slot, ParsleyNode * record) { results[slot].push_back(map(record)); },
+                    [&] (std::size_t slot)
+                    {
+                        for (std::size_t n = 0; n < results[slot].size(); ++n)
+                            consume(std::move(results[slot][n]));
+                        
+                        results[slot].clear();
+                    });
+    }
+    
     
     /*************************************************************************//*!
     *
@@ -530,19 +2339,107 @@ public:
               bool deleteTree = true,
               bool addHeader = true);
     
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Saves a document, which keeps ownership of its tree.
+    *
+    *   @param document The document to save.
+    *
+    *   @param fname The name of the file to write.
+    *
+    *   @param addHeader Whether to write an XML header first.
+    *
+    ****************************************************************************/
+    
+    void save(const ParsleyDocument& document,
+              const std::string& fname,
+              bool addHeader = true);
+    
 private:
     
-    typedef std::vector<std::string> StrVec;
+    friend class ParsleyNode;
+    
+    friend struct ParsleyLazyDocument;
+    
+    enum TokenType
+    {
+        TextToken,
+        TagToken,
+        CDataToken,
+        CommentToken,
+        InstructionToken,
+        DoctypeToken
+    };
+    
+    /*! A tag, run of text or other markup, as byte offsets into the document. */
+    struct Token
+    {
+        std::size_t begin;
+        std::size_t end;
+        
+        TokenType type;
+    };
+    
+    /*! Drawn from the default resource, so that ParseStats counts its growth. */
+    typedef std::vector<Token, ParsleyAllocator<Token> > TokenVec;
+    
+    typedef TokenVec::const_iterator TokenVec_cItr;
+    
+    ParsleyNode * _makeNode(Str_cItr begin, Str_cItr end);
+    
+    ParsleyNode * _makeMarkupNode(const Token& token) const;
+    
+    void _appendData(const Token& token, ParsleyNode * node) const;
+    
+    TokenVec_cItr _makeNodeTree(TokenVec_cItr itr, TokenVec_cItr end, ParsleyNode * parent);
+    
+    bool _closesAncestor(const ParsleyNode::String& closingTag, const ParsleyNode * node) const;
+    
+    ParsleyNode * _parseTokens(TokenVec& vec, const std::shared_ptr<ParsleyLazyDocument>& doc);
+    
+    ParsleyNode * _reparseElement(const std::string& text, const ParsleyNode * old);
+    
+    TokenVec _load(const std::string& fname, std::string& str);
+    
+    TokenVec _tokenize(std::string& str);
+    
+    TokenVec _tokenizeStream(const std::function<bool(std::string&)>& next,
+                             std::string& str,
+                             std::size_t sizeHint);
+    
+    Str_cItr _skipHeader(Str_cItr begin, Str_cItr end);
+    
+    void _bind(const std::string& fname, const ParsleyBinding& schema, void * object);
     
-    typedef StrVec::const_iterator StrVec_cItr;
+    void _bindTokens(const TokenVec& vec, const ParsleyBinding& schema, void * object);
     
-    ParsleyNode * _makeNode(Str_cItr begin, Str_cItr end, bool docHead = false);
+    static unsigned _workerCount(unsigned threads);
     
-    StrVec_cItr _makeNodeTree(StrVec_cItr itr, StrVec_cItr end, ParsleyNode * parent);
+    void _mapRecords(const std::string& fname, const std::string& recordTag,
+                     unsigned threads, std::size_t window,
+                     const std::function<void(std::size_t, ParsleyNode*)>& map,
+                     const std::function<void(std::size_t)>& consume);
     
-    std::vector<std::string> _parse(Str_cItr begin, Str_cItr end);
+    ParsleyNode * _parseRecords(const std::string& text);
     
-    bool _isSelfClosing(Str_cItr begin, Str_cItr end) const;
+    TokenVec _parse(Str_cItr begin, Str_cItr end);
+    
+    Str_cItr _scan(Str_cItr begin, Str_cItr end, bool final, TokenVec& vec, std::size_t& searched);
+    
+    bool _transcode(std::string& str, std::size_t& skip);
+    
+    void _checkUtf8(Str_cItr begin, Str_cItr end);
+    
+    void _diagnose(const ParseError& error);
+    
+    std::size_t _matchTokens(const TokenVec& tokens, std::vector<std::size_t>& match);
+    
+    ParsleyNode * _makeLazyNode(const std::shared_ptr<ParsleyLazyDocument>& doc, std::size_t index);
+    
+    void _materialize(const ParsleyNode * node, unsigned char what);
+    
+    void _tagContents(Str_cItr& begin, Str_cItr& end, bool& selfClosed) const;
     
     bool _isTag(Str_cItr begin, Str_cItr end) const;
     
@@ -550,18 +2447,92 @@ private:
     
     bool _isHeader(Str_cItr begin, Str_cItr end);
     
-    ParsleyNode::AttrMap _getAttrs(Str_cItr begin, Str_cItr end) const;
+    void _getAttrs(Str_cItr begin, Str_cItr end, ParsleyNode * node) const;
+    
+    template <class Callback>
+    void _scanAttrs(Str_cItr begin, Str_cItr end, Callback callback) const;
+    
+    void _declareNamespaces(const ParsleyNode * node);
+    
+    ParsleyNames::Id _lookupNamespace(ParsleyNames::Id prefix) const;
+    
+    ParsleyNames::Id _intern(const char* name, std::size_t length);
     
     template <class T>
     T _lastNonSpace(T begin, T end);
     
-    std::string _nodeToString(const ParsleyNode * node,
-                              std::string indent = "",
-                              bool docHead = false) const;
+    void _nodeToString(const ParsleyNode * node,
+                       std::string& str,
+                       const std::string& indent) const;
+    
+    void _treeToString(const ParsleyNode * root,
+                       std::string& str,
+                       std::string& indent) const;
+    
+    void _write(const ParsleyNode * node, const std::string& fname, bool addHeader) const;
+    
+    /*! The resource parsed documents are allocated from. */
+    ParsleyMemoryResource * _resource = ParsleyMemoryResource::getDefault();
+    
+    ParseLimits _limits;
+    
+    bool _isLazy = false;
+    
+    bool _keepComments = false;
+    
+    bool _validateUtf8 = false;
+    
+    bool _readAhead = false;
+    
+    bool _hashing = false;
+    
+    /*! Whether the document currently being parsed is validated. */
+    bool _validating = false;
+    
+    bool _recover = false;
+    
+    /*! Problems repaired during the last parse, in recovery mode. */
+    std::vector<ParseError> _diagnostics;
+    
+    /*! Start of the document currently being parsed, for offsets. */
+    Str_cItr _docBegin;
+    
+    /*! Number of elements created so far in the current parse. */
+    std::size_t _nodeCount = 0;
+    
+    /*! Statistics of the current parse, null if not requested. */
+    ParseStats * _stats = 0;
+    
+    /*! Nesting depth of the node currently being built. */
+    std::size_t _depth = 0;
+    
+    /*! A namespace declaration in scope while building the tree. */
+    struct NamespaceBinding
+    {
+        ParsleyNames::Id prefix;
+        ParsleyNames::Id ns;
+    };
+    
+    /*! The declarations of the open elements, innermost last. */
+    std::vector<NamespaceBinding> _bindings;
+    
+    /*! Names interned before, so they are found without locking the table. */
+    struct NameCache
+    {
+        NameCache() { }
+        
+        /*! Copies of the parser, e.g. for lazy documents, start out empty. */
+        NameCache(const NameCache&) { }
+        
+        NameCache& operator=(const NameCache&) { ids.clear(); return *this; }
+        
+        std::unordered_map<std::string, ParsleyNames::Id> ids;
+    };
+    
+    NameCache _names;
     
-    std::string _treeToString(const ParsleyNode * root,
-                              std::string& str,
-                              std::string indent = "") const;
+    /*! Reused buffer for looking up _names. */
+    std::string _nameKey;
 };
 
 #endif /* defined(__Parsley__) */
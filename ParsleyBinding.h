@@ -0,0 +1,427 @@
+//
+//  ParsleyBinding.h
+//  Parsley
+//
+
+#ifndef __Parsley_Binding__
+#define __Parsley_Binding__
+
+#include "ParsleyErrors.h"
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+/*************************************************************************//*!
+*
+*   @brief Converts the text of an element or attribute to a std::string.
+*
+*   @details parsleyConvert() is what a ParsleySchema uses to store text in
+*            a field. Overload it for your own field types; it is found by
+*            argument-dependent lookup.
+*
+****************************************************************************/
+
+inline void parsleyConvert(std::string& out, const char* begin, const char* end)
+{
+    out.assign(begin, end);
+}
+
+/*************************************************************************//*!
+*
+*   @brief Converts text to an integer in place, without allocating.
+*
+*   @throws ParseError if the text is not a number or out of range.
+*
+****************************************************************************/
+
+template <class T>
+typename std::enable_if<std::is_integral<T>::value && ! std::is_same<T, bool>::value>::type
+parsleyConvert(T& out, const char* begin, const char* end)
+{
+    typedef typename std::make_unsigned<T>::type Unsigned;
+    
+    bool negative = false;
+    
+    if (begin != end && (*begin == '-' || *begin == '+'))
+    {
+        negative = *begin++ == '-';
+        
+        if (negative && ! std::is_signed<T>::value)
+            throw ParseError("Negative value for an unsigned field!");
+    }
+    
+    if (begin == end) throw ParseError("Expected a number!");
+    
+    // the magnitude of the most negative value is one more than the maximum
+    const Unsigned limit = static_cast<Unsigned>(std::numeric_limits<T>::max()) + (negative ? 1 : 0);
+    
+    Unsigned value = 0;
+    
+    for ( ; begin != end; ++begin)
+    {
+        unsigned digit = static_cast<unsigned char>(*begin) - '0';
+        
+        if (digit > 9) throw ParseError("Expected a number!");
+        
+        if (value > (limit - digit) / 10) throw ParseError("Number out of range!");
+        
+        value = value * 10 + digit;
+    }
+    
+    out = negative ? static_cast<T>(0 - value) : static_cast<T>(value);
+}
+
+/*************************************************************************//*!
+*
+*   @brief Converts text to a floating point number.
+*
+*   @details The text is copied to the stack for strtod(), so this does not
+*            allocate either. Uses the C locale's decimal point.
+*
+*   @throws ParseError if the text is not a number.
+*
+****************************************************************************/
+
+template <class T>
+typename std::enable_if<std::is_floating_point<T>::value>::type
+parsleyConvert(T& out, const char* begin, const char* end)
+{
+    char buffer[64];
+    
+    std::size_t length = end - begin;
+    
+    if (length == 0 || length >= sizeof(buffer)) throw ParseError("Expected a number!");
+    
+    std::memcpy(buffer, begin, length);
+    
+    buffer[length] = '\0';
+    
+    char* last;
+    
+    errno = 0;
+    
+    double value = std::strtod(buffer, &last);
+    
+    if (last != buffer + length) throw ParseError("Expected a number!");
+    
+    if (errno == ERANGE) throw ParseError("Number out of range!");
+    
+    out = static_cast<T>(value);
+}
+
+/*************************************************************************//*!
+*
+*   @brief Converts "true", "false", "1" or "0" to a bool.
+*
+*   @throws ParseError for anything else.
+*
+****************************************************************************/
+
+inline void parsleyConvert(bool& out, const char* begin, const char* end)
+{
+    std::size_t length = end - begin;
+    
+    if ((length == 4 && ! std::memcmp(begin, "true", 4)) || (length == 1 && *begin == '1')) out = true;
+    
+    else if ((length == 5 && ! std::memcmp(begin, "false", 5)) || (length == 1 && *begin == '0')) out = false;
+    
+    else throw ParseError("Expected a boolean!");
+}
+
+/*! Appends every occurrence of a repeated element or attribute to a vector. */
+template <class T>
+void parsleyConvert(std::vector<T>& out, const char* begin, const char* end)
+{
+    out.emplace_back();
+    
+    parsleyConvert(out.back(), begin, end);
+}
+
+/*************************************************************************//*!
+*
+*   @brief How a single field of a schema is filled in.
+*
+****************************************************************************/
+
+class ParsleyFieldBinder
+{
+    
+public:
+    
+    virtual ~ParsleyFieldBinder() { }
+    
+    /*! Stores the text [begin, end) in the field of object. */
+    virtual void assign(void* object, const char* begin, const char* end) const = 0;
+};
+
+/*************************************************************************//*!
+*
+*   @brief How an element bound to a nested struct is entered.
+*
+****************************************************************************/
+
+class ParsleyNestedBinder
+{
+    
+public:
+    
+    virtual ~ParsleyNestedBinder() { }
+    
+    /*! Returns the object to fill from the nested element, creating it if need be. */
+    virtual void* enter(void* object) const = 0;
+};
+
+/*************************************************************************//*!
+*
+*   @brief The type-independent part of a ParsleySchema.
+*
+*   @details Holds the fields of a schema and a perfect hash table of their
+*            names, which the parser uses to dispatch each tag and
+*            attribute with a single hash and one comparison.
+*
+****************************************************************************/
+
+class ParsleyBinding
+{
+    
+public:
+    
+    /*! A bound element or attribute. */
+    struct Field
+    {
+        std::string name;
+        
+        bool isAttribute;
+        
+        /*! Set for elements and attributes holding text. */
+        std::shared_ptr<const ParsleyFieldBinder> binder;
+        
+        /*! Set for elements bound to a nested struct. */
+        std::shared_ptr<const ParsleyNestedBinder> nested;
+        
+        /*! The schema of the nested struct. */
+        std::shared_ptr<const ParsleyBinding> schema;
+    };
+    
+    virtual ~ParsleyBinding() { }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Finds the field bound to an element or attribute name.
+    *
+    *   @param name The name of the element or attribute.
+    *
+    *   @param length The length of the name in bytes.
+    *
+    *   @param isAttribute Whether to look for an attribute or an element.
+    *
+    *   @return The field, or null if the name is not bound.
+    *
+    ****************************************************************************/
+    
+    const Field* find(const char* name, std::size_t length, bool isAttribute) const
+    {
+        if (_table.empty()) return 0;
+        
+        std::size_t slot = _table[_hash(name, length, isAttribute, _seed) & (_table.size() - 1)];
+        
+        if (slot == _empty) return 0;
+        
+        const Field& field = _fields[slot];
+        
+        if (field.isAttribute != isAttribute ||
+            field.name.size() != length ||
+            std::memcmp(field.name.data(), name, length))
+            return 0;
+        
+        return &field;
+    }
+    
+protected:
+    
+    /*! Adds a field and rebuilds the hash table. */
+    void _add(const Field& field);
+    
+private:
+    
+    static const std::size_t _empty = static_cast<std::size_t>(-1);
+    
+    /*! FNV-1a over the name, with the seed and kind mixed in. */
+    static std::size_t _hash(const char* name, std::size_t length, bool isAttribute, std::size_t seed)
+    {
+        std::size_t hash = 2166136261u ^ seed ^ (isAttribute ? 0x9e3779b9u : 0);
+        
+        for (const char* end = name + length; name != end; ++name)
+            hash = (hash ^ static_cast<unsigned char>(*name)) * 16777619u;
+        
+        return hash ^ (hash >> 15);
+    }
+    
+    std::vector<Field> _fields;
+    
+    /*! For every slot, the index of the field hashing to it, or _empty. */
+    std::vector<std::size_t> _table;
+    
+    std::size_t _seed = 0;
+};
+
+/*************************************************************************//*!
+*
+*   @brief Maps the elements and attributes of a document onto a struct.
+*
+*   @details Declare the mapping once, for example as a static object, and
+*            pass it to Parsley::bind(), which fills a T straight from the
+*            document's tokens without building any nodes:
+*
+*            @code
+*            static const ParsleySchema<Dish> dish = ParsleySchema<Dish>()
+*                .attribute("time", &Dish::time)
+*                .element("name", &Dish::name)
+*                .element("calories", &Dish::calories);
+*
+*            static const ParsleySchema<Menu> menu = ParsleySchema<Menu>()
+*                .element("dish", &Menu::dishes, dish);
+*            @endcode
+*
+*            Fields are converted with parsleyConvert(): numbers in place,
+*            text with entities decoded and surrounding whitespace removed.
+*            A std::vector field collects every occurrence. Elements and
+*            attributes not in the schema are skipped.
+*
+****************************************************************************/
+
+template <class T>
+class ParsleySchema : public ParsleyBinding
+{
+    
+public:
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Binds the text of a child element to a member.
+    *
+    ****************************************************************************/
+    
+    template <class M>
+    ParsleySchema& element(const std::string& name, M T::* member)
+    { return _text(name, member, false); }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Binds an attribute of the element to a member.
+    *
+    ****************************************************************************/
+    
+    template <class M>
+    ParsleySchema& attribute(const std::string& name, M T::* member)
+    { return _text(name, member, true); }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Binds a child element to a nested struct member.
+    *
+    *   @param schema The schema of the nested struct, which is copied.
+    *
+    ****************************************************************************/
+    
+    template <class M>
+    ParsleySchema& element(const std::string& name, M T::* member, const ParsleySchema<M>& schema)
+    { return _nested(name, std::make_shared<NestedBinder<M> >(member), schema); }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Binds a repeated child element to a vector of nested structs.
+    *
+    *   @param schema The schema of the nested struct, which is copied.
+    *
+    ****************************************************************************/
+    
+    template <class M>
+    ParsleySchema& element(const std::string& name, std::vector<M> T::* member, const ParsleySchema<M>& schema)
+    { return _nested(name, std::make_shared<RepeatedBinder<M> >(member), schema); }
+    
+private:
+    
+    template <class M>
+    struct TextBinder : public ParsleyFieldBinder
+    {
+        explicit TextBinder(M T::* member) : member(member) { }
+        
+        virtual void assign(void* object, const char* begin, const char* end) const
+        { parsleyConvert(static_cast<T*>(object)->*member, begin, end); }
+        
+        M T::* member;
+    };
+    
+    template <class M>
+    struct NestedBinder : public ParsleyNestedBinder
+    {
+        explicit NestedBinder(M T::* member) : member(member) { }
+        
+        virtual void* enter(void* object) const
+        { return &(static_cast<T*>(object)->*member); }
+        
+        M T::* member;
+    };
+    
+    template <class M>
+    struct RepeatedBinder : public ParsleyNestedBinder
+    {
+        explicit RepeatedBinder(std::vector<M> T::* member) : member(member) { }
+        
+        virtual void* enter(void* object) const
+        {
+            std::vector<M>& vec = static_cast<T*>(object)->*member;
+            
+            vec.emplace_back();
+            
+            return &vec.back();
+        }
+        
+        std::vector<M> T::* member;
+    };
+    
+    template <class M>
+    ParsleySchema& _text(const std::string& name, M T::* member, bool isAttribute)
+    {
+        Field field;
+        
+        field.name = name;
+        field.isAttribute = isAttribute;
+        field.binder = std::make_shared<TextBinder<M> >(member);
+        
+        _add(field);
+        
+        return *this;
+    }
+    
+    template <class M>
+    ParsleySchema& _nested(const std::string& name,
+                           const std::shared_ptr<const ParsleyNestedBinder>& nested,
+                           const ParsleySchema<M>& schema)
+    {
+        Field field;
+        
+        field.name = name;
+        field.isAttribute = false;
+        field.nested = nested;
+        field.schema = std::make_shared<ParsleySchema<M> >(schema);
+        
+        _add(field);
+        
+        return *this;
+    }
+};
+
+#endif /* defined(__Parsley_Binding__) */
@@ -10,6 +10,8 @@
 #define __Parsley_Errors__
 
 #include <stdexcept>
+#include <string>
+#include <vector>
 
 struct FileOpenError : public std::runtime_error
 {
@@ -35,10 +37,114 @@ struct FileNotOpenError : public std::runtime_error
     : std::runtime_error(msg) {}
 };
 
+struct DecompressionError : public std::runtime_error
+{
+    DecompressionError(std::string msg = "Error decompressing file!")
+    : std::runtime_error(msg) {}
+};
+
+struct MemoryLimitError : public std::runtime_error
+{
+    MemoryLimitError(std::string msg = "Memory budget exceeded!")
+    : std::runtime_error(msg) {}
+};
+
+struct WriterError : public std::runtime_error
+{
+    WriterError(std::string msg = "Writing would produce malformed XML!")
+    : std::runtime_error(msg) {}
+};
+
 struct ParseError : public std::runtime_error
 {
     ParseError(std::string msg = "Error parsing file!")
-    : std::runtime_error(msg) {}
+    : std::runtime_error(msg), _message(msg) {}
+    
+    ParseError(std::string msg, std::size_t offset)
+    : std::runtime_error(msg + " (at byte offset " + std::to_string(offset) + ")"),
+      _message(msg),
+      _offset(offset) {}
+    
+    /*! The description of the error, without its position. */
+    const std::string& getMessage() const { return _message; }
+    
+    /*! The byte offset in the document at which the error occurred, or npos. */
+    std::size_t getOffset() const { return _offset; }
+    
+    /*! The line of the error, counting from 1, or 0 if not known. */
+    std::size_t getLine() const { return _line; }
+    
+    /*! The column of the error in characters, counting from 1, or 0 if not known. */
+    std::size_t getColumn() const { return _column; }
+    
+    /*! The text of the line around the error, or an empty string if not known. */
+    const std::string& getExcerpt() const { return _excerpt; }
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Works out the line, column and excerpt of the error.
+    *
+    *   @details Parsley calls this once it catches an error on its way out
+    *            of a parse, so lines are only counted when something went
+    *            wrong. Afterwards what() includes the position and excerpt.
+    *            Does nothing if the offset is unknown or already located.
+    *
+    *   @param begin The start of the document the offset refers to.
+    *
+    *   @param size The size of the document in bytes.
+    *
+    ****************************************************************************/
+    
+    void locate(const char* begin, std::size_t size);
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Locates many errors in the same document at once.
+    *
+    *   @details Equivalent to calling locate() on each error, but lines and
+    *            columns are counted in a single pass over the document
+    *            rather than once per error.
+    *
+    *   @param errors The errors to locate, in any order.
+    *
+    *   @param begin The start of the document the offsets refer to.
+    *
+    *   @param size The size of the document in bytes.
+    *
+    ****************************************************************************/
+    
+    static void locate(std::vector<ParseError>& errors, const char* begin, std::size_t size);
+    
+    virtual const char* what() const noexcept
+    { return _what.empty() ? std::runtime_error::what() : _what.c_str(); }
+    
+private:
+    
+    void _place(const char* begin, std::size_t size,
+                const char* lineBegin, std::size_t line, std::size_t column);
+    
+    std::string _message;
+    
+    /*! The message with line, column and excerpt, once located. */
+    std::string _what;
+    
+    std::string _excerpt;
+    
+    std::size_t _offset = std::string::npos;
+    
+    std::size_t _line = 0;
+    
+    std::size_t _column = 0;
+};
+
+struct EncodingError : public ParseError
+{
+    EncodingError(std::string msg = "Invalid character encoding!")
+    : ParseError(msg) {}
+    
+    EncodingError(std::string msg, std::size_t offset)
+    : ParseError(msg, offset) {}
 };
 
 #endif
@@ -0,0 +1,313 @@
+//
+//  ParsleyMemory.h
+//  Parsley
+//
+
+#ifndef __Parsley_Memory__
+#define __Parsley_Memory__
+
+#include <atomic>
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+/*************************************************************************//*!
+*
+*   @brief Abstract source of memory for ParsleyNodes and their strings.
+*
+*   @details This mirrors std::pmr::memory_resource. Every ParsleyNode,
+*            together with its tag, data and attribute storage, obtains its
+*            memory from a ParsleyMemoryResource. Derive from this class
+*            and implement doAllocate() and doDeallocate() to account for,
+*            pool or cap the memory used by a document.
+*
+****************************************************************************/
+
+class ParsleyMemoryResource
+{
+    
+public:
+    
+    virtual ~ParsleyMemoryResource() { }
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Allocates bytes bytes of memory aligned to align.
+    *
+    ****************************************************************************/
+    
+    void* allocate(std::size_t bytes, std::size_t align = alignof(std::max_align_t))
+    { if (_counter) ++*_counter; return doAllocate(bytes, align); }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Returns memory previously obtained from allocate().
+    *
+    ****************************************************************************/
+    
+    void deallocate(void* ptr, std::size_t bytes, std::size_t align = alignof(std::max_align_t))
+    { doDeallocate(ptr, bytes, align); }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Whether memory allocated by this resource can be deallocated
+    *          by other and vice versa.
+    *
+    ****************************************************************************/
+    
+    bool isEqual(const ParsleyMemoryResource& other) const
+    { return this == &other || doIsEqual(other); }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Accounts for bytes kept on behalf of the documents using this
+    *          resource that are not allocated from it and never returned.
+    *
+    *   @details Parsley charges the names a parse adds to the ParsleyNames
+    *            table this way. Does nothing unless doCharge() is overridden.
+    *
+    *   @throws MemoryLimitError if the bytes do not fit a budget.
+    *
+    ****************************************************************************/
+    
+    void charge(std::size_t bytes)
+    { doCharge(bytes); }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Returns the default resource, which uses operator new and delete.
+    *
+    ****************************************************************************/
+    
+    static ParsleyMemoryResource* getDefault();
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Counts the allocations that any resource makes on the calling
+    *          thread.
+    *
+    *   @details Parsley::parse() uses this to fill in ParseStats.
+    *
+    *   @param counter Incremented on every allocate(), or null to stop.
+    *
+    ****************************************************************************/
+    
+    static void setAllocationCounter(std::size_t* counter) { _counter = counter; }
+    
+    
+    /*! Returns the counter set for the calling thread, or null. */
+    static std::size_t* getAllocationCounter() { return _counter; }
+    
+protected:
+    
+    virtual void* doAllocate(std::size_t bytes, std::size_t align) = 0;
+    
+    virtual void doDeallocate(void* ptr, std::size_t bytes, std::size_t align) = 0;
+    
+    virtual bool doIsEqual(const ParsleyMemoryResource&) const { return false; }
+    
+    virtual void doCharge(std::size_t) { }
+    
+private:
+    
+    static thread_local std::size_t* _counter;
+};
+
+/*************************************************************************//*!
+*
+*   @brief A memory resource that enforces a byte budget.
+*
+*   @details Forwards all requests to an upstream resource while keeping
+*            track of the bytes currently in use, the peak usage and the
+*            number of allocations. An allocation that would take the usage
+*            above the budget throws MemoryLimitError instead, so a parse
+*            using this resource fails cleanly rather than exhausting the
+*            process' memory. Bytes passed to charge() count as in use for
+*            good, and are passed on upstream. Safe to share between threads.
+*
+****************************************************************************/
+
+class ParsleyBudgetResource : public ParsleyMemoryResource
+{
+    
+public:
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Constructs a budget resource.
+    *
+    *   @param budget The maximum number of bytes in use at any time.
+    *
+    *   @param upstream The resource that actually provides the memory.
+    *
+    ****************************************************************************/
+    
+    ParsleyBudgetResource(std::size_t budget = std::numeric_limits<std::size_t>::max(),
+                          ParsleyMemoryResource* upstream = ParsleyMemoryResource::getDefault())
+    : _budget(budget), _upstream(upstream)
+    { }
+    
+    /*! Returns the budget in bytes. */
+    std::size_t getBudget() const { return _budget; }
+    
+    /*! Returns the number of bytes currently allocated. */
+    std::size_t getBytesInUse() const { return _inUse; }
+    
+    /*! Returns the highest number of bytes allocated at any one time. */
+    std::size_t getPeakBytes() const { return _peak; }
+    
+    /*! Returns the total number of allocations made so far. */
+    std::size_t getAllocationCount() const { return _allocations; }
+    
+protected:
+    
+    virtual void* doAllocate(std::size_t bytes, std::size_t align);
+    
+    virtual void doDeallocate(void* ptr, std::size_t bytes, std::size_t align);
+    
+    virtual void doCharge(std::size_t bytes);
+    
+private:
+    
+    const std::size_t _budget;
+    
+    ParsleyMemoryResource* _upstream;
+    
+    std::atomic<std::size_t> _inUse{0};
+    
+    std::atomic<std::size_t> _peak{0};
+    
+    std::atomic<std::size_t> _allocations{0};
+};
+
+/*************************************************************************//*!
+*
+*   @brief A memory resource that hands out memory from large blocks.
+*
+*   @details Allocations are carved out of blocks obtained from an upstream
+*            resource, so allocating is little more than a pointer bump.
+*            Deallocation does nothing: the blocks are only returned when
+*            the arena is released or destroyed, which makes it a good
+*            target for documents that are built, used and dropped as a
+*            whole, such as clones of a template. Nodes allocated from an
+*            arena must be deleted (or no longer used) before the arena
+*            itself goes away. Not safe to share between threads.
+*
+****************************************************************************/
+
+class ParsleyArenaResource : public ParsleyMemoryResource
+{
+    
+public:
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Constructs an arena.
+    *
+    *   @param blockSize The size of the first block in bytes. Every further
+    *                    block is twice as large as the one before.
+    *
+    *   @param upstream The resource the blocks are allocated from.
+    *
+    ****************************************************************************/
+    
+    explicit ParsleyArenaResource(std::size_t blockSize = 4096,
+                                  ParsleyMemoryResource* upstream = ParsleyMemoryResource::getDefault())
+    : _upstream(upstream), _nextBlockSize(blockSize ? blockSize : 1)
+    { }
+    
+    ParsleyArenaResource(const ParsleyArenaResource&) = delete;
+    
+    ParsleyArenaResource& operator=(const ParsleyArenaResource&) = delete;
+    
+    ~ParsleyArenaResource() { release(); }
+    
+    /*! Returns all blocks to the upstream resource, invalidating everything allocated. */
+    void release();
+    
+    /*! Returns the number of bytes obtained from the upstream resource. */
+    std::size_t getBytesReserved() const { return _reserved; }
+    
+    /*! Sets the size of the next block, after which blocks double in size again. */
+    void setBlockSize(std::size_t blockSize) { _nextBlockSize = blockSize ? blockSize : 1; }
+    
+protected:
+    
+    virtual void* doAllocate(std::size_t bytes, std::size_t align);
+    
+    virtual void doDeallocate(void*, std::size_t, std::size_t) { }
+    
+private:
+    
+    struct Block
+    {
+        void* memory;
+        std::size_t size;
+    };
+    
+    ParsleyMemoryResource* _upstream;
+    
+    std::vector<Block> _blocks;
+    
+    char* _current = 0;
+    
+    std::size_t _left = 0;
+    
+    std::size_t _nextBlockSize;
+    
+    std::size_t _reserved = 0;
+};
+
+/*************************************************************************//*!
+*
+*   @brief A standard-conforming allocator drawing from a ParsleyMemoryResource.
+*
+*   @details Used for the strings and attribute containers of ParsleyNodes,
+*            so that all of a node's memory is charged to the same resource.
+*
+****************************************************************************/
+
+template <class T>
+class ParsleyAllocator
+{
+    
+public:
+    
+    typedef T value_type;
+    
+    ParsleyAllocator(ParsleyMemoryResource* resource = ParsleyMemoryResource::getDefault())
+    : _resource(resource)
+    { }
+    
+    template <class U>
+    ParsleyAllocator(const ParsleyAllocator<U>& other)
+    : _resource(other.getResource())
+    { }
+    
+    T* allocate(std::size_t n)
+    { return static_cast<T*>(_resource->allocate(n * sizeof(T), alignof(T))); }
+    
+    void deallocate(T* ptr, std::size_t n)
+    { _resource->deallocate(ptr, n * sizeof(T), alignof(T)); }
+    
+    ParsleyMemoryResource* getResource() const { return _resource; }
+    
+private:
+    
+    ParsleyMemoryResource* _resource;
+};
+
+template <class T, class U>
+bool operator==(const ParsleyAllocator<T>& first, const ParsleyAllocator<U>& second)
+{ return first.getResource()->isEqual(*second.getResource()); }
+
+template <class T, class U>
+bool operator!=(const ParsleyAllocator<T>& first, const ParsleyAllocator<U>& second)
+{ return ! (first == second); }
+
+#endif /* defined(__Parsley_Memory__) */
@@ -0,0 +1,120 @@
+//
+//  ParsleyNames.h
+//  Parsley
+//
+
+#ifndef __Parsley_Names__
+#define __Parsley_Names__
+
+#include <cstddef>
+#include <string>
+
+class ParsleyMemoryResource;
+
+/*************************************************************************//*!
+*
+*   @brief Process-wide table of interned names.
+*
+*   @details Namespace URIs and local names of elements and attributes are
+*            interned once while parsing, so that namespace-aware lookups
+*            compare pairs of integers instead of strings. An Id stays valid
+*            for the lifetime of the process and the same string always
+*            maps to the same Id, across documents and Parsley objects. The
+*            empty string, which also stands for "no namespace", is always
+*            None. Safe to use from several threads.
+*
+*            Names are never removed, so documents with ever new names grow
+*            the table for good. Parsley charges every name a parse adds to
+*            the parser's memory resource, see ParsleyMemoryResource::charge(),
+*            so that a budget caps this growth too. Lookups by name use
+*            find(), which adds nothing.
+*
+****************************************************************************/
+
+class ParsleyNames
+{
+    
+public:
+    
+    typedef unsigned int Id;
+    
+    /*! The Id of the empty string, used for names without a namespace. */
+    static const Id None = 0;
+    
+    /*! Returned by find() for a name never interned. No node has this Id. */
+    static const Id Unknown = static_cast<Id>(-1);
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Returns the Id of a name, adding it to the table if needed.
+    *
+    *   @param name The name to intern.
+    *
+    *   @param length The length of the name in bytes.
+    *
+    *   @param charge If not null, the resource charged for the memory the
+    *                 table takes up for the name, should it be new.
+    *
+    *   @throws MemoryLimitError if the charge exceeds a budget, in which
+    *           case the name is not added.
+    *
+    ****************************************************************************/
+    
+    static Id intern(const char* name, std::size_t length, ParsleyMemoryResource* charge = 0);
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Returns the Id of a name, adding it to the table if needed.
+    *
+    *   @param name The name to intern.
+    *
+    ****************************************************************************/
+    
+    static Id intern(const std::string& name)
+    { return intern(name.data(), name.size()); }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Returns the Id of a name without adding it to the table.
+    *
+    *   @param name The name to look up.
+    *
+    *   @param length The length of the name in bytes.
+    *
+    *   @return The name's Id, or Unknown if it was never interned.
+    *
+    ****************************************************************************/
+    
+    static Id find(const char* name, std::size_t length);
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Returns the Id of a name without adding it to the table.
+    *
+    *   @param name The name to look up.
+    *
+    *   @return The name's Id, or Unknown if it was never interned.
+    *
+    ****************************************************************************/
+    
+    static Id find(const std::string& name)
+    { return find(name.data(), name.size()); }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Returns the name an Id stands for.
+    *
+    *   @param id An Id returned by intern().
+    *
+    *   @throws std::out_of_range if the id was never handed out.
+    *
+    ****************************************************************************/
+    
+    static const std::string& getName(Id id);
+};
+
+#endif /* defined(__Parsley_Names__) */
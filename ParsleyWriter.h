@@ -0,0 +1,276 @@
+//
+//  ParsleyWriter.h
+//  Parsley
+//
+
+#ifndef __Parsley_Writer__
+#define __Parsley_Writer__
+
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+
+/*************************************************************************//*!
+*
+*   @brief Writes XML straight to an output buffer, without building a tree.
+*
+*   @details Call startElement(), attr(), text() and endElement() in
+*            document order and the writer serializes each call into its
+*            buffer, escaping text and attribute values as it goes. The
+*            calls are checked cheaply for well-formedness: names must be
+*            valid, attributes must follow their start tag and be unique,
+*            there must be exactly one root element and every element must
+*            be closed. A call that would produce malformed XML throws
+*            WriterError and leaves the buffer as it was.
+*
+*            Output goes to a string, a file or a callback sink. File and
+*            callback sinks are handed the buffer whenever it grows past
+*            the flush size, so memory stays bounded for large documents.
+*            After finish(), reset() starts the next document while keeping
+*            the buffer's capacity, so writing many small documents does
+*            not allocate once the buffer has grown.
+*
+*            Elements without children or text are written as <tag/>. No
+*            whitespace is added between elements.
+*
+****************************************************************************/
+
+class ParsleyWriter
+{
+    
+public:
+    
+    /*! Receives the serialized output in pieces, in order. */
+    typedef std::function<void(const char*, std::size_t)> Sink;
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Constructs a writer that keeps its output in a string.
+    *
+    *   @details Get the output with getString() after finish().
+    *
+    ****************************************************************************/
+    
+    ParsleyWriter();
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Constructs a writer that writes its output to a file.
+    *
+    *   @param fname The name of the file to write.
+    *
+    *   @param flushSize The buffer size in bytes above which output is
+    *                    written to the file.
+    *
+    *   @throws FileOpenError if the file cannot be opened.
+    *
+    ****************************************************************************/
+    
+    explicit ParsleyWriter(const std::string& fname, std::size_t flushSize = 64 * 1024);
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Constructs a writer that hands its output to a callback.
+    *
+    *   @param sink The callback receiving the output.
+    *
+    *   @param flushSize The buffer size in bytes above which output is
+    *                    passed to the sink.
+    *
+    ****************************************************************************/
+    
+    explicit ParsleyWriter(Sink sink, std::size_t flushSize = 64 * 1024);
+    
+    ParsleyWriter(const ParsleyWriter&) = delete;
+    
+    ParsleyWriter& operator=(const ParsleyWriter&) = delete;
+    
+    /*! Flushes whatever is still buffered to the file or sink. */
+    ~ParsleyWriter();
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Writes the XML header.
+    *
+    *   @throws WriterError if anything was written before.
+    *
+    ****************************************************************************/
+    
+    ParsleyWriter& header();
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Opens a new element inside the current one.
+    *
+    *   @param name The tag name of the element.
+    *
+    *   @param length The length of the name in bytes.
+    *
+    *   @throws WriterError if the name is invalid or the element would be
+    *           a second root element.
+    *
+    ****************************************************************************/
+    
+    ParsleyWriter& startElement(const char* name, std::size_t length);
+    
+    ParsleyWriter& startElement(const char* name)
+    { return startElement(name, std::strlen(name)); }
+    
+    ParsleyWriter& startElement(const std::string& name)
+    { return startElement(name.data(), name.size()); }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Adds an attribute to the element just opened.
+    *
+    *   @details The value is escaped.
+    *
+    *   @throws WriterError if no start tag is open, because text or a
+    *           child was written since, or if the element already has an
+    *           attribute of that name.
+    *
+    ****************************************************************************/
+    
+    ParsleyWriter& attr(const char* name, std::size_t nameLength,
+                        const char* value, std::size_t valueLength);
+    
+    ParsleyWriter& attr(const char* name, const char* value)
+    { return attr(name, std::strlen(name), value, std::strlen(value)); }
+    
+    ParsleyWriter& attr(const std::string& name, const std::string& value)
+    { return attr(name.data(), name.size(), value.data(), value.size()); }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Writes text into the current element.
+    *
+    *   @details The text is escaped.
+    *
+    *   @throws WriterError if no element is open.
+    *
+    ****************************************************************************/
+    
+    ParsleyWriter& text(const char* data, std::size_t length);
+    
+    ParsleyWriter& text(const char* data)
+    { return text(data, std::strlen(data)); }
+    
+    ParsleyWriter& text(const std::string& data)
+    { return text(data.data(), data.size()); }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Writes a comment.
+    *
+    *   @throws WriterError if the text contains "--" or ends with '-'.
+    *
+    ****************************************************************************/
+    
+    ParsleyWriter& comment(const std::string& text);
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Writes a processing instruction.
+    *
+    *   @throws WriterError if the target is not a valid name or the data
+    *           contains "?>".
+    *
+    ****************************************************************************/
+    
+    ParsleyWriter& instruction(const std::string& target, const std::string& data = "");
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Closes the innermost open element.
+    *
+    *   @throws WriterError if no element is open.
+    *
+    ****************************************************************************/
+    
+    ParsleyWriter& endElement();
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Completes the document and flushes it to the sink.
+    *
+    *   @throws WriterError if an element is still open or there is no root
+    *           element.
+    *
+    *   @throws FileWriteError if writing to the file fails.
+    *
+    ****************************************************************************/
+    
+    void finish();
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Starts a new document on the same sink.
+    *
+    *   @details Discards anything not yet flushed but keeps the buffer's
+    *            capacity for reuse.
+    *
+    ****************************************************************************/
+    
+    void reset();
+    
+    /*! Returns the output not yet flushed, which is all of it for string writers. */
+    const std::string& getString() const { return _buffer; }
+    
+    /*! Returns the number of elements currently open. */
+    std::size_t getDepth() const { return _open.size(); }
+    
+private:
+    
+    struct Span
+    {
+        std::size_t begin;
+        std::size_t length;
+    };
+    
+    void _closeStartTag();
+    
+    void _flush();
+    
+    /*! Hands the buffer to the sink once it is full and no start tag is open. */
+    void _flushIfFull()
+    { if (_sink && ! _tagOpen && _buffer.size() >= _flushSize) _flush(); }
+    
+    std::string _buffer;
+    
+    /*! The names of the open elements, back to back. */
+    std::string _names;
+    
+    /*! Where each open element's name starts in _names. */
+    std::vector<std::size_t> _open;
+    
+    /*! The names of the attributes in the open start tag, as spans of _buffer. */
+    std::vector<Span> _attrs;
+    
+    Sink _sink;
+    
+    std::ofstream _file;
+    
+    std::size_t _flushSize;
+    
+    bool _tagOpen;
+    
+    bool _hasRoot;
+    
+    bool _started;
+};
+
+#endif /* defined(__Parsley_Writer__) */
@@ -0,0 +1,1043 @@
+//
+//  benchmark.cpp
+//  Parsley
+//
+//  Built-in benchmark harness for Parsley. Generates synthetic XML corpora
+//  (deep, wide, attribute-heavy, text-heavy and large documents), optionally
+//  takes real-world XML files as command-line arguments, and measures
+//  Parsley::parse() (eager, lazy and with UTF-8 validation), Parsley::save(),
+//  ParsleyNode::getElementsByTagName() and its lazy range counterpart,
+//  parsing from a cold page cache with and without read-ahead,
+//  ParsleyNode::clone(), deriving an
+//  edited copy from a ParsleyTemplate and saving an unedited one, and tree
+//  destruction. It also writes
+//  many small response documents, once by building trees and saving them
+//  and once with ParsleyWriter, and reads the records of the large corpus
+//  into structs, from a tree, with a ParsleySchema and on all cores with
+//  Parsley::mapRecords(), and updates it after a small edit with
+//  Parsley::reparse(). Built with
+//  PARSLEY_WITH_ZLIB, it also parses gzip-compressed copies of each corpus,
+//  once decompressed to a file first and once directly.
+//
+//  Build (from the repository root):
+//
+//      g++ -std=c++11 -O2 -I. benchmarks/benchmark.cpp Parsley.cpp -o parsley_bench -pthread
+//
+//  or, including the compressed input benchmark:
+//
+//      g++ -std=c++11 -O2 -DPARSLEY_WITH_ZLIB -I. benchmarks/benchmark.cpp Parsley.cpp -o parsley_bench -lz -pthread
+//
+//  Usage:
+//
+//      ./parsley_bench [-r repetitions] [-s scale] [file.xml ...]
+//
+//  Without file arguments the synthetic corpora are generated into the
+//  working directory, benchmarked and removed again. The scale factor
+//  multiplies the size of every synthetic corpus.
+//
+
+#include "Parsley.h"
+#include "ParsleyErrors.h"
+#include "ParsleyWriter.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#ifdef PARSLEY_WITH_ZLIB
+#include <zlib.h>
+#endif
+
+/*************************************************************************//*!
+*
+*   @brief Global allocation counters, fed by the replaced operator new.
+*
+****************************************************************************/
+
+namespace
+{
+    std::atomic<unsigned long long> allocCount(0);
+    std::atomic<unsigned long long> allocBytes(0);
+}
+
+// the replacements below pair malloc() with free(), but GCC sees
+// free() inlined into callers of operator new and warns regardless
+#if defined(__GNUC__) && ! defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(std::size_t size)
+{
+    ++allocCount;
+    allocBytes += size;
+    
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size)
+{ return ::operator new(size); }
+
+void operator delete(void* p) noexcept { std::free(p); }
+
+void operator delete[](void* p) noexcept { std::free(p); }
+
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+    
+    /*************************************************************************//*!
+    *
+    *   @brief A single measurement: wall time plus allocation deltas.
+    *
+    ****************************************************************************/
+    
+    struct Sample
+    {
+        double seconds = 0;
+        
+        unsigned long long allocs = 0;
+        unsigned long long bytes = 0;
+    };
+    
+    struct Corpus
+    {
+        std::string name;
+        std::string fname;
+        std::string searchTag;
+    };
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Peak resident set size of the process in MiB.
+    *
+    ****************************************************************************/
+    
+    double peakRssMiB()
+    {
+        rusage usage;
+        
+        getrusage(RUSAGE_SELF, &usage);
+        
+        // ru_maxrss is in KiB on Linux
+        return usage.ru_maxrss / 1024.0;
+    }
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Drops a file from the page cache, so the next read hits the disk.
+    *
+    *   @details Only a hint to the kernel, which may keep some pages anyway,
+    *            e.g. on tmpfs.
+    *
+    ****************************************************************************/
+    
+    void evictFromCache(const std::string& fname)
+    {
+        int fd = open(fname.c_str(), O_RDONLY);
+        
+        if (fd < 0) return;
+        
+        // dirty pages can't be dropped, so write them back first
+        fdatasync(fd);
+        
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        
+        close(fd);
+    }
+    
+    template <class F>
+    Sample measure(F func)
+    {
+        Sample sample;
+        
+        unsigned long long allocs = allocCount;
+        unsigned long long bytes = allocBytes;
+        
+        Clock::time_point start = Clock::now();
+        
+        func();
+        
+        sample.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        
+        sample.allocs = allocCount - allocs;
+        sample.bytes = allocBytes - bytes;
+        
+        return sample;
+    }
+    
+    std::size_t fileSize(const std::string& fname)
+    {
+        std::ifstream file(fname, std::ios::binary | std::ios::ate);
+        
+        if (! file.is_open()) throw FileOpenError();
+        
+        return static_cast<std::size_t>(file.tellg());
+    }
+    
+    std::size_t countNodes(const ParsleyNode* node)
+    {
+        std::size_t count = 0;
+        
+        // iterative pre-order walk, so deep documents don't blow the stack
+        while (node)
+        {
+            ++count;
+            
+            if (node->hasChildren())
+            { node = node->getFirstChild(); continue; }
+            
+            while (node && ! node->getNextSibling())
+                node = node->getParent();
+            
+            if (node) node = node->getNextSibling();
+        }
+        
+        return count;
+    }
+    
+    void writeFile(const std::string& fname, const std::string& contents)
+    {
+        std::ofstream file(fname, std::ios::binary);
+        
+        if (! file.is_open()) throw FileOpenError();
+        
+        file << contents;
+        
+        if (! file.good()) throw FileWriteError();
+    }
+    
+    const std::string header = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+    
+    std::string makeDeep(unsigned depth)
+    {
+        std::string s = header;
+        
+        for (unsigned i = 0; i < depth; ++i)
+            s += "<level depth=\"" + std::to_string(i) + "\">\n";
+        
+        s += "<leaf>bottom</leaf>\n";
+        
+        for (unsigned i = 0; i < depth; ++i)
+            s += "</level>\n";
+        
+        return s;
+    }
+    
+    std::string makeWide(unsigned count)
+    {
+        std::string s = header + "<root>\n";
+        
+        for (unsigned i = 0; i < count; ++i)
+            s += "\t<item>" + std::to_string(i) + "</item>\n";
+        
+        return s + "</root>\n";
+    }
+    
+    std::string makeAttrHeavy(unsigned count, unsigned attrs)
+    {
+        std::string s = header + "<root>\n";
+        
+        for (unsigned i = 0; i < count; ++i)
+        {
+            s += "\t<item";
+            
+            for (unsigned j = 0; j < attrs; ++j)
+                s += " attr" + std::to_string(j) + "=\"value" + std::to_string(i * j) + "\"";
+            
+            s += "></item>\n";
+        }
+        
+        return s + "</root>\n";
+    }
+    
+    std::string makeTextHeavy(unsigned count, unsigned textLength)
+    {
+        static const std::string words = "lorem ipsum dolor sit amet consectetur adipiscing elit ";
+        
+        std::string text;
+        
+        while (text.size() < textLength) text += words;
+        
+        std::string s = header + "<root>\n";
+        
+        for (unsigned i = 0; i < count; ++i)
+            s += "\t<para>" + text + "</para>\n";
+        
+        return s + "</root>\n";
+    }
+    
+    std::string makeLarge(std::size_t targetBytes)
+    {
+        std::string s = header + "<catalog>\n";
+        
+        for (unsigned i = 0; s.size() < targetBytes; ++i)
+        {
+            std::string id = std::to_string(i);
+            
+            // the band holds a '>', which must not end its tag
+            s += "\t<record id=\"" + id + "\" type=\"book\">\n"
+                 "\t\t<title>Title number " + id + "</title>\n"
+                 "\t\t<author>Author " + std::to_string(i % 997) + "</author>\n"
+                 "\t\t<price currency=\"EUR\" band='>" + std::to_string(i % 100 / 10 * 10) + "'>" + std::to_string(i % 100) + ".99</price>\n"
+                 "\t\t<tags><tag>fiction</tag><tag>paper</tag></tags>\n"
+                 "\t</record>\n";
+        }
+        
+        return s + "</catalog>\n";
+    }
+    
+    void printRow(const std::string& corpus,
+                  const std::string& op,
+                  const Sample& sample,
+                  std::size_t bytes,
+                  std::size_t nodes)
+    {
+        double mbs = bytes / (1024.0 * 1024.0) / sample.seconds;
+        double nps = nodes / sample.seconds;
+        
+        std::printf("%-14s %-24s %10.3f %10.2f %14.0f %12llu %14llu %10.1f\n",
+                    corpus.c_str(),
+                    op.c_str(),
+                    sample.seconds * 1000.0,
+                    mbs,
+                    nps,
+                    sample.allocs,
+                    sample.bytes,
+                    peakRssMiB());
+    }
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Runs every benchmark on a single corpus, reporting the fastest
+    *          of the given number of repetitions for each operation.
+    *
+    ****************************************************************************/
+    
+    void runCorpus(const Corpus& corpus, unsigned repetitions)
+    {
+        Parsley parser;
+        Parsley lazyParser;
+        Parsley checkingParser;
+        Parsley readAheadParser;
+        Parsley hashingParser;
+        
+        lazyParser.setLazy(true);
+        checkingParser.setValidateUtf8(true);
+        readAheadParser.setReadAhead(true);
+        hashingParser.setHashing(true);
+        
+        std::size_t bytes = fileSize(corpus.fname);
+        std::size_t nodes = 0;
+        
+        std::string outName = corpus.fname + ".out";
+        
+        Sample parseBest, lazyBest, checkedBest, hashedBest, coldBest, readAheadBest;
+        Sample saveBest, searchBest, rangeBest, cloneBest, deriveBest, deriveSaveBest, destroyBest;
+        
+        for (unsigned r = 0; r < repetitions; ++r)
+        {
+            ParsleyNode* root = 0;
+            
+            Sample parse = measure([&] { root = parser.parse(corpus.fname); });
+            
+            nodes = countNodes(root);
+            
+            std::size_t found = 0;
+            
+            Sample search = measure([&]
+            { found = root->getElementsByTagName(corpus.searchTag).size(); });
+            
+            std::size_t ranged = 0;
+            
+            // the same search, without collecting the matches
+            Sample range = measure([&]
+            {
+                for (ParsleyNode* node : root->getDescendantsByTagName(corpus.searchTag.c_str(), 1))
+                { if (node) ++ranged; }
+            });
+            
+            Sample save = measure([&] { parser.save(root, outName, false); });
+            
+            ParsleyNode* copy = 0;
+            
+            Sample clone = measure([&] { copy = root->clone(); });
+            
+            ParsleyTemplate tmpl{ParsleyDocument(ParsleyNode::NodePtr(copy))};
+            
+            // an instance with a single edit, dropped again
+            Sample derive = measure([&]
+            {
+                ParsleyDocument instance = tmpl.instantiate();
+                
+                instance.getRoot()->getFirstChild()->setData("edited");
+            });
+            
+            // an untouched instance, read in full by saving it
+            Sample deriveSave = measure([&]
+            {
+                ParsleyDocument instance = tmpl.instantiate();
+                
+                parser.save(instance.getRoot(), outName, false);
+            });
+            
+            Sample destroy = measure([&] { delete root; });
+            
+            // lazy parse, touching only the root's first child
+            Sample lazy = measure([&]
+            {
+                ParsleyNode* lazyRoot = lazyParser.parse(corpus.fname);
+                
+                lazyRoot->getFirstChild();
+                
+                delete lazyRoot;
+            });
+            
+            ParsleyNode* checkedRoot = 0;
+            
+            Sample checked = measure([&] { checkedRoot = checkingParser.parse(corpus.fname); });
+            
+            delete checkedRoot;
+            
+            ParsleyNode* hashedRoot = 0;
+            
+            Sample hashed = measure([&] { hashedRoot = hashingParser.parse(corpus.fname); });
+            
+            delete hashedRoot;
+            
+            ParsleyNode* coldRoot = 0;
+            
+            evictFromCache(corpus.fname);
+            
+            Sample cold = measure([&] { coldRoot = parser.parse(corpus.fname); });
+            
+            delete coldRoot;
+            
+            evictFromCache(corpus.fname);
+            
+            Sample readAhead = measure([&] { coldRoot = readAheadParser.parse(corpus.fname); });
+            
+            delete coldRoot;
+            
+            if (r == 0 || parse.seconds < parseBest.seconds) parseBest = parse;
+            if (r == 0 || lazy.seconds < lazyBest.seconds) lazyBest = lazy;
+            if (r == 0 || checked.seconds < checkedBest.seconds) checkedBest = checked;
+            if (r == 0 || hashed.seconds < hashedBest.seconds) hashedBest = hashed;
+            if (r == 0 || cold.seconds < coldBest.seconds) coldBest = cold;
+            if (r == 0 || readAhead.seconds < readAheadBest.seconds) readAheadBest = readAhead;
+            if (r == 0 || save.seconds < saveBest.seconds) saveBest = save;
+            if (r == 0 || search.seconds < searchBest.seconds) searchBest = search;
+            if (r == 0 || range.seconds < rangeBest.seconds) rangeBest = range;
+            if (r == 0 || clone.seconds < cloneBest.seconds) cloneBest = clone;
+            if (r == 0 || derive.seconds < deriveBest.seconds) deriveBest = derive;
+            if (r == 0 || deriveSave.seconds < deriveSaveBest.seconds) deriveSaveBest = deriveSave;
+            if (r == 0 || destroy.seconds < destroyBest.seconds) destroyBest = destroy;
+            
+            (void) found;
+            (void) ranged;
+        }
+        
+        printRow(corpus.name, "parse", parseBest, bytes, nodes);
+        printRow(corpus.name, "parse (lazy)", lazyBest, bytes, nodes);
+        printRow(corpus.name, "parse (validate UTF-8)", checkedBest, bytes, nodes);
+        printRow(corpus.name, "parse (hashing)", hashedBest, bytes, nodes);
+        printRow(corpus.name, "parse (cold)", coldBest, bytes, nodes);
+        printRow(corpus.name, "parse (cold, read-ahead)", readAheadBest, bytes, nodes);
+        printRow(corpus.name, "save", saveBest, bytes, nodes);
+        printRow(corpus.name, "getElementsByTagName", searchBest, bytes, nodes);
+        printRow(corpus.name, "range by tag name", rangeBest, bytes, nodes);
+        printRow(corpus.name, "clone", cloneBest, bytes, nodes);
+        printRow(corpus.name, "instantiate + edit", deriveBest, bytes, nodes);
+        printRow(corpus.name, "instantiate + save", deriveSaveBest, bytes, nodes);
+        printRow(corpus.name, "destroy", destroyBest, bytes, nodes);
+        
+        std::remove(outName.c_str());
+    }
+    
+#ifdef PARSLEY_WITH_ZLIB
+    
+    /*! Decompresses a gzip file into a string. */
+    std::string gunzip(const std::string& fname)
+    {
+        gzFile file = gzopen(fname.c_str(), "rb");
+        
+        if (! file) throw FileOpenError();
+        
+        std::string contents;
+        
+        char buffer[256 * 1024];
+        
+        int n;
+        
+        while ((n = gzread(file, buffer, sizeof(buffer))) > 0)
+            contents.append(buffer, n);
+        
+        gzclose(file);
+        
+        if (n < 0) throw FileReadError();
+        
+        return contents;
+    }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Parses a gzip-compressed copy of a corpus, once decompressing
+    *          it to a file first and once letting the parser decompress it
+    *          on its own thread while tokenizing.
+    *
+    ****************************************************************************/
+    
+    void runCompressed(const Corpus& corpus, unsigned repetitions)
+    {
+        const std::string gzName = corpus.fname + ".gz";
+        const std::string tmpName = corpus.fname + ".tmp";
+        
+        {
+            std::string contents = gunzip(corpus.fname);
+            
+            gzFile file = gzopen(gzName.c_str(), "wb6");
+            
+            if (! file) throw FileOpenError();
+            
+            gzwrite(file, contents.data(), static_cast<unsigned>(contents.size()));
+            
+            gzclose(file);
+        }
+        
+        std::size_t bytes = fileSize(corpus.fname);
+        std::size_t nodes = 0;
+        
+        Sample inflateBest, twoStepBest, pipelinedBest;
+        
+        for (unsigned r = 0; r < repetitions; ++r)
+        {
+            Parsley parser;
+            
+            Sample inflate = measure([&] { gunzip(gzName); });
+            
+            ParsleyNode* root = 0;
+            
+            Sample twoStep = measure([&]
+            {
+                writeFile(tmpName, gunzip(gzName));
+                
+                root = parser.parse(tmpName);
+            });
+            
+            nodes = countNodes(root);
+            
+            delete root;
+            
+            Sample pipelined = measure([&] { root = parser.parse(gzName); });
+            
+            delete root;
+            
+            if (r == 0 || inflate.seconds < inflateBest.seconds) inflateBest = inflate;
+            if (r == 0 || twoStep.seconds < twoStepBest.seconds) twoStepBest = twoStep;
+            if (r == 0 || pipelined.seconds < pipelinedBest.seconds) pipelinedBest = pipelined;
+        }
+        
+        printRow(corpus.name, "gunzip only", inflateBest, bytes, nodes);
+        printRow(corpus.name, "gunzip to file + parse", twoStepBest, bytes, nodes);
+        printRow(corpus.name, "parse (gzip)", pipelinedBest, bytes, nodes);
+        
+        std::remove(gzName.c_str());
+        std::remove(tmpName.c_str());
+    }
+    
+#endif
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Writes count small response documents, once by building node
+    *          trees and saving each to a file and once with a ParsleyWriter
+    *          handing them to a sink, as when sending to a socket.
+    *
+    ****************************************************************************/
+    
+    void runResponses(unsigned count, unsigned repetitions)
+    {
+        const std::string fname = "parsley_bench_response.xml";
+        
+        std::size_t bytes = 0;
+        std::size_t nodes = 6 * static_cast<std::size_t>(count);
+        
+        Sample buildBest, writeBest;
+        
+        for (unsigned r = 0; r < repetitions; ++r)
+        {
+            Parsley parser;
+            
+            Sample build = measure([&]
+            {
+                for (unsigned i = 0; i < count; ++i)
+                {
+                    std::string id = std::to_string(i);
+                    
+                    ParsleyNode* root = new ParsleyNode("record");
+                    root->addAttr("id", id);
+                    root->addAttr("type", "book");
+                    
+                    ParsleyNode* title = new ParsleyNode("title");
+                    title->setData("Title number " + id);
+                    root->appendChild(title);
+                    
+                    ParsleyNode* author = new ParsleyNode("author");
+                    author->setData("Author " + std::to_string(i % 997));
+                    root->appendChild(author);
+                    
+                    ParsleyNode* tags = new ParsleyNode("tags");
+                    
+                    ParsleyNode* tag = new ParsleyNode("tag");
+                    tag->setData("fiction");
+                    tags->appendChild(tag);
+                    
+                    tag = new ParsleyNode("tag");
+                    tag->setData("paper");
+                    tags->appendChild(tag);
+                    
+                    root->appendChild(tags);
+                    
+                    parser.save(root, fname);
+                }
+            });
+            
+            bytes = fileSize(fname) * count;
+            
+            std::size_t sent = 0;
+            
+            ParsleyWriter writer([&] (const char*, std::size_t size) { sent += size; });
+            
+            Sample write = measure([&]
+            {
+                for (unsigned i = 0; i < count; ++i)
+                {
+                    std::string id = std::to_string(i);
+                    
+                    writer.reset();
+                    
+                    writer.header()
+                          .startElement("record").attr("id", id).attr("type", "book")
+                          .startElement("title").text("Title number " + id).endElement()
+                          .startElement("author").text("Author " + std::to_string(i % 997)).endElement()
+                          .startElement("tags")
+                          .startElement("tag").text("fiction").endElement()
+                          .startElement("tag").text("paper").endElement()
+                          .endElement()
+                          .endElement()
+                          .finish();
+                }
+            });
+            
+            if (r == 0 || build.seconds < buildBest.seconds) buildBest = build;
+            if (r == 0 || write.seconds < writeBest.seconds) writeBest = write;
+            
+            (void) sent;
+        }
+        
+        printRow("responses", "build + save", buildBest, bytes, nodes);
+        printRow("responses", "write (to sink)", writeBest, bytes, nodes);
+        
+        std::remove(fname.c_str());
+    }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief The fields of a record of the large corpus.
+    *
+    ****************************************************************************/
+    
+    struct Record
+    {
+        unsigned long id = 0;
+        
+        std::string title;
+        std::string author;
+        
+        double price = 0;
+    };
+    
+    struct Catalog
+    {
+        std::vector<Record> records;
+    };
+    
+    Record extractRecord(ParsleyNode* node)
+    {
+        Record rec;
+        
+        rec.id = std::stoul(node->getAttr("id"));
+        rec.title = node->getElementsByTagName("title")[0]->getData();
+        rec.author = node->getElementsByTagName("author")[0]->getData();
+        rec.price = std::stod(node->getElementsByTagName("price")[0]->getData());
+        
+        return rec;
+    }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Reads the records of the large corpus into structs: by
+    *          parsing a tree and extracting them, with bind() and with
+    *          mapRecords() on every core.
+    *
+    ****************************************************************************/
+    
+    void runCatalog(const std::string& fname, unsigned repetitions)
+    {
+        static const ParsleySchema<Record> record = ParsleySchema<Record>()
+            .attribute("id", &Record::id)
+            .element("title", &Record::title)
+            .element("author", &Record::author)
+            .element("price", &Record::price);
+        
+        static const ParsleySchema<Catalog> catalog = ParsleySchema<Catalog>()
+            .element("record", &Catalog::records, record);
+        
+        std::size_t bytes = fileSize(fname);
+        std::size_t nodes = 0;
+        
+        Sample extractBest, bindBest, mapBest;
+        
+        unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+        
+        for (unsigned r = 0; r < repetitions; ++r)
+        {
+            Parsley parser;
+            
+            Catalog extracted;
+            
+            Sample extract = measure([&]
+            {
+                ParsleyDocument doc = parser.parseDocument(fname);
+                
+                for (ParsleyNode* node : doc.getRoot()->getChildren())
+                    extracted.records.push_back(extractRecord(node));
+            });
+            
+            Catalog bound;
+            
+            Sample bind = measure([&] { parser.bind(fname, catalog, bound); });
+            
+            Catalog mapped;
+            
+            Sample map = measure([&]
+            {
+                parser.mapRecords(fname, "record", extractRecord,
+                                  [&] (Record&& rec) { mapped.records.push_back(std::move(rec)); },
+                                  threads);
+            });
+            
+            nodes = extracted.records.size();
+            
+            if (bound.records.size() != nodes)
+                std::cerr << "bind found " << bound.records.size() << " of " << nodes << " records" << std::endl;
+            
+            if (mapped.records.size() != nodes)
+                std::cerr << "mapRecords found " << mapped.records.size() << " of " << nodes << " records" << std::endl;
+            
+            if (r == 0 || extract.seconds < extractBest.seconds) extractBest = extract;
+            if (r == 0 || bind.seconds < bindBest.seconds) bindBest = bind;
+            if (r == 0 || map.seconds < mapBest.seconds) mapBest = map;
+        }
+        
+        // nodes/s counts records here
+        printRow("large", "parse + extract", extractBest, bytes, nodes);
+        printRow("large", "bind (schema)", bindBest, bytes, nodes);
+        printRow("large", "map records (" + std::to_string(threads) + " thr)", mapBest, bytes, nodes);
+    }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Brings a parsed document up to date after a one byte edit in
+    *          the middle of its file, to compare with parsing it again.
+    *
+    ****************************************************************************/
+    
+    void runReparse(const std::string& contents, unsigned repetitions)
+    {
+        const std::string fname = "parsley_bench_edit.xml";
+        
+        std::string text = contents;
+        
+        writeFile(fname, text);
+        
+        Parsley parser;
+        
+        ParsleyDocument doc = parser.parseDocument(fname);
+        
+        // the title of the record in the middle of the file
+        std::size_t position = text.find("</title>", text.size() / 2);
+        
+        Sample best;
+        
+        for (unsigned r = 0; r < repetitions; ++r)
+        {
+            // alternately append a character to the title and remove it again
+            bool grow = r % 2 == 0;
+            
+            if (grow) text.insert(position, 1, '!');
+            
+            else text.erase(position, 1);
+            
+            writeFile(fname, text);
+            
+            Sample sample = measure([&]
+            {
+                parser.reparse(doc, fname, position, position + (grow ? 0 : 1), position + (grow ? 1 : 0));
+            });
+            
+            if (r == 0 || sample.seconds < best.seconds) best = sample;
+        }
+        
+        std::remove(fname.c_str());
+        
+        printRow("large", "reparse (one edit)", best, text.size(), countNodes(doc.getRoot()));
+    }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Edits a document all over, then compares walking it before
+    *          and after compacting it.
+    *
+    ****************************************************************************/
+    
+    void runCompaction(const std::string& fname, unsigned repetitions)
+    {
+        Parsley parser;
+        
+        Sample walkBest, compactBest, compactedBest;
+        
+        std::size_t bytes = 0, nodes = 0;
+        
+        ParsleyMemoryUsage edited, compacted;
+        
+        for (unsigned r = 0; r < repetitions; ++r)
+        {
+            ParsleyDocument doc = parser.parseDocument(fname);
+            
+            ParsleyNode* root = doc.getRoot();
+            
+            std::size_t records = root->getChildCount();
+            
+            // visit the records out of order, so that what the
+            // edits allocate is scattered across the tree
+            for (std::size_t i = 0; i < records; ++i)
+            {
+                ParsleyNode* record = root->getNthChild(i * 7919 % records);
+                
+                ParsleyNode* title = record->getFirstChild();
+                
+                title->setData(std::string(200, 'x'));
+                title->setData("Retitled");
+                
+                if (i % 2 == 0)
+                {
+                    ParsleyNode::NodePtr note(new ParsleyNode("note"));
+                    
+                    note->setData("Added after parsing, long enough to leave the string object");
+                    
+                    record->appendChild(std::move(note));
+                }
+            }
+            
+            edited = root->memoryUsage();
+            
+            Sample walk = measure([&] { nodes = countNodes(doc.getRoot()); });
+            
+            Sample compact = measure([&] { doc.compact(); });
+            
+            compacted = doc.getRoot()->memoryUsage();
+            
+            Sample compactedWalk = measure([&] { nodes = countNodes(doc.getRoot()); });
+            
+            if (r == 0 || walk.seconds < walkBest.seconds) walkBest = walk;
+            
+            if (r == 0 || compact.seconds < compactBest.seconds) compactBest = compact;
+            
+            if (r == 0 || compactedWalk.seconds < compactedBest.seconds) compactedBest = compactedWalk;
+            
+            bytes = edited.getTotalBytes();
+        }
+        
+        printRow("large", "walk (edited)", walkBest, bytes, nodes);
+        printRow("large", "compact", compactBest, bytes, nodes);
+        printRow("large", "walk (compacted)", compactedBest, bytes, nodes);
+        
+        std::printf("%-14s %-24s %10.1f MiB in %llu allocations, %.1f MiB slack\n",
+                    "large", "tree (edited)",
+                    edited.getTotalBytes() / (1024.0 * 1024.0),
+                    static_cast<unsigned long long>(edited.allocations),
+                    edited.slackBytes / (1024.0 * 1024.0));
+        
+        std::printf("%-14s %-24s %10.1f MiB in %llu allocations, %.1f MiB slack\n",
+                    "large", "tree (compacted)",
+                    compacted.getTotalBytes() / (1024.0 * 1024.0),
+                    static_cast<unsigned long long>(compacted.allocations),
+                    compacted.slackBytes / (1024.0 * 1024.0));
+    }
+    
+    
+    /*************************************************************************//*!
+    *
+    *   @brief Compares two hashed copies of a document, one of them edited
+    *          in the middle, by hash and with diff().
+    *
+    ****************************************************************************/
+    
+    void runDiff(const std::string& fname, unsigned repetitions)
+    {
+        Parsley parser;
+        
+        parser.setHashing(true);
+        
+        ParsleyDocument original = parser.parseDocument(fname);
+        ParsleyDocument edited = parser.parseDocument(fname);
+        
+        std::size_t bytes = fileSize(fname);
+        std::size_t nodes = countNodes(original.getRoot());
+        
+        ParsleyNode* record = edited.getRoot()->getNthChild(static_cast<unsigned>(edited.getRoot()->getChildCount() / 2));
+        
+        Sample equalBest, diffBest;
+        
+        for (unsigned r = 0; r < repetitions; ++r)
+        {
+            bool equal = true;
+            
+            // rehashes the path from the edit to the root
+            Sample compare = measure([&]
+            {
+                record->getFirstChild()->setData(r % 2 ? "Edited" : "Edited again");
+                
+                equal = original.getRoot()->isEqual(*edited.getRoot());
+            });
+            
+            std::size_t differences = 0;
+            
+            Sample diff = measure([&]
+            { differences = original.getRoot()->diff(*edited.getRoot()).size(); });
+            
+            if (r == 0 || compare.seconds < equalBest.seconds) equalBest = compare;
+            if (r == 0 || diff.seconds < diffBest.seconds) diffBest = diff;
+            
+            (void) equal;
+            (void) differences;
+        }
+        
+        printRow("large", "edit + isEqual", equalBest, bytes, nodes);
+        printRow("large", "diff (one edit)", diffBest, bytes, nodes);
+    }
+}
+
+int main(int argc, char * argv[])
+{
+    unsigned repetitions = 3;
+    unsigned scale = 1;
+    
+    std::vector<Corpus> corpora;
+    std::vector<std::string> generated;
+    
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg(argv[i]);
+        
+        if (arg == "-r" && i + 1 < argc)
+            repetitions = static_cast<unsigned>(std::atoi(argv[++i]));
+        
+        else if (arg == "-s" && i + 1 < argc)
+            scale = static_cast<unsigned>(std::atoi(argv[++i]));
+        
+        else
+        {
+            Corpus corpus = { arg, arg, "record" };
+            corpora.push_back(corpus);
+        }
+    }
+    
+    if (repetitions == 0) repetitions = 1;
+    
+    if (scale == 0) scale = 1;
+    
+    if (corpora.empty())
+    {
+        struct { const char* name; std::string contents; const char* searchTag; } synthetic[] =
+        {
+            { "deep",       makeDeep(1000 * scale),             "level"  },
+            { "wide",       makeWide(10000 * scale),            "item"   },
+            { "attr-heavy", makeAttrHeavy(2000 * scale, 32),    "item"   },
+            { "text-heavy", makeTextHeavy(1000 * scale, 4096),  "para"   },
+            { "large",      makeLarge(2 * 1024 * 1024 * scale), "record" }
+        };
+        
+        for (auto& s : synthetic)
+        {
+            std::string fname = std::string("parsley_bench_") + s.name + ".xml";
+            
+            writeFile(fname, s.contents);
+            
+            generated.push_back(fname);
+            
+            Corpus corpus = { s.name, fname, s.searchTag };
+            corpora.push_back(corpus);
+        }
+    }
+    
+    std::printf("%-14s %-24s %10s %10s %14s %12s %14s %10s\n",
+                "corpus", "operation", "ms", "MB/s", "nodes/s",
+                "allocs", "alloc bytes", "peak MiB");
+    
+    for (const Corpus& corpus : corpora)
+    {
+        try
+        {
+            runCorpus(corpus, repetitions);
+            
+#ifdef PARSLEY_WITH_ZLIB
+            runCompressed(corpus, repetitions);
+#endif
+        }
+        
+        catch (const std::exception& e)
+        { std::cerr << corpus.name << ": " << e.what() << std::endl; }
+    }
+    
+    runResponses(10000 * scale, repetitions);
+    
+    // the schema describes the synthetic records only
+    if (! generated.empty())
+    {
+        runCatalog("parsley_bench_large.xml", repetitions);
+        
+        runReparse(makeLarge(2 * 1024 * 1024 * scale), repetitions);
+        
+        runCompaction("parsley_bench_large.xml", repetitions);
+        
+        runDiff("parsley_bench_large.xml", repetitions);
+    }
+    
+    for (const std::string& fname : generated)
+        std::remove(fname.c_str());
+}